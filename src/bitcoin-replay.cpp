@@ -0,0 +1,304 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "main.h"
+#include "net.h"
+#include "noui.h"
+#include "txdb.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <algorithm>
+#include <map>
+#include <stdio.h>
+
+#include <boost/filesystem/operations.hpp>
+#include <boost/foreach.hpp>
+#include <boost/interprocess/sync/file_lock.hpp>
+
+/**
+ * duckcoin-replay feeds a log written by -capturemessages through the
+ * node's message processing, one message at a time, and reports how long
+ * each type of message took to process.
+ *
+ * Nothing goes over the network: every captured peer is played by a CNode
+ * without a socket, whose replies are thrown away. The clock is mocked to
+ * the time each message was received. Blocks that get accepted are stored
+ * and connected as usual, so it has to be run against a copy of the data
+ * directory: it refuses the default one, and one a node has locked.
+ */
+
+using namespace std;
+
+/** Processing times of one type of message */
+struct CCommandStats
+{
+    uint64_t nBytes;
+    vector<int64_t> vLatency; //!< in microseconds
+
+    CCommandStats() : nBytes(0) {}
+};
+
+static string HelpMessageReplay()
+{
+    string strUsage;
+    strUsage += _("Options:") + "\n";
+    strUsage += "  -?                     " + _("This help message") + "\n";
+    strUsage += "  -conf=<file>           " + strprintf(_("Specify configuration file (default: %s)"), "duckcoin.conf") + "\n";
+    strUsage += "  -datadir=<dir>         " + _("Specify data directory. Accepted blocks are written to it, so this must be a copy of a node's data directory, not the default one") + "\n";
+    strUsage += "  -dbcache=<n>           " + strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache) + "\n";
+    strUsage += "  -debug=<category>      " + _("Output debugging information (default: 0, supplying <category> is optional)") + "\n";
+    strUsage += "  -printtoconsole        " + _("Send trace/debug info to console instead of debug.log file") + "\n";
+    strUsage += "  -testnet               " + _("Use the test network") + "\n";
+    strUsage += "  -regtest               " + _("Enter regression test mode, which uses a special chain in which blocks can be "
+                                                "solved instantly. This is intended for regression testing tools and app development.") + "\n";
+    return strUsage;
+}
+
+static bool AppInitReplay(int argc, char* argv[], string& strFile)
+{
+    ParseParameters(argc, argv);
+    if (mapArgs.count("-?") || mapArgs.count("-h") || mapArgs.count("-help") || mapArgs.count("-version")) {
+        string strUsage = _("Duckcoin Core message replay version") + " " + FormatFullVersion() + "\n";
+        if (!mapArgs.count("-version")) {
+            strUsage += "\n" + _("Usage:") + "\n" +
+                  "  duckcoin-replay [options] [file]  " + strprintf(_("Replay captured messages (default file: %s in the data directory)"), "msgcapture.dat") + "\n";
+            strUsage += "\n" + HelpMessageReplay();
+        }
+        fprintf(stdout, "%s", strUsage.c_str());
+        return false;
+    }
+    if (!boost::filesystem::is_directory(GetDataDir(false))) {
+        fprintf(stderr, "Error: Specified data directory \"%s\" does not exist.\n", mapArgs["-datadir"].c_str());
+        return false;
+    }
+    try {
+        ReadConfigFile(mapArgs, mapMultiArgs);
+    } catch(std::exception &e) {
+        fprintf(stderr, "Error reading configuration file: %s\n", e.what());
+        return false;
+    }
+    if (!SelectParamsFromCommandLine()) {
+        fprintf(stderr, "Error: Invalid combination of -regtest and -testnet.\n");
+        return false;
+    }
+    fPrintToConsole = GetBoolArg("-printtoconsole", false);
+    fDebug = !mapMultiArgs["-debug"].empty();
+
+    // Replaying changes the chainstate, so keep away from the node's own data
+    boost::filesystem::path pathDefault = GetDefaultDataDir();
+    if (!mapArgs.count("-datadir") ||
+        (boost::filesystem::exists(pathDefault) && boost::filesystem::equivalent(GetDataDir(false), pathDefault))) {
+        fprintf(stderr, "Error: Replay writes to the data directory. Point -datadir at a copy of it instead of the default one.\n");
+        return false;
+    }
+    boost::filesystem::path pathLockFile = GetDataDir() / ".lock";
+    FILE* file = fopen(pathLockFile.string().c_str(), "a"); // empty lock file; created if it doesn't exist.
+    if (file) fclose(file);
+    static boost::interprocess::file_lock lock(pathLockFile.string().c_str());
+    if (!lock.try_lock()) {
+        fprintf(stderr, "Error: Cannot obtain a lock on data directory %s. Duckcoin Core is probably using it.\n", GetDataDir().string().c_str());
+        return false;
+    }
+
+    strFile = (GetDataDir() / "msgcapture.dat").string();
+    for (int i = 1; i < argc; i++)
+        if (!IsSwitchChar(argv[i][0]))
+            strFile = argv[i];
+    return true;
+}
+
+static bool LoadChainState()
+{
+    CDBCacheSizes cacheSizes = CalculateDBCacheSizes();
+    nCoinCacheSize = cacheSizes.nCoinCacheUsage / 300;
+
+    boost::filesystem::create_directories(GetDataDir() / "blocks");
+    pblocktree = new CBlockTreeDB(GetDBOptions("blockindexdb", cacheSizes.nBlockTreeDBCache));
+    pcoinsdbview = new CCoinsViewDB(GetDBOptions("chainstatedb", cacheSizes.nCoinDBCache));
+    pcoinsTip = new CCoinsViewCache(pcoinsdbview);
+    if (!LoadBlockIndex())
+        return error("%s: error loading block database", __func__);
+    if (!mapBlockIndex.empty() && mapBlockIndex.count(Params().HashGenesisBlock()) == 0)
+        return error("%s: incorrect or no genesis block found, wrong datadir for network?", __func__);
+    if (!InitBlockIndex())
+        return error("%s: error initializing block database", __func__);
+    return true;
+}
+
+/** A socketless stand-in for the captured peer, as if its connection had just been set up */
+static CNode* NewReplayNode(const CCapturedMessage& record)
+{
+    CNode* pnode = new CNode(INVALID_SOCKET, CAddress(), strprintf("replay-%d", record.nodeid), record.fInbound);
+    if (record.strCommand != "version") {
+        // The capture started after the handshake
+        pnode->nVersion = PROTOCOL_VERSION;
+        pnode->SetRecvVersion(PROTOCOL_VERSION);
+        pnode->fSuccessfullyConnected = true;
+        pnode->fRelayTxes = true;
+    }
+    return pnode;
+}
+
+/** Drop the node's replies, so a full send buffer never holds up processing */
+static void DiscardSendQueue(CNode* pnode)
+{
+    LOCK(pnode->cs_vSend);
+    pnode->vSendMsg.clear();
+    pnode->nSendSize = 0;
+    pnode->nSendOffset = 0;
+}
+
+/** Hand record to pnode as received bytes and process it; returns the time taken in microseconds */
+static int64_t ReplayMessage(CNode* pnode, const CCapturedMessage& record)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr(record.strCommand.c_str(), record.vPayload.size());
+    uint256 hash = Hash(record.vPayload.begin(), record.vPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    ss << hdr;
+    ss.write(record.vPayload.empty() ? NULL : &record.vPayload[0], record.vPayload.size());
+
+    SetMockTime(record.nTime / 1000000);
+
+    int64_t nLatency = 0;
+    {
+        LOCK(pnode->cs_vRecvMsg);
+        if (!pnode->ReceiveMsgBytes(&ss[0], ss.size())) {
+            pnode->fDisconnect = true;
+            return 0;
+        }
+        int64_t nStart = GetTimeMicros();
+        while (!pnode->fDisconnect && (!pnode->vRecvMsg.empty() || !pnode->vRecvGetData.empty())) {
+            if (!ProcessMessages(pnode))
+                pnode->fDisconnect = true;
+            DiscardSendQueue(pnode);
+        }
+        nLatency = GetTimeMicros() - nStart;
+    }
+
+    // Not timed, but the requests it makes shape how later messages are handled
+    {
+        LOCK(pnode->cs_vSend);
+        SendMessages(pnode, true);
+    }
+    DiscardSendQueue(pnode);
+    return nLatency;
+}
+
+static int64_t Percentile(const vector<int64_t>& vSorted, int nPercent)
+{
+    return vSorted[std::min(vSorted.size() - 1, vSorted.size() * nPercent / 100)];
+}
+
+static void PrintStats(const map<string, CCommandStats>& mapStats)
+{
+    fprintf(stdout, "%-12s %9s %12s %11s %11s %9s %9s %9s %9s\n",
+            "command", "count", "bytes", "total ms", "msgs/s", "mean us", "p50 us", "p99 us", "max us");
+    uint64_t nTotalCount = 0, nTotalBytes = 0;
+    int64_t nTotalTime = 0;
+    for (map<string, CCommandStats>::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it) {
+        vector<int64_t> vSorted = it->second.vLatency;
+        std::sort(vSorted.begin(), vSorted.end());
+        int64_t nTime = 0;
+        BOOST_FOREACH(int64_t nLatency, vSorted)
+            nTime += nLatency;
+        fprintf(stdout, "%-12s %9u %12u %11.1f %11.1f %9.1f %9d %9d %9d\n",
+                SanitizeString(it->first).c_str(), (unsigned int)vSorted.size(), (unsigned int)it->second.nBytes,
+                nTime / 1000.0, nTime ? vSorted.size() * 1000000.0 / nTime : 0.0, (double)nTime / vSorted.size(),
+                (int)Percentile(vSorted, 50), (int)Percentile(vSorted, 99), (int)vSorted.back());
+        nTotalCount += vSorted.size();
+        nTotalBytes += it->second.nBytes;
+        nTotalTime += nTime;
+    }
+    fprintf(stdout, "%-12s %9u %12u %11.1f %11.1f\n", "total", (unsigned int)nTotalCount, (unsigned int)nTotalBytes,
+            nTotalTime / 1000.0, nTotalTime ? nTotalCount * 1000000.0 / nTotalTime : 0.0);
+}
+
+static bool Replay(const string& strFile)
+{
+    FILE* file = fopen(strFile.c_str(), "rb");
+    if (!file)
+        return error("%s: failed to open %s", __func__, strFile);
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+    CCaptureFileHeader header;
+    try {
+        filein >> header;
+    } catch (const std::exception&) {
+        return error("%s: %s is empty or truncated", __func__, strFile);
+    }
+    if (!header.IsValid())
+        return error("%s: %s is not a message capture from this network", __func__, strFile);
+
+    map<NodeId, CNode*> mapNodes;
+    map<string, CCommandStats> mapStats;
+    unsigned int nSkipped = 0;
+    while (true) {
+        CCapturedMessage record;
+        try {
+            filein >> record;
+        } catch (const std::exception&) {
+            if (!feof(filein.Get()))
+                LogPrintf("%s: stopping at a truncated or corrupt record\n", __func__);
+            break;
+        }
+
+        // A node restart reuses peer ids, but a new connection always starts with version
+        CNode*& pnode = mapNodes[record.nodeid];
+        if (pnode && record.strCommand == "version" && pnode->nVersion != 0) {
+            delete pnode;
+            pnode = NULL;
+        }
+        if (!pnode)
+            pnode = NewReplayNode(record);
+        if (pnode->fDisconnect) {
+            // The original peer would have been disconnected by now as well
+            nSkipped++;
+            continue;
+        }
+
+        int64_t nLatency = ReplayMessage(pnode, record);
+        CCommandStats& stats = mapStats[record.strCommand];
+        stats.nBytes += record.vPayload.size();
+        stats.vLatency.push_back(nLatency);
+    }
+
+    for (map<NodeId, CNode*>::iterator it = mapNodes.begin(); it != mapNodes.end(); ++it)
+        delete it->second;
+
+    PrintStats(mapStats);
+    if (nSkipped)
+        fprintf(stdout, "%u messages skipped from peers that got disconnected\n", nSkipped);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    SetupEnvironment();
+    noui_connect();
+
+    string strFile;
+    bool fRet = false;
+    try {
+        if (!AppInitReplay(argc, argv, strFile))
+            return EXIT_FAILURE;
+        RegisterNodeSignals(GetNodeSignals());
+        if (LoadChainState())
+            fRet = Replay(strFile);
+        UnregisterNodeSignals(GetNodeSignals());
+        delete pcoinsTip;
+        delete pcoinsdbview;
+        delete pblocktree;
+    } catch (std::exception& e) {
+        PrintExceptionContinue(&e, "Replay()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "Replay()");
+    }
+    if (!fRet)
+        fprintf(stderr, "Error: replay failed, see debug.log\n");
+    return fRet ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -127,6 +127,9 @@ private:
     }
 
 public:
+    //! Mutex to ensure only one concurrent CCheckQueueControl
+    boost::mutex ControlMutex;
+
     //! Create a new check queue
     CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
 
@@ -171,7 +174,8 @@ public:
 
 /** 
  * RAII-style controller object for a CCheckQueue that guarantees the passed
- * queue is finished before continuing.
+ * queue is finished before continuing. Controllers for the same queue wait
+ * for each other, so it can be shared by threads that do not hold cs_main.
  */
 template <typename T>
 class CCheckQueueControl
@@ -179,12 +183,15 @@ class CCheckQueueControl
 private:
     CCheckQueue<T>* pqueue;
     bool fDone;
+    boost::unique_lock<boost::mutex> lockControl;
 
 public:
     CCheckQueueControl(CCheckQueue<T>* pqueueIn) : pqueue(pqueueIn), fDone(false)
     {
         // passed queue is supposed to be unused, or NULL
         if (pqueue != NULL) {
+            boost::unique_lock<boost::mutex> lock(pqueue->ControlMutex);
+            lockControl.swap(lock);
             bool isIdle = pqueue->IsIdle();
             assert(isIdle);
         }
@@ -89,10 +89,15 @@ typedef u_int SOCKET;
 #define THREAD_PRIORITY_ABOVE_NORMAL    (-2)
 #endif
 
+// Linux has epoll, which unlike select() does not limit socket numbers to FD_SETSIZE
+#if defined(__linux__)
+#define USE_EPOLL
+#endif
+
 size_t strnlen_int( const char *start, size_t max_len);
 
 bool static inline IsSelectableSocket(SOCKET s) {
-#ifdef WIN32
+#if defined(WIN32) || defined(USE_EPOLL)
     return true;
 #else
     return (s < FD_SETSIZE);
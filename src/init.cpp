@@ -50,6 +50,8 @@ using namespace std;
 CWallet* pwalletMain = NULL;
 #endif
 bool fFeeEstimatesInitialized = false;
+static CCriticalSection cs_dumpMempoolLater;
+static bool fDumpMempoolLater = false; //! protected by cs_dumpMempoolLater
 
 #ifdef WIN32
 // Win32 LevelDB doesn't use filedescriptors, and the ones used for
@@ -132,7 +134,6 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB *pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
 
 void Shutdown()
@@ -158,6 +159,12 @@ void Shutdown()
     StopNode();
     UnregisterNodeSignals(GetNodeSignals());
 
+    {
+        LOCK(cs_dumpMempoolLater);
+        if (fDumpMempoolLater)
+            DumpMempool(mempool);
+    }
+
     if (fFeeEstimatesInitialized)
     {
         boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
@@ -241,10 +248,13 @@ std::string HelpMessage(HelpMessageMode mode)
     string strUsage = _("Options:") + "\n";
     strUsage += "  -?                     " + _("This help message") + "\n";
     strUsage += "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)") + "\n";
-    strUsage += "  -alerts                " + strprintf(_("Receive and display P2P network alerts (default: %u)"), DEFAULT_ALERTS);
+    strUsage += "  -alerts                " + strprintf(_("Receive and display P2P network alerts (default: %u)"), DEFAULT_ALERTS) + "\n";
+    strUsage += "  -blockindexdbcache=<n> " + _("Set the block index database cache size in megabytes, taken out of -dbcache (default: derived from -dbcache)") + "\n";
     strUsage += "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n";
+    strUsage += "  -chainstatedbcache=<n> " + _("Set the chainstate database cache size in megabytes, taken out of -dbcache (default: derived from -dbcache)") + "\n";
     strUsage += "  -checkblocks=<n>       " + strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), 288) + "\n";
     strUsage += "  -checklevel=<n>        " + strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), 3) + "\n";
+    strUsage += "  -compactidle=<n>       " + strprintf(_("Compact the chainstate database in the background after <n> seconds without a new block (0 = off, default: %u)"), DEFAULT_COMPACT_IDLE) + "\n";
     strUsage += "  -conf=<file>           " + strprintf(_("Specify configuration file (default: %s)"), "duckcoin.conf") + "\n";
     if (mode == HMM_BITBREADCRUMBD)
     {
@@ -255,8 +265,11 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -dbcache=<n>           " + strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache) + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + " " + _("on startup") + "\n";
+    strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
     strUsage += "  -maxorphantx=<n>       " + strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS) + "\n";
+    strUsage += "  -maxorphantxsize=<n>   " + strprintf(_("Keep at most <n> kilobytes of unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE) + "\n";
     strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
+    strUsage += "  -persistmempool        " + strprintf(_("Whether to save the mempool on shutdown and load on restart (default: %u)"), 1) + "\n";
 #ifndef WIN32
     strUsage += "  -pid=<file>            " + strprintf(_("Specify pid file (default: %s)"), "duckcoind.pid") + "\n";
 #endif
@@ -271,21 +284,27 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -banscore=<n>          " + strprintf(_("Threshold for disconnecting misbehaving peers (default: %u)"), 100) + "\n";
     strUsage += "  -bantime=<n>           " + strprintf(_("Number of seconds to keep misbehaving peers from reconnecting (default: %u)"), 86400) + "\n";
     strUsage += "  -bind=<addr>           " + _("Bind to given address and always listen on it. Use [host]:port notation for IPv6") + "\n";
+    strUsage += "  -capturemaxsize=<n>    " + strprintf(_("Stop capturing messages once msgcapture.dat is <n> MB (default: %u)"), DEFAULT_CAPTURE_MAX_SIZE) + "\n";
+    strUsage += "  -capturemessages       " + _("Append every message received from peers to msgcapture.dat in the data directory, for replay with duckcoin-replay (default: 0)") + "\n";
+    strUsage += "  -compactblocks         " + strprintf(_("Relay new blocks as compact blocks with peers that support them (default: %u)"), DEFAULT_COMPACT_BLOCKS) + "\n";
     strUsage += "  -connect=<ip>          " + _("Connect only to the specified node(s)") + "\n";
     strUsage += "  -discover              " + _("Discover own IP address (default: 1 when listening and no -externalip)") + "\n";
     strUsage += "  -dns                   " + _("Allow DNS lookups for -addnode, -seednode and -connect") + " " + _("(default: 1)") + "\n";
     strUsage += "  -dnsseed               " + _("Query for peer addresses via DNS lookup, if low on addresses (default: 1 unless -connect)") + "\n";
     strUsage += "  -externalip=<ip>       " + _("Specify your own public address") + "\n";
+    strUsage += "  -feefilter             " + strprintf(_("Tell peers not to announce transactions below our mempool minimum fee rate (default: %u)"), DEFAULT_FEEFILTER) + "\n";
     strUsage += "  -forcednsseed          " + strprintf(_("Always query for peer addresses via DNS lookup (default: %u)"), 0) + "\n";
     strUsage += "  -listen                " + _("Accept connections from outside (default: 1 if no -proxy or -connect)") + "\n";
     strUsage += "  -maxconnections=<n>    " + strprintf(_("Maintain at most <n> connections to peers (default: %u)"), 125) + "\n";
     strUsage += "  -maxreceivebuffer=<n>  " + strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), 5000) + "\n";
     strUsage += "  -maxsendbuffer=<n>     " + strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), 1000) + "\n";
+    strUsage += "  -msghandlerthreads=<n> " + strprintf(_("Number of threads processing peer messages, each serving a fixed share of the peers (1 to %d, default: %d)"), MAX_MSGHANDLER_THREADS, DEFAULT_MSGHANDLER_THREADS) + "\n";
     strUsage += "  -onion=<ip:port>       " + strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy") + "\n";
     strUsage += "  -onlynet=<net>         " + _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)") + "\n";
     strUsage += "  -permitbaremultisig    " + strprintf(_("Relay non-P2SH multisig (default: %u)"), 1) + "\n";
     strUsage += "  -port=<port>           " + strprintf(_("Listen for connections on <port> (default: %u or testnet: %u)"), 20811, 30811) + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through SOCKS5 proxy") + "\n";
+    strUsage += "  -relaycachesize=<n>    " + strprintf(_("Keep up to <n> MB of serialized transactions and recent blocks to serve peers (default: %u)"), DEFAULT_RELAY_CACHE_SIZE) + "\n";
     strUsage += "  -seednode=<ip>         " + _("Connect to a node to retrieve peer addresses, and disconnect") + "\n";
     strUsage += "  -timeout=<n>           " + strprintf(_("Specify connection timeout in milliseconds (minimum: 1, default: %d)"), DEFAULT_CONNECT_TIMEOUT) + "\n";
 #ifdef USE_UPNP
@@ -348,9 +367,16 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -logtimestamps         " + strprintf(_("Prepend debug output with timestamp (default: %u)"), 1) + "\n";
     if (GetBoolArg("-help-debug", false))
     {
+        strUsage += "  -limitancestorcount=<n> " + strprintf(_("Do not accept transactions with more than <n> unconfirmed ancestors (default: %u)"), DEFAULT_ANCESTOR_LIMIT) + "\n";
+        strUsage += "  -limitancestorsize=<n> " + strprintf(_("Do not accept transactions whose size with all unconfirmed ancestors exceeds <n> kilobytes (default: %u)"), DEFAULT_ANCESTOR_SIZE_LIMIT) + "\n";
+        strUsage += "  -limitdescendantcount=<n> " + strprintf(_("Do not accept transactions that would give an unconfirmed transaction more than <n> descendants (default: %u)"), DEFAULT_DESCENDANT_LIMIT) + "\n";
+        strUsage += "  -limitdescendantsize=<n> " + strprintf(_("Do not accept transactions that would make an unconfirmed transaction with its descendants exceed <n> kilobytes (default: %u)"), DEFAULT_DESCENDANT_SIZE_LIMIT) + "\n";
         strUsage += "  -limitfreerelay=<n>    " + strprintf(_("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default:%u)"), 15) + "\n";
         strUsage += "  -relaypriority         " + strprintf(_("Require high priority for relaying free or low-fee transactions (default:%u)"), 1) + "\n";
         strUsage += "  -maxsigcachesize=<n>   " + strprintf(_("Limit size of signature cache to <n> entries (default: %u)"), 50000) + "\n";
+        strUsage += "  -<db>bloombits=<n>     " + strprintf(_("Bloom filter bits per key for database <db> (blockindexdb or chainstatedb, 0 = none, default: %u)"), CLevelDBOptions().nBloomBits) + "\n";
+        strUsage += "  -<db>compression       " + strprintf(_("Compress database <db> (blockindexdb or chainstatedb, default: %u)"), CLevelDBOptions().fCompression) + "\n";
+        strUsage += "  -<db>writebuffer=<n>   " + _("Write buffer size in megabytes for database <db> (blockindexdb or chainstatedb, default: a quarter of its cache)") + "\n";
     }
     strUsage += "  -minrelaytxfee=<amt>   " + strprintf(_("Fees (in DUK/Kb) smaller than this are considered zero fee for relaying (default: %s)"), FormatMoney(::minRelayTxFee.GetFeePerK())) + "\n";
     strUsage += "  -printtoconsole        " + _("Send trace/debug info to console instead of debug.log file") + "\n";
@@ -486,6 +512,12 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
         LogPrintf("Stopping after block import\n");
         StartShutdown();
     }
+
+    if (GetBoolArg("-persistmempool", true)) {
+        LoadMempool(mempool);
+        LOCK(cs_dumpMempoolLater);
+        fDumpMempoolLater = !ShutdownRequested();
+    }
 }
 
 /** Sanity checks
@@ -634,9 +666,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
 
     // Make sure enough file descriptors are available
-    int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
+#ifndef USE_EPOLL
+    // select() can't watch sockets numbered FD_SETSIZE or above
+    int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+#endif
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -758,6 +793,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     nMaxDatacarrierBytes = GetArg("-datacarriersize", nMaxDatacarrierBytes);
 
     fAlerts = GetBoolArg("-alerts", DEFAULT_ALERTS);
+    fCompactBlocks = GetBoolArg("-compactblocks", DEFAULT_COMPACT_BLOCKS);
 
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
 
@@ -1001,18 +1037,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
 
     // cache size calculations
-    size_t nTotalCache = (GetArg("-dbcache", nDefaultDbCache) << 20);
-    if (nTotalCache < (nMinDbCache << 20))
-        nTotalCache = (nMinDbCache << 20); // total cache cannot be less than nMinDbCache
-    else if (nTotalCache > (nMaxDbCache << 20))
-        nTotalCache = (nMaxDbCache << 20); // total cache cannot be greater than nMaxDbCache
-    size_t nBlockTreeDBCache = nTotalCache / 8;
-    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false))
-        nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
-    nTotalCache -= nBlockTreeDBCache;
-    size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
-    nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    CDBCacheSizes cacheSizes = CalculateDBCacheSizes();
+    size_t nBlockTreeDBCache = cacheSizes.nBlockTreeDBCache;
+    size_t nCoinDBCache = cacheSizes.nCoinDBCache;
+    nCoinCacheSize = cacheSizes.nCoinCacheUsage / 300; // coins in memory require around 300 bytes
+    LogPrintf("Cache configuration: block index database %.1fMiB, chainstate database %.1fMiB, in-memory coins %.1fMiB\n",
+        nBlockTreeDBCache * (1.0 / 1024 / 1024), nCoinDBCache * (1.0 / 1024 / 1024), cacheSizes.nCoinCacheUsage * (1.0 / 1024 / 1024));
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -1030,8 +1060,8 @@ bool AppInit2(boost::thread_group& threadGroup)
                 delete pcoinscatcher;
                 delete pblocktree;
 
-                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
-                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
+                pblocktree = new CBlockTreeDB(GetDBOptions("blockindexdb", nBlockTreeDBCache), false, fReindex);
+                pcoinsdbview = new CCoinsViewDB(GetDBOptions("chainstatedb", nCoinDBCache), false, fReindex);
                 pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
 
@@ -1265,6 +1295,8 @@ bool AppInit2(boost::thread_group& threadGroup)
             vImportFiles.push_back(strFile);
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
+    if (GetArg("-compactidle", DEFAULT_COMPACT_IDLE) > 0)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "compact", &ThreadCompactChainstate));
     if (chainActive.Tip() == NULL) {
         LogPrintf("Waiting for genesis block to be imported...\n");
         while (!fRequestShutdown && chainActive.Tip() == NULL)
@@ -1290,7 +1322,9 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("mapAddressBook.size() = %u\n",  pwalletMain ? pwalletMain->mapAddressBook.size() : 0);
 #endif
 
-    StartNode(threadGroup);
+    std::string strNodeError;
+    if (!StartNode(threadGroup, strNodeError))
+        return InitError(strNodeError);
 
 #ifdef ENABLE_WALLET
     // Generate coins in the background
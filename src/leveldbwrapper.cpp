@@ -27,14 +27,14 @@ void HandleError(const leveldb::Status& status) throw(leveldb_error)
     throw leveldb_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+static leveldb::Options GetOptions(const CLevelDBOptions& dbOptions)
 {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    options.block_cache = leveldb::NewLRUCache(dbOptions.GetBlockCacheSize());
+    options.write_buffer_size = dbOptions.GetWriteBufferSize();
+    options.filter_policy = dbOptions.nBloomBits > 0 ? leveldb::NewBloomFilterPolicy(dbOptions.nBloomBits) : NULL;
+    options.compression = dbOptions.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.max_open_files = dbOptions.nMaxOpenFiles;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -43,14 +43,24 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe)
+CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe) : dbOptions(nCacheSize)
+{
+    Open(path, fMemory, fWipe);
+}
+
+CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, const CLevelDBOptions& dbOptionsIn, bool fMemory, bool fWipe) : dbOptions(dbOptionsIn)
+{
+    Open(path, fMemory, fWipe);
+}
+
+void CLevelDBWrapper::Open(const boost::filesystem::path& path, bool fMemory, bool fWipe)
 {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(dbOptions);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -87,3 +97,26 @@ bool CLevelDBWrapper::WriteBatch(CLevelDBBatch& batch, bool fSync) throw(leveldb
     HandleError(status);
     return true;
 }
+
+std::string CLevelDBWrapper::GetProperty(const std::string& strName) const
+{
+    std::string strValue;
+    if (!pdb->GetProperty(strName, &strValue))
+        return "";
+    return strValue;
+}
+
+uint64_t CLevelDBWrapper::GetApproximateSize() const
+{
+    // All keys start with a single type character, so this range covers everything
+    leveldb::Range range("", "\xff");
+    uint64_t nSize = 0;
+    pdb->GetApproximateSizes(&range, 1, &nSize);
+    return nSize;
+}
+
+void CLevelDBWrapper::CompactRange(const std::string& strBegin, const std::string& strEnd)
+{
+    leveldb::Slice slBegin(strBegin), slEnd(strEnd);
+    pdb->CompactRange(&slBegin, &slEnd);
+}
@@ -24,6 +24,26 @@ public:
 
 void HandleError(const leveldb::Status& status) throw(leveldb_error);
 
+/** Tuning for a single LevelDB database */
+struct CLevelDBOptions
+{
+    //! Memory budget: half goes to the block cache, a quarter to each of the two write buffers
+    size_t nCacheSize;
+    //! Write buffer size in bytes, 0 to derive it from nCacheSize
+    size_t nWriteBufferSize;
+    //! Bloom filter bits per key, 0 to disable the filter
+    int nBloomBits;
+    //! Snappy-compress table blocks (only effective if LevelDB was built with Snappy)
+    bool fCompression;
+    int nMaxOpenFiles;
+
+    explicit CLevelDBOptions(size_t nCacheSizeIn = 0) : nCacheSize(nCacheSizeIn), nWriteBufferSize(0), nBloomBits(10), fCompression(false), nMaxOpenFiles(64) {}
+
+    size_t GetBlockCacheSize() const { return nCacheSize / 2; }
+    //! Up to two write buffers may be held in memory simultaneously
+    size_t GetWriteBufferSize() const { return nWriteBufferSize ? nWriteBufferSize : nCacheSize / 4; }
+};
+
 /** Batch of changes queued to be written to a CLevelDBWrapper */
 class CLevelDBBatch
 {
@@ -61,12 +81,62 @@ public:
     }
 };
 
+/** Iterator over a CLevelDBWrapper whose keys and values are read in place */
+class CLevelDBIterator
+{
+private:
+    leveldb::Iterator *piter;
+
+    // Disallow copies
+    CLevelDBIterator(const CLevelDBIterator&);
+    CLevelDBIterator& operator=(const CLevelDBIterator&);
+
+public:
+    explicit CLevelDBIterator(leveldb::Iterator *piterIn) : piter(piterIn) {}
+    ~CLevelDBIterator() { delete piter; }
+
+    bool Valid() const { return piter->Valid(); }
+    void SeekToFirst() { piter->SeekToFirst(); }
+    void Next() { piter->Next(); }
+
+    template <typename K>
+    void Seek(const K& key)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(ssKey.GetSerializeSize(key));
+        ssKey << key;
+        piter->Seek(leveldb::Slice(&ssKey[0], ssKey.size()));
+    }
+
+    /** Reader over the current key; valid until the iterator moves */
+    CDataReader GetKey() const
+    {
+        leveldb::Slice slKey = piter->key();
+        return CDataReader(slKey.data(), slKey.size(), SER_DISK, CLIENT_VERSION);
+    }
+
+    /** Reader over the current value; valid until the iterator moves */
+    CDataReader GetValue() const
+    {
+        leveldb::Slice slValue = piter->value();
+        return CDataReader(slValue.data(), slValue.size(), SER_DISK, CLIENT_VERSION);
+    }
+
+    unsigned int GetValueSize() const
+    {
+        return piter->value().size();
+    }
+};
+
 class CLevelDBWrapper
 {
 private:
     //! custom environment this database is using (may be NULL in case of default environment)
     leveldb::Env* penv;
 
+    //! tuning this database was opened with
+    CLevelDBOptions dbOptions;
+
     //! database options used
     leveldb::Options options;
 
@@ -85,10 +155,24 @@ private:
     //! the database itself
     leveldb::DB* pdb;
 
+    void Open(const boost::filesystem::path& path, bool fMemory, bool fWipe);
+
 public:
     CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CLevelDBWrapper(const boost::filesystem::path& path, const CLevelDBOptions& dbOptionsIn, bool fMemory = false, bool fWipe = false);
     ~CLevelDBWrapper();
 
+    const CLevelDBOptions& GetDBOptions() const { return dbOptions; }
+
+    /** Return a LevelDB property such as "leveldb.stats", or an empty string if it is unknown */
+    std::string GetProperty(const std::string& strName) const;
+
+    /** Approximate number of bytes of file system space used by the whole key range */
+    uint64_t GetApproximateSize() const;
+
+    /** Compact the raw key range [strBegin, strEnd) to the bottom level; blocks until done */
+    void CompactRange(const std::string& strBegin, const std::string& strEnd);
+
     template <typename K, typename V>
     bool Read(const K& key, V& value) const throw(leveldb_error)
     {
@@ -106,7 +190,7 @@ public:
             HandleError(status);
         }
         try {
-            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            CDataReader ssValue(strValue.data(), strValue.size(), SER_DISK, CLIENT_VERSION);
             ssValue >> value;
         } catch (const std::exception&) {
             return false;
@@ -163,10 +247,9 @@ public:
         return WriteBatch(batch, true);
     }
 
-    // not exactly clean encapsulation, but it's easiest for now
-    leveldb::Iterator* NewIterator()
+    CLevelDBIterator* NewIterator() const
     {
-        return pdb->NewIterator(iteroptions);
+        return new CLevelDBIterator(pdb->NewIterator(iteroptions));
     }
 };
 
@@ -16,6 +16,7 @@
 #include "pow.h"
 #include "txdb.h"
 #include "txmempool.h"
+#include "txrequest.h"
 #include "ui_interface.h"
 #include "util.h"
 #include "utilmoneystr.h"
@@ -54,6 +55,7 @@ bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
 unsigned int nCoinCacheSize = 5000;
 bool fAlerts = DEFAULT_ALERTS;
+bool fCompactBlocks = DEFAULT_COMPACT_BLOCKS;
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for relaying and mining) */
 CFeeRate minRelayTxFee = CFeeRate(DEFAULT_TX_FEE);
@@ -61,13 +63,24 @@ CFeeRate minRelayTxFee = CFeeRate(DEFAULT_TX_FEE);
 CTxMemPool mempool(::minRelayTxFee);
 
 struct COrphanTx {
-    CTransaction tx;
+    CTransactionRef tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nTxSize;
 };
 map<uint256, COrphanTx> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+map<COutPoint, set<uint256> > mapOrphanTransactionsByPrev;
 void EraseOrphansFor(NodeId peer);
 
+/** Orphans announced by one peer and the bytes they take up */
+struct COrphanPeerUsage {
+    set<uint256> setOrphans;
+    size_t nBytes;
+    COrphanPeerUsage() : nBytes(0) {}
+};
+static map<NodeId, COrphanPeerUsage> mapOrphanPeerUsage;
+static size_t nOrphanTransactionsBytes = 0;
+
 static void CheckBlockIndex();
 
 /** Constant stuff for coinbase transactions we create: */
@@ -145,11 +158,126 @@ namespace {
     /** Number of preferable block download peers. */
     int nPreferredDownload = 0;
 
+    /** Which peer to ask for which announced transaction, and when. Protected by cs_main. */
+    CTxRequestTracker txrequest(MAX_PEER_TX_ANNOUNCEMENTS, MAX_PEER_TX_IN_FLIGHT, TX_REQUEST_TIMEOUT * 1000000LL);
+
     /** Dirty block index entries. */
     set<CBlockIndex*> setDirtyBlockIndex;
 
     /** Dirty block file entries. */
     set<int> setDirtyFileInfo;
+
+    /**
+     * Appends to blk?????.dat or rev?????.dat files through a single
+     * long-lived, fully buffered FILE*, instead of an fopen/fwrite/fclose
+     * cycle per block. Nothing is synced until Commit(), which is only called
+     * from FlushBlockFile: when leaving a block file and when the chain state
+     * is flushed. Protected by cs_LastBlockFile.
+     */
+    class CBlockFileWriter
+    {
+    private:
+        FILE* (*pOpenFile)(const CDiskBlockPos&, bool);
+        FILE *file;
+        int nFile;
+        bool fDirty;
+        //! Files written to since the last Commit() that are no longer open
+        set<int> setUnsynced;
+        std::vector<char> vBuffer;
+
+    public:
+        CBlockFileWriter(FILE* (*pOpenFileIn)(const CDiskBlockPos&, bool)) : pOpenFile(pOpenFileIn), file(NULL), nFile(-1), fDirty(false) {}
+
+        ~CBlockFileWriter()
+        {
+            Close();
+        }
+
+        /** Return the open handle for pos.nFile, positioned at pos.nPos. Ownership stays with the writer. */
+        FILE* Get(const CDiskBlockPos &pos)
+        {
+            if (pos.IsNull())
+                return NULL;
+            if (file && nFile != pos.nFile)
+                Close();
+            if (!file) {
+                file = pOpenFile(CDiskBlockPos(pos.nFile, 0), false);
+                if (!file)
+                    return NULL;
+                nFile = pos.nFile;
+                vBuffer.resize(BLOCKFILE_WRITE_BUFFER_SIZE);
+                setvbuf(file, &vBuffer[0], _IOFBF, vBuffer.size());
+            }
+            // Appends are sequential, so this normally avoids an fseek (which would flush the buffer).
+            if (ftell(file) != (long)pos.nPos && fseek(file, pos.nPos, SEEK_SET)) {
+                LogPrintf("Unable to seek to position %u of file %i\n", pos.nPos, pos.nFile);
+                Close();
+                return NULL;
+            }
+            fDirty = true;
+            return file;
+        }
+
+        /** Pre-allocate nLength bytes of pos.nFile starting at pos.nPos. */
+        bool Allocate(const CDiskBlockPos &pos, unsigned int nLength)
+        {
+            FILE *fileAlloc = Get(pos);
+            if (!fileAlloc)
+                return false;
+            // AllocateFileRange works on the descriptor, below stdio's buffer
+            fflush(fileAlloc);
+            AllocateFileRange(fileAlloc, pos.nPos, nLength);
+            fseek(fileAlloc, pos.nPos, SEEK_SET);
+            return true;
+        }
+
+        /** Hand buffered data for nFileIn to the OS, so that other handles can read it. */
+        void Flush(int nFileIn)
+        {
+            if (file && nFile == nFileIn)
+                fflush(file);
+        }
+
+        bool Truncate(int nFileIn, unsigned int nSize)
+        {
+            FILE *fileTruncate = Get(CDiskBlockPos(nFileIn, 0));
+            if (!fileTruncate)
+                return false;
+            fflush(fileTruncate);
+            return TruncateFile(fileTruncate, nSize);
+        }
+
+        /** Sync everything written since the last call. */
+        void Commit()
+        {
+            if (file && fDirty)
+                FileCommit(file);
+            fDirty = false;
+            for (set<int>::const_iterator it = setUnsynced.begin(); it != setUnsynced.end(); it++) {
+                FILE *fileOld = pOpenFile(CDiskBlockPos(*it, 0), false);
+                if (fileOld) {
+                    FileCommit(fileOld);
+                    fclose(fileOld);
+                }
+            }
+            setUnsynced.clear();
+        }
+
+        void Close()
+        {
+            if (!file)
+                return;
+            fclose(file);
+            if (fDirty)
+                setUnsynced.insert(nFile);
+            fDirty = false;
+            file = NULL;
+            nFile = -1;
+        }
+    };
+
+    CBlockFileWriter blockFileWriter(OpenBlockFile);
+    CBlockFileWriter undoFileWriter(OpenUndoFile);
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -260,6 +388,14 @@ struct CNodeState {
     int nBlocksInFlight;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Compact block from this peer waiting for the missing transactions (blocktxn).
+    boost::shared_ptr<CPartiallyDownloadedBlock> partialBlock;
+    //! The last header we sent this peer (in a headers message).
+    CBlockIndex *pindexBestHeaderSent;
+    //! Whether this peer wants new blocks announced with headers instead of inv.
+    bool fPreferHeaders;
+    //! Whether this peer sent sendcmpct, so it can serve compact blocks.
+    bool fSupportsCompactBlocks;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -272,6 +408,9 @@ struct CNodeState {
         nStallingSince = 0;
         nBlocksInFlight = 0;
         fPreferredDownload = false;
+        pindexBestHeaderSent = NULL;
+        fPreferHeaders = false;
+        fSupportsCompactBlocks = false;
     }
 };
 
@@ -324,6 +463,7 @@ void FinalizeNode(NodeId nodeid) {
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    txrequest.DisconnectedPeer(nodeid);
 
     mapNodeState.erase(nodeid);
 }
@@ -389,6 +529,22 @@ void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash) {
     }
 }
 
+/** Whether the peer already has pindex's header, because it announced it or we sent it. Requires cs_main. */
+bool PeerHasHeader(CNodeState *state, CBlockIndex *pindex)
+{
+    if (state->pindexBestKnownBlock && pindex == state->pindexBestKnownBlock->GetAncestor(pindex->nHeight))
+        return true;
+    if (state->pindexBestHeaderSent && pindex == state->pindexBestHeaderSent->GetAncestor(pindex->nHeight))
+        return true;
+    return false;
+}
+
+/** Whether we are close enough to the tip to download announced blocks right away. Requires cs_main. */
+bool CanDirectFetch()
+{
+    return chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - Params().TargetSpacing() * 20;
+}
+
 /** Find the last common ancestor two blocks have.
  *  Both pa and pb must be non-NULL. */
 CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
@@ -515,6 +671,9 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals)
     nodeSignals.SendMessages.connect(&SendMessages);
     nodeSignals.InitializeNode.connect(&InitializeNode);
     nodeSignals.FinalizeNode.connect(&FinalizeNode);
+
+    // Message stats tell apart the time handlers spend waiting for cs_main
+    SetLockWaitTracked(&cs_main);
 }
 
 void UnregisterNodeSignals(CNodeSignals& nodeSignals)
@@ -543,6 +702,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -560,22 +720,30 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer)
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
     // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
+    // The total size of all orphans is bounded separately by
+    // -maxorphantxsize, see LimitOrphanTxSize.
     unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
-    if (sz > 5000)
+    if (sz > MAX_ORPHAN_TX_SIZE)
     {
         LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = MakeTransactionRef(tx);
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nTxSize = sz;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+        mapOrphanTransactionsByPrev[txin.prevout].insert(hash);
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
+    COrphanPeerUsage& usage = mapOrphanPeerUsage[peer];
+    usage.setOrphans.insert(hash);
+    usage.nBytes += sz;
+    nOrphanTransactionsBytes += sz;
+
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u bytes %u)\n", hash.ToString(),
+             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size(), nOrphanTransactionsBytes);
     return true;
 }
 
@@ -584,51 +752,126 @@ void static EraseOrphanTx(uint256 hash)
     map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
     if (it == mapOrphanTransactions.end())
         return;
-    BOOST_FOREACH(const CTxIn& txin, it->second.tx.vin)
+    BOOST_FOREACH(const CTxIn& txin, it->second.tx->vin)
     {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
+        map<COutPoint, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
         if (itPrev == mapOrphanTransactionsByPrev.end())
             continue;
         itPrev->second.erase(hash);
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+
+    map<NodeId, COrphanPeerUsage>::iterator itPeer = mapOrphanPeerUsage.find(it->second.fromPeer);
+    if (itPeer != mapOrphanPeerUsage.end())
+    {
+        itPeer->second.setOrphans.erase(hash);
+        itPeer->second.nBytes -= it->second.nTxSize;
+        if (itPeer->second.setOrphans.empty())
+            mapOrphanPeerUsage.erase(itPeer);
+    }
+    nOrphanTransactionsBytes -= it->second.nTxSize;
     mapOrphanTransactions.erase(it);
 }
 
 void EraseOrphansFor(NodeId peer)
 {
-    int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end())
-    {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer)
-        {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
-            ++nErased;
-        }
-    }
-    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
+    map<NodeId, COrphanPeerUsage>::iterator itPeer = mapOrphanPeerUsage.find(peer);
+    if (itPeer == mapOrphanPeerUsage.end())
+        return;
+    // Copy, EraseOrphanTx drops the peer's entry along with its last orphan
+    set<uint256> setErase = itPeer->second.setOrphans;
+    BOOST_FOREACH(const uint256& hash, setErase)
+        EraseOrphanTx(hash);
+    LogPrint("mempool", "Erased %d orphan tx from peer %d\n", setErase.size(), peer);
 }
 
-
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+/**
+ * Expire orphans that have waited too long for their parents, then evict until
+ * both the count and the byte limit are met. Evictions come out of the peer
+ * whose orphans use the most memory, so a peer flooding us with orphans
+ * displaces its own rather than everybody else's.
+ */
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxOrphanBytes)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+    static int64_t nNextSweep;
+    int64_t nNow = GetTime();
+    if (nNextSweep <= nNow) {
+        int nErased = 0;
+        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
+        map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
+        while (iter != mapOrphanTransactions.end())
+        {
+            map<uint256, COrphanTx>::iterator maybeErase = iter++;
+            if (maybeErase->second.nTimeExpire <= nNow) {
+                EraseOrphanTx(maybeErase->first);
+                ++nErased;
+            } else {
+                nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
+            }
+        }
+        // Sweep again 5 minutes after the next entry that expires in order to batch the linear scan.
+        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nErased);
+    }
+
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTransactionsBytes > nMaxOrphanBytes)
     {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+        map<NodeId, COrphanPeerUsage>::iterator itPeer = mapOrphanPeerUsage.begin();
+        for (map<NodeId, COrphanPeerUsage>::iterator mi = mapOrphanPeerUsage.begin(); mi != mapOrphanPeerUsage.end(); ++mi)
+            if (mi->second.nBytes > itPeer->second.nBytes)
+                itPeer = mi;
+        assert(itPeer != mapOrphanPeerUsage.end());
+
+        // Evict a random orphan of that peer:
+        const set<uint256>& setOrphans = itPeer->second.setOrphans;
+        set<uint256>::const_iterator it = setOrphans.lower_bound(GetRandHash());
+        if (it == setOrphans.end())
+            it = setOrphans.begin();
+        EraseOrphanTx(*it);
         ++nEvicted;
     }
     return nEvicted;
 }
 
+/**
+ * Orphans spending outputs of the given transactions whose inputs are now all
+ * available, in the order the parents were given. Orphans still missing
+ * another parent stay where they are.
+ */
+static void GetReadyOrphans(const std::vector<uint256>& vParents, std::vector<uint256>& vReady)
+{
+    set<uint256> setSeen;
+    LOCK(mempool.cs);
+    CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+    BOOST_FOREACH(const uint256& hashParent, vParents)
+    {
+        map<COutPoint, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.lower_bound(COutPoint(hashParent, 0));
+        while (itByPrev != mapOrphanTransactionsByPrev.end() && itByPrev->first.hash == hashParent)
+        {
+            BOOST_FOREACH(const uint256& orphanHash, itByPrev->second)
+            {
+                if (!setSeen.insert(orphanHash).second)
+                    continue;
+                const CTransaction& orphanTx = *mapOrphanTransactions[orphanHash].tx;
+                bool fReady = true;
+                BOOST_FOREACH(const CTxIn& txin, orphanTx.vin)
+                {
+                    if (!viewMemPool.HaveCoins(txin.prevout.hash))
+                    {
+                        fReady = false;
+                        break;
+                    }
+                }
+                if (fReady)
+                    vReady.push_back(orphanHash);
+            }
+            ++itByPrev;
+        }
+    }
+}
+
 
 
 
@@ -940,8 +1183,79 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectInsaneFee)
+/**
+ * A transaction on its way into the mempool: what the policy and UTXO checks
+ * under cs_main found, and the script checks still to be run. The checks
+ * carry copies of the scriptPubKeys they verify against, so they can run
+ * without the lock.
+ */
+class CMempoolAcceptance
+{
+public:
+    const CBlockIndex* pindexTip; //! Chain tip the inputs were looked up against
+    CTxMemPoolEntry entry;
+    std::vector<CScriptCheck> vChecks; //! With STANDARD_SCRIPT_VERIFY_FLAGS
+    std::vector<CScriptCheck> vMandatoryChecks; //! Same inputs, with MANDATORY_SCRIPT_VERIFY_FLAGS
+    bool fFree; //! Counts against the free transaction rate limit once accepted
+
+    CMempoolAcceptance() : pindexTip(NULL), fFree(false) { }
+};
+
+static bool RunScriptChecks(std::vector<CScriptCheck>& vChecks);
+
+/** Rate limiter for free transactions, charged only for those that make it into the mempool */
+static CCriticalSection csFreeLimiter;
+static double dFreeCount = 0;
+static int64_t nLastFreeTime = 0;
+
+static void DecayFreeCount()
+{
+    AssertLockHeld(csFreeLimiter);
+    int64_t nNow = GetTime();
+    // Use an exponentially decaying ~10-minute window:
+    dFreeCount *= pow(1.0 - 1.0/600.0, (double)(nNow - nLastFreeTime));
+    nLastFreeTime = nNow;
+}
+
+/**
+ * The fee limits that depend on what other transactions got into the
+ * mempool, so a transaction checked without cs_main is held to them again
+ * before it is added.
+ */
+static bool CheckMempoolFeeLimits(CTxMemPool& pool, CValidationState &state, const CMempoolAcceptance& acceptance)
+{
+    uint256 hash = acceptance.entry.GetTx().GetHash();
+    CAmount nFees = acceptance.entry.GetFee();
+    unsigned int nSize = acceptance.entry.GetTxSize();
+
+    // Continuously rate-limit free (really, very-low-fee) transactions
+    // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
+    // be annoying or make others' transactions take longer to confirm.
+    if (acceptance.fFree)
+    {
+        LOCK(csFreeLimiter);
+        DecayFreeCount();
+        // -limitfreerelay unit is thousand-bytes-per-minute
+        // At default rate it would take over a month to fill 1GB
+        if (dFreeCount >= GetArg("-limitfreerelay", 15)*10*1000)
+            return state.DoS(0, error("AcceptToMemoryPool : free transaction rejected by rate limiter"),
+                             REJECT_INSUFFICIENTFEE, "rate limited free transaction");
+    }
+
+    // Once the pool has had to evict transactions it only takes ones
+    // paying more than what was evicted.
+    CAmount nMempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+    if (nMempoolRejectFee > 0 && nFees < nMempoolRejectFee)
+        return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                                  hash.ToString(), nFees, nMempoolRejectFee),
+                         REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+    return true;
+}
+
+/** Everything AcceptToMemoryPool checks under cs_main, before the scripts */
+static bool PreCheckMempoolTx(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                              bool* pfMissingInputs, bool fRejectInsaneFee, int64_t nAcceptTime,
+                              CMempoolAcceptance& acceptance)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1041,8 +1355,8 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         CAmount nFees = nValueIn-nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
-        unsigned int nSize = entry.GetTxSize();
+        acceptance.entry = CTxMemPoolEntry(tx, nFees, nAcceptTime ? nAcceptTime : GetTime(), dPriority, chainActive.Height());
+        unsigned int nSize = acceptance.entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
         CAmount txMinFee = GetMinRelayFee(tx, nSize, true);
@@ -1056,58 +1370,100 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
         }
 
-        // Continuously rate-limit free (really, very-low-fee) transactions
-        // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
-        // be annoying or make others' transactions take longer to confirm.
-        if (fLimitFree && nFees < ::minRelayTxFee.GetFee(nSize))
-        {
-            static CCriticalSection csFreeLimiter;
-            static double dFreeCount;
-            static int64_t nLastTime;
-            int64_t nNow = GetTime();
-
-            LOCK(csFreeLimiter);
-
-            // Use an exponentially decaying ~10-minute window:
-            dFreeCount *= pow(1.0 - 1.0/600.0, (double)(nNow - nLastTime));
-            nLastTime = nNow;
-            // -limitfreerelay unit is thousand-bytes-per-minute
-            // At default rate it would take over a month to fill 1GB
-            if (dFreeCount >= GetArg("-limitfreerelay", 15)*10*1000)
-                return state.DoS(0, error("AcceptToMemoryPool : free transaction rejected by rate limiter"),
-                                 REJECT_INSUFFICIENTFEE, "rate limited free transaction");
-            LogPrint("mempool", "Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount+nSize);
-            dFreeCount += nSize;
-        }
+        acceptance.fFree = fLimitFree && nFees < ::minRelayTxFee.GetFee(nSize);
+        if (!CheckMempoolFeeLimits(pool, state, acceptance))
+            return false;
 
         if (fRejectInsaneFee && nFees > ::minRelayTxFee.GetFee(nSize) * 10000)
             return error("AcceptToMemoryPool: : insane fees %s, %d > %d",
                          hash.ToString(),
                          nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
-        // Check against previous transactions
+        // Keep chains of unconfirmed transactions short enough that
+        // working with their packages stays cheap.
+        std::set<uint256> setAncestors;
+        std::string errString;
+        if (!pool.CalculateMemPoolAncestors(tx, nSize, setAncestors,
+                                            GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT),
+                                            GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000,
+                                            GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT),
+                                            GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000,
+                                            errString))
+            return state.DoS(0, error("AcceptToMemoryPool : %s %s", errString, hash.ToString()),
+                             REJECT_NONSTANDARD, "too-long-mempool-chain");
+
+        // Check against previous transactions, leaving the scripts for later.
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true))
-        {
+        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, &acceptance.vChecks))
             return error("AcceptToMemoryPool: : ConnectInputs failed %s", hash.ToString());
-        }
+        CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, &acceptance.vMandatoryChecks);
+        assert(acceptance.vChecks.size() == acceptance.vMandatoryChecks.size());
+        acceptance.pindexTip = chainActive.Tip();
+    }
+    return true;
+}
 
-        // Check again against just the consensus-critical mandatory script
-        // verification flags, in case of bugs in the standard flags that cause
-        // transactions to pass as valid when they're actually invalid. For
-        // instance the STRICTENC flag was incorrectly allowing certain
-        // CHECKSIG NOT scripts to pass, even though they were invalid.
-        //
-        // There is a similar check in CreateNewBlock() to prevent creating
-        // invalid blocks, however allowing such transactions into the mempool
-        // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+/** Verify the scripts of a transaction that passed PreCheckMempoolTx. Does not need cs_main. */
+static bool CheckMempoolTxScripts(CValidationState &state, const CTransaction &tx, const CMempoolAcceptance& acceptance)
+{
+    std::vector<CScriptCheck> vChecks(acceptance.vChecks);
+    if (!RunScriptChecks(vChecks))
+    {
+        // Find the failing input and tell a merely non-standard script
+        // from an invalid one, as CheckInputs does.
+        for (unsigned int i = 0; i < acceptance.vChecks.size(); i++)
         {
-            return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
+            CScriptCheck check(acceptance.vChecks[i]);
+            if (check())
+                continue;
+            CScriptCheck checkMandatory(acceptance.vMandatoryChecks[i]);
+            if (checkMandatory())
+                state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
+            else
+                state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
+            break;
         }
+        return error("AcceptToMemoryPool: : ConnectInputs failed %s", tx.GetHash().ToString());
+    }
+
+    // Check again against just the consensus-critical mandatory script
+    // verification flags, in case of bugs in the standard flags that cause
+    // transactions to pass as valid when they're actually invalid. For
+    // instance the STRICTENC flag was incorrectly allowing certain
+    // CHECKSIG NOT scripts to pass, even though they were invalid.
+    //
+    // There is a similar check in CreateNewBlock() to prevent creating
+    // invalid blocks, however allowing such transactions into the mempool
+    // can be exploited as a DoS attack.
+    vChecks = acceptance.vMandatoryChecks;
+    if (!RunScriptChecks(vChecks))
+        return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", tx.GetHash().ToString());
+    return true;
+}
 
+/** Store a checked transaction in the mempool */
+static bool AddMempoolTx(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, const CMempoolAcceptance& acceptance)
+{
+    AssertLockHeld(cs_main);
+    uint256 hash = tx.GetHash();
+    {
         // Store transaction in memory
-        pool.addUnchecked(hash, entry);
+        pool.addUnchecked(hash, acceptance.entry, !IsInitialBlockDownload());
+
+        // Make room for it, which may mean it does not stay
+        pool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+        if (!pool.exists(hash))
+            return state.DoS(0, error("AcceptToMemoryPool : mempool full, %s not accepted", hash.ToString()),
+                             REJECT_INSUFFICIENTFEE, "mempool full");
+    }
+
+    if (acceptance.fFree)
+    {
+        LOCK(csFreeLimiter);
+        DecayFreeCount();
+        unsigned int nSize = acceptance.entry.GetTxSize();
+        LogPrint("mempool", "Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount+nSize);
+        dFreeCount += nSize;
     }
 
     SyncWithWallets(tx, NULL);
@@ -1115,6 +1471,81 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return true;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fRejectInsaneFee, int64_t nAcceptTime)
+{
+    AssertLockHeld(cs_main);
+    CMempoolAcceptance acceptance;
+    if (!PreCheckMempoolTx(pool, state, tx, fLimitFree, pfMissingInputs, fRejectInsaneFee, nAcceptTime, acceptance))
+        return false;
+    if (!CheckMempoolTxScripts(state, tx, acceptance))
+        return false;
+    return AddMempoolTx(pool, state, tx, acceptance);
+}
+
+bool AcceptToMemoryPoolConcurrent(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                  bool* pfMissingInputs, bool fRejectInsaneFee)
+{
+    CMempoolAcceptance acceptance;
+    {
+        LOCK(cs_main);
+        if (!PreCheckMempoolTx(pool, state, tx, fLimitFree, pfMissingInputs, fRejectInsaneFee, 0, acceptance))
+            return false;
+    }
+
+    if (!CheckMempoolTxScripts(state, tx, acceptance))
+        return false;
+
+    LOCK(cs_main);
+    // A new tip may have spent or matured the inputs; start over. The
+    // signature cache makes the second round cheap.
+    if (chainActive.Tip() != acceptance.pindexTip)
+        return AcceptToMemoryPool(pool, state, tx, fLimitFree, pfMissingInputs, fRejectInsaneFee);
+
+    // On the same tip the outputs being spent cannot have changed, but the
+    // mempool may have: the transaction or a conflicting one may have been
+    // accepted meanwhile, an unconfirmed parent evicted, or the minimum fee
+    // raised by evictions.
+    if (!CheckMempoolFeeLimits(pool, state, acceptance))
+        return false;
+    uint256 hash = tx.GetHash();
+    {
+        LOCK(pool.cs);
+        if (pool.exists(hash))
+            return false;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            if (pool.mapNextTx.count(txin.prevout))
+                return false;
+        }
+
+        CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+        CCoinsViewCache view(&viewMemPool);
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            if (!view.HaveCoins(txin.prevout.hash)) {
+                if (pfMissingInputs)
+                    *pfMissingInputs = true;
+                return false;
+            }
+        }
+        if (!view.HaveInputs(tx))
+            return state.Invalid(error("AcceptToMemoryPool : inputs already spent"),
+                                 REJECT_DUPLICATE, "bad-txns-inputs-spent");
+
+        std::set<uint256> setAncestors;
+        std::string errString;
+        if (!pool.CalculateMemPoolAncestors(tx, acceptance.entry.GetTxSize(), setAncestors,
+                                            GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT),
+                                            GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000,
+                                            GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT),
+                                            GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000,
+                                            errString))
+            return state.DoS(0, error("AcceptToMemoryPool : %s %s", errString, hash.ToString()),
+                             REJECT_NONSTANDARD, "too-long-mempool-chain");
+    }
+
+    return AddMempoolTx(pool, state, tx, acceptance);
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1188,23 +1619,36 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
 
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
 {
-    // Open history file to append
-    CAutoFile fileout(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
+    LOCK(cs_LastBlockFile);
+
+    // Append to the block file kept open by blockFileWriter
+    CAutoFile fileout(blockFileWriter.Get(pos), SER_DISK, CLIENT_VERSION);
     if (fileout.IsNull())
         return error("WriteBlockToDisk : OpenBlockFile failed");
 
-    // Write index header
-    unsigned int nSize = fileout.GetSerializeSize(block);
-    fileout << FLATDATA(Params().MessageStart()) << nSize;
-
-    // Write block
-    long fileOutPos = ftell(fileout.Get());
-    if (fileOutPos < 0)
-        return error("WriteBlockToDisk : ftell failed");
-    pos.nPos = (unsigned int)fileOutPos;
-    fileout << block;
+    bool ret = true;
+    try {
+        // Write index header
+        unsigned int nSize = fileout.GetSerializeSize(block);
+        fileout << FLATDATA(Params().MessageStart()) << nSize;
+
+        // Write block
+        long fileOutPos = ftell(fileout.Get());
+        if (fileOutPos < 0) {
+            ret = error("WriteBlockToDisk : ftell failed");
+        } else {
+            pos.nPos = (unsigned int)fileOutPos;
+            fileout << block;
+        }
+    } catch (const std::exception &e) {
+        ret = error("%s : I/O error - %s", __func__, e.what());
+    }
 
-    return true;
+    // The handle stays open for the next block; drop it if its state is unknown.
+    fileout.release();
+    if (!ret)
+        blockFileWriter.Close();
+    return ret;
 }
 
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
@@ -1355,6 +1799,7 @@ void Misbehaving(NodeId pnode, int howmuch)
     if (howmuch == 0)
         return;
 
+    LOCK(cs_main);
     CNodeState *state = State(pnode);
     if (state == NULL)
         return;
@@ -1622,22 +2067,17 @@ void static FlushBlockFile(bool fFinalize = false)
 {
     LOCK(cs_LastBlockFile);
 
-    CDiskBlockPos posOld(nLastBlockFile, 0);
-
-    FILE *fileOld = OpenBlockFile(posOld);
-    if (fileOld) {
-        if (fFinalize)
-            TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nSize);
-        FileCommit(fileOld);
-        fclose(fileOld);
+    if (fFinalize) {
+        blockFileWriter.Truncate(nLastBlockFile, vinfoBlockFile[nLastBlockFile].nSize);
+        undoFileWriter.Truncate(nLastBlockFile, vinfoBlockFile[nLastBlockFile].nUndoSize);
     }
 
-    fileOld = OpenUndoFile(posOld);
-    if (fileOld) {
-        if (fFinalize)
-            TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nUndoSize);
-        FileCommit(fileOld);
-        fclose(fileOld);
+    blockFileWriter.Commit();
+    undoFileWriter.Commit();
+
+    if (fFinalize) {
+        blockFileWriter.Close();
+        undoFileWriter.Close();
     }
 }
 
@@ -1650,6 +2090,173 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+/** Run checks on the script check threads, with the calling thread helping */
+static bool RunScriptChecks(std::vector<CScriptCheck>& vChecks)
+{
+    if (vChecks.empty())
+        return true;
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    control.Add(vChecks);
+    return control.Wait();
+}
+
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+bool DumpMempool(CTxMemPool& pool)
+{
+    int64_t nStart = GetTimeMillis();
+
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<CTxMemPoolEntry> vEntries;
+    {
+        LOCK(pool.cs);
+        mapDeltas = pool.mapDeltas;
+        vEntries.reserve(pool.mapTx.size());
+
+        // Arrival order, except that transactions brought back by a reorg
+        // can be parents of earlier arrivals; those are moved up.
+        std::set<uint256> setDone;
+        for (std::map<uint64_t, uint256>::const_iterator it = pool.mapSequence.begin(); it != pool.mapSequence.end(); ++it)
+        {
+            std::vector<uint256> vStack(1, it->second);
+            while (!vStack.empty())
+            {
+                const uint256 hash = vStack.back();
+                if (setDone.count(hash)) {
+                    vStack.pop_back();
+                    continue;
+                }
+                bool fParentsDone = true;
+                BOOST_FOREACH(const uint256& hashParent, pool.mapIndex[hash].setParents) {
+                    if (!setDone.count(hashParent)) {
+                        vStack.push_back(hashParent);
+                        fParentsDone = false;
+                    }
+                }
+                if (fParentsDone) {
+                    vEntries.push_back(pool.mapTx[hash]);
+                    setDone.insert(hash);
+                    vStack.pop_back();
+                }
+            }
+        }
+    }
+
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+    try {
+        CAutoFile file(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull())
+            return error("%s : failed to open %s", __func__, pathTmp.string());
+
+        file << MEMPOOL_DUMP_VERSION;
+        file << mapDeltas;
+        file << (uint64_t)vEntries.size();
+        BOOST_FOREACH(const CTxMemPoolEntry& entry, vEntries)
+            file << entry.GetTx() << entry.GetTime();
+        FileCommit(file.Get());
+        file.fclose();
+        if (!RenameOver(pathTmp, path))
+            return error("%s : failed to rename %s", __func__, pathTmp.string());
+    } catch (const std::exception& e) {
+        return error("%s : failed to write mempool: %s", __func__, e.what());
+    }
+    LogPrintf("Dumped %u mempool transactions to disk in %dms\n", vEntries.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+/**
+ * Verify the scripts of a batch of transactions on the script check threads,
+ * so that accepting them one by one afterwards mostly hits the signature cache.
+ */
+static void PrecheckMempoolBatch(CTxMemPool& pool, const std::vector<CTransaction>& vtx)
+{
+    AssertLockHeld(cs_main);
+    if (!nScriptCheckThreads)
+        return;
+
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    {
+        LOCK(pool.cs);
+        CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+        view.SetBackend(viewMemPool);
+        BOOST_FOREACH(const CTransaction& tx, vtx)
+        {
+            if (!view.HaveInputs(tx))
+                continue;
+            std::vector<CScriptCheck> vChecks;
+            CValidationState state;
+            if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, &vChecks))
+                continue;
+            control.Add(vChecks);
+            // Later transactions in the batch may spend this one
+            view.ModifyCoins(tx.GetHash())->FromTx(tx, MEMPOOL_HEIGHT);
+        }
+        view.SetBackend(dummy);
+    }
+    control.Wait();
+}
+
+bool LoadMempool(CTxMemPool& pool)
+{
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("%s: no mempool file at %s\n", __func__, path.string());
+        return false;
+    }
+
+    unsigned int nAccepted = 0;
+    unsigned int nFailed = 0;
+    try {
+        uint64_t nVersion;
+        file >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("%s : unknown mempool file version %d", __func__, nVersion);
+
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+            pool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+
+        uint64_t nCount;
+        file >> nCount;
+        while (nCount > 0 && !ShutdownRequested())
+        {
+            std::vector<CTransaction> vtx;
+            std::vector<int64_t> vTime;
+            while (nCount > 0 && vtx.size() < MEMPOOL_LOAD_BATCH_SIZE)
+            {
+                CTransaction tx;
+                int64_t nTime;
+                file >> tx >> nTime;
+                vtx.push_back(tx);
+                vTime.push_back(nTime);
+                nCount--;
+            }
+
+            LOCK(cs_main);
+            PrecheckMempoolBatch(pool, vtx);
+            for (unsigned int i = 0; i < vtx.size(); i++)
+            {
+                CValidationState state;
+                if (AcceptToMemoryPool(pool, state, vtx[i], false, NULL, false, vTime[i]))
+                    nAccepted++;
+                else
+                    nFailed++;
+            }
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("%s: failed to read mempool, continuing anyway: %s\n", __func__, e.what());
+    }
+
+    LogPrintf("Imported %u mempool transactions from disk (%u failed) in %dms\n", nAccepted, nFailed, GetTimeMillis() - nStart);
+    return true;
+}
+
 static int64_t nTimeVerify = 0;
 static int64_t nTimeConnect = 0;
 static int64_t nTimeIndex = 0;
@@ -1935,10 +2542,15 @@ void static UpdateTip(CBlockIndex *pindexNew) {
 }
 
 /** Disconnect chainActive's tip. */
-bool static DisconnectTip(CValidationState &state) {
+/**
+ * Disconnect chainActive's tip. Its transactions are added to the front of
+ * listDisconnected for ResurrectMempoolTransactions, which has to be called
+ * once the disconnecting is done: until then the mempool may hold children
+ * of transactions that are in neither the chain nor the pool.
+ */
+bool static DisconnectTip(CValidationState &state, std::list<CTransaction>& listDisconnected) {
     CBlockIndex *pindexDelete = chainActive.Tip();
     assert(pindexDelete);
-    mempool.check(pcoinsTip);
     // Read block from disk.
     CBlock block;
     if (!ReadBlockFromDisk(block, pindexDelete))
@@ -1955,16 +2567,8 @@ bool static DisconnectTip(CValidationState &state) {
     // Write the chain state to disk, if necessary.
     if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
         return false;
-    // Resurrect mempool transactions from the disconnected block.
-    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-        // ignore validation errors in resurrected transactions
-        list<CTransaction> removed;
-        CValidationState stateDummy;
-        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
-            mempool.remove(tx, removed, true);
-    }
-    mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
-    mempool.check(pcoinsTip);
+    // Blocks are disconnected newest first, so this keeps parents in front
+    listDisconnected.insert(listDisconnected.begin(), block.vtx.begin(), block.vtx.end());
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev);
     // Let wallets know transactions went from 1-confirmed to
@@ -1975,6 +2579,36 @@ bool static DisconnectTip(CValidationState &state) {
     return true;
 }
 
+/**
+ * Put the transactions of disconnected blocks back into the mempool. Their
+ * scripts are checked together on the script check threads first, so
+ * accepting them one by one mostly hits the signature cache, and the
+ * mempool-wide cleanup runs once for the whole reorg.
+ */
+static void ResurrectMempoolTransactions(const std::list<CTransaction>& listDisconnected)
+{
+    AssertLockHeld(cs_main);
+    if (listDisconnected.empty())
+        return;
+
+    std::vector<CTransaction> vtx;
+    BOOST_FOREACH(const CTransaction& tx, listDisconnected) {
+        if (!tx.IsCoinBase())
+            vtx.push_back(tx);
+    }
+    PrecheckMempoolBatch(mempool, vtx);
+
+    BOOST_FOREACH(const CTransaction& tx, listDisconnected) {
+        // ignore validation errors in resurrected transactions
+        list<CTransactionRef> removed;
+        CValidationState stateDummy;
+        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+            mempool.remove(tx, removed, true);
+    }
+    mempool.removeCoinbaseSpends(pcoinsTip, chainActive.Height() + 1);
+    mempool.check(pcoinsTip);
+}
+
 static int64_t nTimeReadFromDisk = 0;
 static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
@@ -2023,15 +2657,15 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     int64_t nTime5 = GetTimeMicros(); nTimeChainState += nTime5 - nTime4;
     LogPrint("bench", "  - Writing chainstate: %.2fms [%.2fs]\n", (nTime5 - nTime4) * 0.001, nTimeChainState * 0.000001);
     // Remove conflicting transactions from the mempool.
-    list<CTransaction> txConflicted;
-    mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, txConflicted);
+    list<CTransactionRef> txConflicted;
+    mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, txConflicted, !IsInitialBlockDownload());
     mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
     // Tell wallet about transactions that went from mempool
     // to conflicted:
-    BOOST_FOREACH(const CTransaction &tx, txConflicted) {
-        SyncWithWallets(tx, NULL);
+    BOOST_FOREACH(const CTransactionRef &ptx, txConflicted) {
+        SyncWithWallets(*ptx, NULL);
     }
     // ... and about transactions that got confirmed:
     BOOST_FOREACH(const CTransaction &tx, pblock->vtx) {
@@ -2111,10 +2745,14 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
     const CBlockIndex *pindexFork = chainActive.FindFork(pindexMostWork);
 
     // Disconnect active blocks which are no longer in the best chain.
+    std::list<CTransaction> listDisconnected;
     while (chainActive.Tip() && chainActive.Tip() != pindexFork) {
-        if (!DisconnectTip(state))
+        if (!DisconnectTip(state, listDisconnected)) {
+            ResurrectMempoolTransactions(listDisconnected);
             return false;
+        }
     }
+    ResurrectMempoolTransactions(listDisconnected);
 
     // Build list of new blocks to connect.
     std::vector<CBlockIndex*> vpindexToConnect;
@@ -2180,8 +2818,10 @@ bool ActivateBestChain(CValidationState &state, CBlock *pblock) {
         boost::this_thread::interruption_point();
 
         bool fInitialDownload;
+        const CBlockIndex *pindexFork;
         {
             LOCK(cs_main);
+            CBlockIndex *pindexOldTip = chainActive.Tip();
             pindexMostWork = FindMostWorkChain();
 
             // Whether we have anything to do at all.
@@ -2192,6 +2832,7 @@ bool ActivateBestChain(CValidationState &state, CBlock *pblock) {
                 return false;
 
             pindexNewTip = chainActive.Tip();
+            pindexFork = pindexOldTip ? chainActive.FindFork(pindexOldTip) : NULL;
             fInitialDownload = IsInitialBlockDownload();
         }
         // When we reach this point, we switched to a new tip (stored in pindexNewTip).
@@ -2199,13 +2840,28 @@ bool ActivateBestChain(CValidationState &state, CBlock *pblock) {
         // Notifications/callbacks that can run without cs_main
         if (!fInitialDownload) {
             uint256 hashNewTip = pindexNewTip->GetBlockHash();
+            // Find the hashes of all blocks that weren't previously in the best chain.
+            std::vector<uint256> vHashes;
+            const CBlockIndex *pindexToAnnounce = pindexNewTip;
+            while (pindexToAnnounce != pindexFork) {
+                vHashes.push_back(pindexToAnnounce->GetBlockHash());
+                pindexToAnnounce = pindexToAnnounce->pprev;
+                if (vHashes.size() == MAX_BLOCKS_TO_ANNOUNCE) {
+                    // Limit announcements in case of a huge reorganization.
+                    // Rely on the peer's synchronization mechanism in that case.
+                    break;
+                }
+            }
             // Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
             {
                 LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                BOOST_FOREACH(CNode* pnode, vNodes) {
+                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate)) {
+                        BOOST_REVERSE_FOREACH(const uint256& hash, vHashes)
+                            pnode->PushBlockHash(hash);
+                    }
+                }
             }
             // Notify external listeners about the new tip.
             uiInterface.NotifyBlockTip(hashNewTip);
@@ -2229,6 +2885,7 @@ bool InvalidateBlock(CValidationState& state, CBlockIndex *pindex) {
     setDirtyBlockIndex.insert(pindex);
     setBlockIndexCandidates.erase(pindex);
 
+    std::list<CTransaction> listDisconnected;
     while (chainActive.Contains(pindex)) {
         CBlockIndex *pindexWalk = chainActive.Tip();
         pindexWalk->nStatus |= BLOCK_FAILED_CHILD;
@@ -2236,10 +2893,12 @@ bool InvalidateBlock(CValidationState& state, CBlockIndex *pindex) {
         setBlockIndexCandidates.erase(pindexWalk);
         // ActivateBestChain considers blocks already in chainActive
         // unconditionally valid already, so force disconnect away from it.
-        if (!DisconnectTip(state)) {
+        if (!DisconnectTip(state, listDisconnected)) {
+            ResurrectMempoolTransactions(listDisconnected);
             return false;
         }
     }
+    ResurrectMempoolTransactions(listDisconnected);
 
     // The resulting new best tip may not be in setBlockIndexCandidates anymore, so
     // add them again.
@@ -2402,12 +3061,8 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
         unsigned int nNewChunks = (vinfoBlockFile[nFile].nSize + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
         if (nNewChunks > nOldChunks) {
             if (CheckDiskSpace(nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos)) {
-                FILE *file = OpenBlockFile(pos);
-                if (file) {
+                if (blockFileWriter.Allocate(pos, nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos))
                     LogPrintf("Pre-allocating up to position 0x%x in blk%05u.dat\n", nNewChunks * BLOCKFILE_CHUNK_SIZE, pos.nFile);
-                    AllocateFileRange(file, pos.nPos, nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos);
-                    fclose(file);
-                }
             }
             else
                 return state.Error("out of disk space");
@@ -2433,12 +3088,8 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
     unsigned int nNewChunks = (nNewSize + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
     if (nNewChunks > nOldChunks) {
         if (CheckDiskSpace(nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos)) {
-            FILE *file = OpenUndoFile(pos);
-            if (file) {
+            if (undoFileWriter.Allocate(pos, nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos))
                 LogPrintf("Pre-allocating up to position 0x%x in rev%05u.dat\n", nNewChunks * UNDOFILE_CHUNK_SIZE, pos.nFile);
-                AllocateFileRange(file, pos.nPos, nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos);
-                fclose(file);
-            }
         }
         else
             return state.Error("out of disk space");
@@ -2889,10 +3540,19 @@ FILE* OpenDiskFile(const CDiskBlockPos &pos, const char *prefix, bool fReadOnly)
 }
 
 FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly) {
+    if (fReadOnly) {
+        // Readers must see blocks still sitting in the writer's buffer
+        LOCK(cs_LastBlockFile);
+        blockFileWriter.Flush(pos.nFile);
+    }
     return OpenDiskFile(pos, "blk", fReadOnly);
 }
 
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly) {
+    if (fReadOnly) {
+        LOCK(cs_LastBlockFile);
+        undoFileWriter.Flush(pos.nFile);
+    }
     return OpenDiskFile(pos, "rev", fReadOnly);
 }
 
@@ -3113,6 +3773,11 @@ bool CVerifyDB::VerifyDB(CCoinsView *coinsview, int nCheckLevel, int nCheckDepth
 
 void UnloadBlockIndex()
 {
+    {
+        LOCK(cs_LastBlockFile);
+        blockFileWriter.Close();
+        undoFileWriter.Close();
+    }
     mapBlockIndex.clear();
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
@@ -3508,14 +4173,41 @@ bool static AlreadyHave(const CInv& inv)
 }
 
 
+/**
+ * Serialized form of a block (or of its compact form, whose short IDs are good
+ * for any peer) to send in reply to getdata. Blocks near the tip are requested
+ * by most peers in turn, so they go through the relay cache.
+ */
+static CSharedPayload GetBlockPayload(const CInv& inv, CBlockIndex* pindex)
+{
+    CSharedPayload payload;
+    if (relayCache.Get(inv, payload))
+        return payload;
+
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex))
+        assert(!"cannot load block from disk");
+    if (inv.type == MSG_CMPCT_BLOCK)
+        payload = MakeSharedPayload(CBlockHeaderAndShortTxIDs(block));
+    else
+        payload = MakeSharedPayload(block);
+    if (pindex->nHeight >= chainActive.Height() - MAX_RELAY_CACHE_BLOCK_DEPTH)
+        relayCache.Insert(inv, payload);
+    return payload;
+}
+
+/** Whether new blocks are fetched from pnode as compact blocks. Requires cs_main. */
+static bool CanFetchCompactBlock(const CNode* pnode)
+{
+    return fCompactBlocks && State(pnode->GetId())->fSupportsCompactBlocks;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -3526,8 +4218,12 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
+                // Block replies need the block index; transaction replies
+                // below are served without cs_main, so that other message
+                // handler threads are not held up by them.
+                LOCK(cs_main);
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
@@ -3547,14 +4243,20 @@ void static ProcessGetData(CNode* pfrom)
                 }
                 if (send)
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    // Compact blocks are for catching up with the tip; older
+                    // blocks asked for that way are sent in full.
+                    bool fCompact = inv.type == MSG_CMPCT_BLOCK && fCompactBlocks &&
+                        mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+                    if (fCompact)
+                        pfrom->PushSharedMessage("cmpctblock", GetBlockPayload(CInv(MSG_CMPCT_BLOCK, inv.hash), mi->second));
+                    else if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK)
+                        pfrom->PushSharedMessage("block", GetBlockPayload(CInv(MSG_BLOCK, inv.hash), mi->second));
                     else // MSG_FILTERED_BLOCK)
                     {
+                        // Send block from disk
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second))
+                            assert(!"cannot load block from disk");
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
@@ -3568,8 +4270,15 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                            {
+                                bool fKnown;
+                                {
+                                    LOCK(pfrom->cs_inventory);
+                                    fKnown = pfrom->filterInventoryKnown.contains(pair.second);
+                                }
+                                if (!fKnown)
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
+                            }
                         }
                         // else
                             // no response
@@ -3590,27 +4299,18 @@ void static ProcessGetData(CNode* pfrom)
             }
             else if (inv.IsKnownType())
             {
-                // Send stream from relay memory
-                bool pushed = false;
-                {
-                    LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                        pushed = true;
-                    }
-                }
-                if (!pushed && inv.type == MSG_TX) {
-                    CTransaction tx;
-                    if (mempool.lookup(inv.hash, tx)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
-                        pushed = true;
+                // Send stream from relay memory, serializing it there on a miss
+                CSharedPayload payload;
+                if (!relayCache.Get(inv, payload) && inv.type == MSG_TX) {
+                    CTransactionRef ptx = mempool.get(inv.hash);
+                    if (ptx) {
+                        payload = MakeSharedPayload(*ptx);
+                        relayCache.Insert(inv, payload);
                     }
                 }
-                if (!pushed) {
+                if (!payload.IsNull()) {
+                    pfrom->PushSharedMessage(inv.GetCommand(), payload);
+                } else {
                     vNotFound.push_back(inv);
                 }
             }
@@ -3618,7 +4318,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             g_signals.Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -3637,7 +4337,43 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+/** Process a block received from pfrom, in full or rebuilt from a compact block */
+static void ProcessBlockFromPeer(CNode* pfrom, CBlock& block)
+{
+    CValidationState state;
+    ProcessNewBlock(state, pfrom, &block);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", string("block"), state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+    }
+}
+
+/** Message types handled by ProcessMessage below; keep this in step with its dispatch */
+static const char* ppszMessageTypes[] =
+{
+    "addr", "alert", "block", "blocktxn", "cmpctblock", "feefilter", "filteradd",
+    "filterclear", "filterload", "getaddr", "getblocks", "getblocktxn", "getdata",
+    "getheaders", "headers", "inv", "mempool", "notfound", "ping", "pong", "reject",
+    "sendcmpct", "sendheaders", "tx", "verack", "version"
+};
+
+/** Stats key for received commands we don't know, so made-up ones can't grow the maps */
+static const char* MSG_STATS_OTHER = "*other*";
+
+bool IsKnownMessageType(const std::string& strCommand)
+{
+    for (unsigned int i = 0; i < ARRAYLEN(ppszMessageTypes); i++)
+        if (strCommand == ppszMessageTypes[i])
+            return true;
+    return false;
+}
+
+bool static ProcessMessage(CNode* pfrom, string strCommand, CNetDataStream& vRecv, int64_t nTimeReceived)
 {
     RandAddSeedPerfmon();
     LogPrint("net", "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->id);
@@ -3727,7 +4463,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
 
         // Potentially mark this peer as a preferred download peer.
-        UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        {
+            LOCK(cs_main);
+            UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        }
 
         // Change version
         pfrom->PushMessage("verack");
@@ -3798,6 +4537,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        if (pfrom->nVersion >= SENDHEADERS_VERSION) {
+            // Tell our peer we prefer to receive headers rather than inv's.
+            // We send this to non-NODE_NETWORK peers as well, because even
+            // non-NODE_NETWORK peers can announce blocks (such as pruning
+            // nodes).
+            pfrom->PushMessage("sendheaders");
+        }
+        if (pfrom->nVersion >= COMPACTBLOCKS_VERSION && fCompactBlocks) {
+            // Tell our peer it can fetch new blocks from us as compact blocks.
+            pfrom->PushMessage("sendcmpct");
+        }
     }
 
 
@@ -3833,7 +4584,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 {
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                    // at a time so the addrKnowns of the chosen nodes prevent repeats
                     static uint256 hashSalt;
                     if (hashSalt == 0)
                         hashSalt = GetRandHash();
@@ -3868,6 +4619,34 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == "sendheaders")
+    {
+        LOCK(cs_main);
+        State(pfrom->GetId())->fPreferHeaders = true;
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        LOCK(cs_main);
+        State(pfrom->GetId())->fSupportsCompactBlocks = true;
+    }
+
+
+    else if (strCommand == "feefilter")
+    {
+        CAmount newFeeFilter = 0;
+        vRecv >> newFeeFilter;
+        if (MoneyRange(newFeeFilter)) {
+            {
+                LOCK(pfrom->cs_feeFilter);
+                pfrom->minFeeFilter = newFeeFilter;
+            }
+            LogPrint("net", "received: feefilter of %s from peer=%d\n", CFeeRate(newFeeFilter).ToString(), pfrom->id);
+        }
+    }
+
+
     else if (strCommand == "inv")
     {
         vector<CInv> vInv;
@@ -3878,22 +4657,46 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return error("message inv size() = %u", vInv.size());
         }
 
+        // Note what the peer knows, and settle transactions that are in
+        // the mempool already, before taking cs_main for the rest.
+        std::vector<CInv> vInvMain;
+        vInvMain.reserve(vInv.size());
+        BOOST_FOREACH(const CInv& inv, vInv)
+        {
+            pfrom->AddInventoryKnown(inv);
+            if (inv.type == MSG_TX && mempool.exists(inv.hash)) {
+                LogPrint("net", "got inv: %s  have peer=%d\n", inv.ToString(), pfrom->id);
+                g_signals.Inventory(inv.hash);
+                continue;
+            }
+            vInvMain.push_back(inv);
+        }
+        if (vInvMain.empty())
+            return true;
+
         LOCK(cs_main);
 
         std::vector<CInv> vToFetch;
 
-        for (unsigned int nInv = 0; nInv < vInv.size(); nInv++)
+        for (unsigned int nInv = 0; nInv < vInvMain.size(); nInv++)
         {
-            const CInv &inv = vInv[nInv];
+            const CInv &inv = vInvMain[nInv];
 
             boost::this_thread::interruption_point();
-            pfrom->AddInventoryKnown(inv);
 
             bool fAlreadyHave = AlreadyHave(inv);
             LogPrint("net", "got inv: %s  %s peer=%d\n", inv.ToString(), fAlreadyHave ? "have" : "new", pfrom->id);
 
-            if (!fAlreadyHave && !fImporting && !fReindex && inv.type != MSG_BLOCK)
-                pfrom->AskFor(inv);
+            if (!fAlreadyHave && !fImporting && !fReindex && inv.type == MSG_TX) {
+                // Outbound and whitelisted peers get the first shot at delivering a transaction
+                bool fPreferred = !pfrom->fInbound || pfrom->fWhitelisted;
+                int64_t nReqTime = GetTimeMicros();
+                if (!fPreferred)
+                    nReqTime += INBOUND_PEER_TX_DELAY * 1000000LL;
+                if (txrequest.CountInFlight(pfrom->GetId()) >= MAX_PEER_TX_IN_FLIGHT)
+                    nReqTime += OVERLOADED_PEER_TX_DELAY * 1000000LL;
+                txrequest.ReceivedInv(pfrom->GetId(), inv.hash, fPreferred, nReqTime);
+            }
 
             if (inv.type == MSG_BLOCK) {
                 UpdateBlockAvailability(pfrom->GetId(), inv.hash);
@@ -3908,9 +4711,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     // not a direct successor.
                     pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
                     CNodeState *nodestate = State(pfrom->GetId());
-                    if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - Params().TargetSpacing() * 20 &&
-                        nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                        vToFetch.push_back(inv);
+                    if (CanDirectFetch() && nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                        vToFetch.push_back(CanFetchCompactBlock(pfrom) ? CInv(MSG_CMPCT_BLOCK, inv.hash) : inv);
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
                         MarkBlockAsInFlight(pfrom->GetId(), inv.hash);
@@ -4025,6 +4827,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
                 break;
         }
+        // pindex can be NULL either if we sent chainActive.Tip() OR
+        // if our peer has chainActive.Tip() (and thus we are sending an empty
+        // headers message). In both cases it's safe to update
+        // pindexBestHeaderSent to be our tip.
+        State(pfrom->GetId())->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
         pfrom->PushMessage("headers", vHeaders);
     }
 
@@ -4039,14 +4846,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
-
         bool fMissingInputs = false;
         CValidationState state;
 
-        mapAlreadyAskedFor.erase(inv);
+        // Checking the signatures can take a while; leave cs_main to block
+        // processing and RPC meanwhile.
+        bool fAccepted = AcceptToMemoryPoolConcurrent(mempool, state, tx, true, &fMissingInputs);
+
+        LOCK(cs_main);
+
+        // Whatever came of it, there's no point in asking other peers for it
+        txrequest.ReceivedResponse(pfrom->GetId(), inv.hash);
+        txrequest.ForgetTxHash(inv.hash);
 
-        if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
+        if (fAccepted)
         {
             mempool.check(pcoinsTip);
             RelayTransaction(tx);
@@ -4058,19 +4871,29 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 tx.GetHash().ToString(),
                 mempool.mapTx.size());
 
-            // Recursively process any orphan transactions that depended on this one
+            // Process orphan transactions that depended on this one, a
+            // generation at a time: every orphan whose inputs are now all
+            // available has its scripts verified as one batch before they
+            // are accepted, and the ones that make it in seed the next round.
             set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+            while (!vWorkQueue.empty())
             {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
+                vector<uint256> vReady;
+                GetReadyOrphans(vWorkQueue, vReady);
+                vWorkQueue.clear();
+                if (vReady.empty())
+                    break;
+
+                vector<CTransaction> vReadyTx;
+                BOOST_FOREACH(const uint256& orphanHash, vReady)
+                    if (!setMisbehaving.count(mapOrphanTransactions[orphanHash].fromPeer))
+                        vReadyTx.push_back(*mapOrphanTransactions[orphanHash].tx);
+                if (vReadyTx.size() > 1)
+                    PrecheckMempoolBatch(mempool, vReadyTx);
+
+                BOOST_FOREACH(const uint256& orphanHash, vReady)
                 {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
+                    const CTransaction& orphanTx = *mapOrphanTransactions[orphanHash].tx;
                     NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
                     bool fMissingInputs2 = false;
                     // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
@@ -4101,8 +4924,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                         // too-little-fee orphan
                         LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
                     }
-                    mempool.check(pcoinsTip);
+                    else
+                    {
+                        // An input was spent in the meantime; leave it to expire
+                        vEraseQueue.pop_back();
+                    }
                 }
+                mempool.check(pcoinsTip);
             }
 
             BOOST_FOREACH(uint256 hash, vEraseQueue)
@@ -4114,7 +4942,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+            size_t nMaxOrphanBytes = (size_t)std::max((int64_t)0, GetArg("-maxorphantxsize", DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE)) * 1000;
+            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, nMaxOrphanBytes);
             if (nEvicted > 0)
                 LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
         } else if (pfrom->fWhitelisted) {
@@ -4188,6 +5017,53 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256(0));
         }
 
+        // If this set of headers is valid and ends in a block with at least as
+        // much work as our tip, download as much as possible.
+        CNodeState *nodestate = State(pfrom->GetId());
+        if (CanDirectFetch() && pindexLast && pindexLast->IsValid(BLOCK_VALID_TREE) && chainActive.Tip()->nChainWork <= pindexLast->nChainWork) {
+            vector<CBlockIndex *> vToFetch;
+            CBlockIndex *pindexWalk = pindexLast;
+            // Calculate all the blocks we'd need to switch to pindexLast, up to a limit.
+            while (pindexWalk && !chainActive.Contains(pindexWalk) && vToFetch.size() <= MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                if (!(pindexWalk->nStatus & BLOCK_HAVE_DATA) && !mapBlocksInFlight.count(pindexWalk->GetBlockHash())) {
+                    // We don't have this block, and it's not yet in flight.
+                    vToFetch.push_back(pindexWalk);
+                }
+                pindexWalk = pindexWalk->pprev;
+            }
+            // If pindexWalk still isn't on our main chain, we're looking at a
+            // very large reorg at a time we think we're close to caught up to
+            // the main chain -- this shouldn't really happen. Bail out on the
+            // direct fetch and rely on parallel download instead.
+            if (!chainActive.Contains(pindexWalk)) {
+                LogPrint("net", "Large reorg, won't direct fetch to %s (%d)\n",
+                        pindexLast->GetBlockHash().ToString(),
+                        pindexLast->nHeight);
+            } else {
+                vector<CInv> vGetData;
+                // Download as much as possible, from earliest to latest.
+                BOOST_REVERSE_FOREACH(CBlockIndex *pindex, vToFetch) {
+                    if (nodestate->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                        // Can't download any more from this peer
+                        break;
+                    }
+                    vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                    MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), pindex);
+                    LogPrint("net", "Requesting block %s from peer=%d\n",
+                            pindex->GetBlockHash().ToString(), pfrom->id);
+                }
+                if (vGetData.size() > 1) {
+                    LogPrint("net", "Downloading blocks toward %s (%d) via headers direct fetch\n",
+                            pindexLast->GetBlockHash().ToString(), pindexLast->nHeight);
+                }
+                // A lone new block is best fetched as a compact block.
+                if (vGetData.size() == 1 && CanFetchCompactBlock(pfrom))
+                    vGetData[0].type = MSG_CMPCT_BLOCK;
+                if (vGetData.size() > 0)
+                    pfrom->PushMessage("getdata", vGetData);
+            }
+        }
+
         CheckBlockIndex();
     }
 
@@ -4201,18 +5077,139 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         pfrom->AddInventoryKnown(inv);
 
-        CValidationState state;
-        ProcessNewBlock(state, pfrom, &block);
-        int nDoS;
-        if (state.IsInvalid(nDoS)) {
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0) {
-                LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), nDoS);
+        ProcessBlockFromPeer(pfrom, block);
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        CInv inv(MSG_BLOCK, cmpctblock.header.GetHash());
+        LogPrint("net", "received compact block %s (%u txn) peer=%d\n", inv.hash.ToString(), cmpctblock.BlockTxCount(), pfrom->id);
+
+        pfrom->AddInventoryKnown(inv);
+
+        CBlock block;
+        bool fReconstructed = false;
+        {
+            LOCK(cs_main);
+            // Only rebuild compact blocks we asked this peer for
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(inv.hash);
+            if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != pfrom->GetId()) {
+                LogPrint("net", "ignoring unrequested compact block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+                return true;
+            }
+
+            CValidationState state;
+            if (!AcceptBlockHeader(cmpctblock.header, state)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS)) {
+                    if (nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS);
+                    return error("invalid header received in compact block");
+                }
+            }
+
+            boost::shared_ptr<CPartiallyDownloadedBlock> partialBlock(new CPartiallyDownloadedBlock());
+            ReadStatus status = partialBlock->InitData(cmpctblock, mempool);
+            if (status == READ_INVALID) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("invalid compact block %s from peer=%d", inv.hash.ToString(), pfrom->id);
+            }
+
+            CBlockTransactionsRequest req;
+            req.blockhash = inv.hash;
+            if (status == READ_OK) {
+                for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++)
+                    if (!partialBlock->IsTxAvailable(i))
+                        req.vIndexes.push_back(i);
+                if (req.vIndexes.empty())
+                    fReconstructed = partialBlock->FillBlock(block, vector<CTransaction>()) == READ_OK;
+            }
+
+            if (!req.vIndexes.empty()) {
+                LogPrint("net", "requesting %u of %u transactions of compact block %s peer=%d\n",
+                         req.vIndexes.size(), cmpctblock.BlockTxCount(), inv.hash.ToString(), pfrom->id);
+                State(pfrom->GetId())->partialBlock = partialBlock;
+                pfrom->PushMessage("getblocktxn", req);
+            } else if (!fReconstructed) {
+                // Colliding short IDs; the full block is still in flight from this peer
+                LogPrint("net", "cannot rebuild compact block %s, fetching it in full peer=%d\n", inv.hash.ToString(), pfrom->id);
+                pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+            }
+        }
+
+        if (fReconstructed) {
+            LogPrint("net", "rebuilt block %s from mempool peer=%d\n", inv.hash.ToString(), pfrom->id);
+            ProcessBlockFromPeer(pfrom, block);
+        }
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex)
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        bool fReconstructed = false;
+        {
+            LOCK(cs_main);
+            CNodeState *nodestate = State(pfrom->GetId());
+            if (!nodestate->partialBlock || nodestate->partialBlock->header.GetHash() != resp.blockhash) {
+                LogPrint("net", "ignoring unrequested block transactions for %s peer=%d\n", resp.blockhash.ToString(), pfrom->id);
+                return true;
             }
+
+            ReadStatus status = nodestate->partialBlock->FillBlock(block, resp.vtx);
+            nodestate->partialBlock.reset();
+            if (status == READ_INVALID) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("invalid block transactions for %s from peer=%d", resp.blockhash.ToString(), pfrom->id);
+            } else if (status == READ_FAILED) {
+                LogPrint("net", "cannot rebuild compact block %s, fetching it in full peer=%d\n", resp.blockhash.ToString(), pfrom->id);
+                pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, resp.blockhash)));
+            } else {
+                fReconstructed = true;
+            }
+        }
+
+        if (fReconstructed)
+            ProcessBlockFromPeer(pfrom, block);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("net", "peer %d asked for transactions of unknown block %s\n", pfrom->id, req.blockhash.ToString());
+            return true;
+        }
+        if (mi->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            LogPrint("net", "peer %d asked for transactions of old block %s\n", pfrom->id, req.blockhash.ToString());
+            return true;
         }
 
+        CBlock block;
+        if (!ReadBlockFromDisk(block, mi->second))
+            assert(!"cannot load block from disk");
+
+        CBlockTransactions resp(req);
+        for (size_t i = 0; i < req.vIndexes.size(); i++) {
+            if (req.vIndexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer %d asked for out of range transactions of block %s", pfrom->id, req.blockhash.ToString());
+            }
+            resp.vtx[i] = block.vtx[req.vIndexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
     }
 
 
@@ -4223,7 +5220,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     // getaddr message mitigates the attack.
     else if ((strCommand == "getaddr") && (pfrom->fInbound))
     {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -4239,10 +5239,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vector<CInv> vInv;
         BOOST_FOREACH(uint256& hash, vtxid) {
             CInv inv(MSG_TX, hash);
-            CTransaction tx;
-            bool fInMemPool = mempool.lookup(hash, tx);
-            if (!fInMemPool) continue; // another thread removed since queryHashes, maybe...
-            if ((pfrom->pfilter && pfrom->pfilter->IsRelevantAndUpdate(tx)) ||
+            CTransactionRef ptx = mempool.get(hash);
+            if (!ptx) continue; // another thread removed since queryHashes, maybe...
+            if ((pfrom->pfilter && pfrom->pfilter->IsRelevantAndUpdate(*ptx)) ||
                (!pfrom->pfilter))
                 vInv.push_back(inv);
             if (vInv.size() == MAX_INV_SZ) {
@@ -4339,6 +5338,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CAlert alert;
         vRecv >> alert;
 
+        // Every peer's setKnown is only touched with cs_mapAlerts held, as
+        // alerts may be relayed from several message handler threads.
+        LOCK(cs_mapAlerts);
         uint256 alertHash = alert.GetHash();
         if (pfrom->setKnown.count(alertHash) == 0)
         {
@@ -4413,6 +5415,22 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == "notfound")
+    {
+        vector<CInv> vInv;
+        vRecv >> vInv;
+        if (vInv.size() <= MAX_INV_SZ)
+        {
+            // Let the next peer that announced these transactions have a go
+            LOCK(cs_main);
+            BOOST_FOREACH(const CInv& inv, vInv) {
+                if (inv.type == MSG_TX)
+                    txrequest.ReceivedResponse(pfrom->GetId(), inv.hash);
+            }
+        }
+    }
+
+
     else if (strCommand == "reject")
     {
         if (fDebug) {
@@ -4464,8 +5482,13 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
-    if (!pfrom->vRecvGetData.empty())
+    if (!pfrom->vRecvGetData.empty()) {
+        // Answering the rest of an earlier getdata is booked to it
+        int64_t nStart = GetTimeMicros();
+        int64_t nLockWaitStart = GetLockWaitMicros();
         ProcessGetData(pfrom);
+        pfrom->RecordRecvTime("getdata", GetTimeMicros() - nStart, GetLockWaitMicros() - nLockWaitStart);
+    }
 
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
@@ -4511,7 +5534,7 @@ bool ProcessMessages(CNode* pfrom)
         unsigned int nMessageSize = hdr.nMessageSize;
 
         // Checksum
-        CDataStream& vRecv = msg.vRecv;
+        CNetDataStream& vRecv = msg.vRecv;
         uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
         unsigned int nChecksum = 0;
         memcpy(&nChecksum, &hash, sizeof(nChecksum));
@@ -4522,8 +5545,12 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
+        CaptureMessage(pfrom, msg);
+
         // Process message
         bool fRet = false;
+        int64_t nStart = GetTimeMicros();
+        int64_t nLockWaitStart = GetLockWaitMicros();
         try
         {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
@@ -4555,6 +5582,9 @@ bool ProcessMessages(CNode* pfrom)
         } catch (...) {
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
+        pfrom->RecordRecvMsg(IsKnownMessageType(strCommand) ? strCommand : MSG_STATS_OTHER,
+                             CMessageHeader::HEADER_SIZE + nMessageSize,
+                             GetTimeMicros() - nStart, GetLockWaitMicros() - nLockWaitStart);
 
         if (!fRet)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
@@ -4577,6 +5607,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (pto->nVersion == 0)
             return true;
 
+        // Trickling invs and requesting what peers announced is booked to
+        // "getdata", like answering their requests
+        int64_t nStart = GetTimeMicros();
+        int64_t nLockWaitStart = GetLockWaitMicros();
+
         //
         // Message: ping
         //
@@ -4617,9 +5652,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodes)
             {
-                // Periodically clear setAddrKnown to allow refresh broadcasts
-                if (nLastRebroadcast)
-                    pnode->setAddrKnown.clear();
+                // Periodically clear addrKnown to allow refresh broadcasts
+                if (nLastRebroadcast) {
+                    LOCK(pnode->cs_vAddrToSend);
+                    pnode->addrKnown.reset();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -4633,13 +5670,14 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
+            LOCK(pto->cs_vAddrToSend);
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                if (!pto->addrKnown.contains(addr.GetKey()))
                 {
+                    pto->addrKnown.insert(addr.GetKey());
                     vAddr.push_back(addr);
                     // receiver rejects addr messages larger than 1000
                     if (vAddr.size() >= 1000)
@@ -4697,18 +5735,131 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             g_signals.Broadcast();
         }
 
+        //
+        // Try sending block announcements via headers
+        //
+        {
+            // If we have less than MAX_BLOCKS_TO_ANNOUNCE in our
+            // list of block hashes we're relaying, and our peer wants
+            // headers announcements, then find the first header
+            // not yet known to our peer but would connect, and send.
+            // If no header would connect, or if we have too many
+            // blocks, or if the peer doesn't want headers, just
+            // add all to the inv queue.
+            LOCK(pto->cs_inventory);
+            vector<CBlock> vHeaders;
+            bool fRevertToInv = (!state.fPreferHeaders || pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE);
+            CBlockIndex *pBestIndex = NULL; // last header queued for delivery
+            ProcessBlockAvailability(pto->id); // ensure pindexBestKnownBlock is up-to-date
+
+            if (!fRevertToInv) {
+                bool fFoundStartingHeader = false;
+                // Try to find first header that our peer doesn't have, and
+                // then send all headers past that one.  If we come across any
+                // headers that aren't on chainActive, give up.
+                BOOST_FOREACH(const uint256 &hash, pto->vBlockHashesToAnnounce) {
+                    BlockMap::iterator mi = mapBlockIndex.find(hash);
+                    assert(mi != mapBlockIndex.end());
+                    CBlockIndex *pindex = mi->second;
+                    if (chainActive[pindex->nHeight] != pindex) {
+                        // Bail out if we reorged away from this block
+                        fRevertToInv = true;
+                        break;
+                    }
+                    if (pBestIndex != NULL && pindex->pprev != pBestIndex) {
+                        // This means that the list of blocks to announce don't
+                        // connect to each other.
+                        // This shouldn't really be possible to hit during
+                        // regular operation (because reorgs should take us to
+                        // a chain that has some block not on the prior chain,
+                        // which should be caught by the prior check), but one
+                        // way this could happen is by using invalidateblock /
+                        // reconsiderblock repeatedly on the tip, causing it to
+                        // be added multiple times to vBlockHashesToAnnounce.
+                        // Robustly deal with this rare situation by reverting
+                        // to an inv.
+                        fRevertToInv = true;
+                        break;
+                    }
+                    pBestIndex = pindex;
+                    if (fFoundStartingHeader) {
+                        // add this to the headers message
+                        vHeaders.push_back(pindex->GetBlockHeader());
+                    } else if (PeerHasHeader(&state, pindex)) {
+                        continue; // keep looking for the first new block
+                    } else if (pindex->pprev == NULL || PeerHasHeader(&state, pindex->pprev)) {
+                        // Peer doesn't have this header but they do have the prior one.
+                        // Start sending headers.
+                        fFoundStartingHeader = true;
+                        vHeaders.push_back(pindex->GetBlockHeader());
+                    } else {
+                        // Peer doesn't have this header or the prior one -- nothing will
+                        // connect, so bail out.
+                        fRevertToInv = true;
+                        break;
+                    }
+                }
+            }
+            if (fRevertToInv) {
+                // If falling back to using an inv, just try to inv the tip.
+                // The last entry in vBlockHashesToAnnounce was our tip at some point
+                // in the past.
+                if (!pto->vBlockHashesToAnnounce.empty()) {
+                    const uint256 &hashToAnnounce = pto->vBlockHashesToAnnounce.back();
+                    BlockMap::iterator mi = mapBlockIndex.find(hashToAnnounce);
+                    assert(mi != mapBlockIndex.end());
+                    CBlockIndex *pindex = mi->second;
+
+                    // Warn if we're announcing a block that is not on the main chain.
+                    // This should be very rare and could be optimized out.
+                    // Just log for now.
+                    if (chainActive[pindex->nHeight] != pindex) {
+                        LogPrint("net", "Announcing block %s not on main chain (tip=%s)\n",
+                            hashToAnnounce.ToString(), chainActive.Tip()->GetBlockHash().ToString());
+                    }
+
+                    // If the peer announced this block to us, don't inv it back.
+                    // (Since block announcements may not be via inv's, we can't solely rely on
+                    // filterInventoryKnown to track this.)
+                    if (!PeerHasHeader(&state, pindex)) {
+                        pto->PushInventory(CInv(MSG_BLOCK, hashToAnnounce));
+                        LogPrint("net", "%s: sending inv peer=%d hash=%s\n", __func__,
+                            pto->id, hashToAnnounce.ToString());
+                    }
+                }
+            } else if (!vHeaders.empty()) {
+                if (vHeaders.size() > 1) {
+                    LogPrint("net", "%s: %u headers, range (%s, %s), to peer=%d\n", __func__,
+                            vHeaders.size(),
+                            vHeaders.front().GetHash().ToString(),
+                            vHeaders.back().GetHash().ToString(), pto->id);
+                } else {
+                    LogPrint("net", "%s: sending header %s to peer=%d\n", __func__,
+                            vHeaders.front().GetHash().ToString(), pto->id);
+                }
+                pto->PushMessage("headers", vHeaders);
+                state.pindexBestHeaderSent = pBestIndex;
+            }
+            pto->vBlockHashesToAnnounce.clear();
+        }
+
         //
         // Message: inventory
         //
         vector<CInv> vInv;
         vector<CInv> vInvWait;
+        CAmount filterrate = 0;
+        {
+            LOCK(pto->cs_feeFilter);
+            filterrate = pto->minFeeFilter;
+        }
         {
             LOCK(pto->cs_inventory);
             vInv.reserve(pto->vInventoryToSend.size());
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -4729,9 +5880,17 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                // don't announce transactions the peer would reject for their fee
+                if (inv.type == MSG_TX && filterrate)
+                {
+                    CFeeRate feeRate;
+                    if (mempool.lookupFeeRate(inv.hash, feeRate) && feeRate.GetFeePerK() < filterrate)
+                        continue;
+                }
+
+                if (!pto->filterInventoryKnown.contains(inv.hash))
                 {
+                    pto->filterInventoryKnown.insert(inv.hash);
                     vInv.push_back(inv);
                     if (vInv.size() >= 1000)
                     {
@@ -4789,9 +5948,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: getdata (non-blocks)
         //
-        while (!pto->fDisconnect && !pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
+        vector<uint256> vRequestable;
+        if (!pto->fDisconnect)
+            txrequest.GetRequestable(pto->GetId(), nNow, vRequestable);
+        BOOST_FOREACH(const uint256& hash, vRequestable)
         {
-            const CInv& inv = (*pto->mapAskFor.begin()).second;
+            CInv inv(MSG_TX, hash);
             if (!AlreadyHave(inv))
             {
                 if (fDebug)
@@ -4803,11 +5965,38 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     vGetData.clear();
                 }
             }
-            pto->mapAskFor.erase(pto->mapAskFor.begin());
+            else
+            {
+                // Got it meanwhile, e.g. in a block
+                txrequest.ForgetTxHash(hash);
+            }
         }
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
+        //
+        // Message: feefilter
+        //
+        if (pto->nVersion >= FEEFILTER_VERSION && GetBoolArg("-feefilter", DEFAULT_FEEFILTER)) {
+            CAmount currentFilter = mempool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFeePerK();
+            int64_t timeNow = GetTimeMicros();
+            if (timeNow > pto->nextSendTimeFeeFilter) {
+                if (currentFilter != pto->lastSentFeeFilter) {
+                    pto->PushMessage("feefilter", currentFilter);
+                    pto->lastSentFeeFilter = currentFilter;
+                }
+                // Randomize the interval so peers can't line up our broadcasts
+                pto->nextSendTimeFeeFilter = timeNow + (AVG_FEEFILTER_BROADCAST_INTERVAL / 2) * 1000000 + GetRand(AVG_FEEFILTER_BROADCAST_INTERVAL * 1000000);
+            }
+            // If the fee filter has changed substantially and it's still more than MAX_FEEFILTER_CHANGE_DELAY
+            // until scheduled broadcast, then move the broadcast to within MAX_FEEFILTER_CHANGE_DELAY.
+            else if (timeNow + MAX_FEEFILTER_CHANGE_DELAY * 1000000 < pto->nextSendTimeFeeFilter &&
+                     (currentFilter < 3 * pto->lastSentFeeFilter / 4 || currentFilter > 4 * pto->lastSentFeeFilter / 3)) {
+                pto->nextSendTimeFeeFilter = timeNow + GetRand(MAX_FEEFILTER_CHANGE_DELAY * 1000000);
+            }
+        }
+
+        pto->RecordRecvTime("getdata", GetTimeMicros() - nStart, GetLockWaitMicros() - nLockWaitStart);
     }
     return true;
 }
@@ -4815,29 +6004,41 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 
 bool CBlockUndo::WriteToDisk(CDiskBlockPos &pos, const uint256 &hashBlock)
 {
-    // Open history file to append
-    CAutoFile fileout(OpenUndoFile(pos), SER_DISK, CLIENT_VERSION);
+    LOCK(cs_LastBlockFile);
+
+    // Append to the undo file kept open by undoFileWriter
+    CAutoFile fileout(undoFileWriter.Get(pos), SER_DISK, CLIENT_VERSION);
     if (fileout.IsNull())
         return error("CBlockUndo::WriteToDisk : OpenUndoFile failed");
 
-    // Write index header
-    unsigned int nSize = fileout.GetSerializeSize(*this);
-    fileout << FLATDATA(Params().MessageStart()) << nSize;
-
-    // Write undo data
-    long fileOutPos = ftell(fileout.Get());
-    if (fileOutPos < 0)
-        return error("CBlockUndo::WriteToDisk : ftell failed");
-    pos.nPos = (unsigned int)fileOutPos;
-    fileout << *this;
+    bool ret = true;
+    try {
+        // Write index header
+        unsigned int nSize = fileout.GetSerializeSize(*this);
+        fileout << FLATDATA(Params().MessageStart()) << nSize;
+
+        // Write undo data
+        long fileOutPos = ftell(fileout.Get());
+        if (fileOutPos < 0) {
+            ret = error("CBlockUndo::WriteToDisk : ftell failed");
+        } else {
+            pos.nPos = (unsigned int)fileOutPos;
+            fileout << *this;
 
-    // calculate & write checksum
-    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
-    hasher << hashBlock;
-    hasher << *this;
-    fileout << hasher.GetHash();
+            // calculate & write checksum
+            CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+            hasher << hashBlock;
+            hasher << *this;
+            fileout << hasher.GetHash();
+        }
+    } catch (const std::exception &e) {
+        ret = error("%s : I/O error - %s", __func__, e.what());
+    }
 
-    return true;
+    fileout.release();
+    if (!ret)
+        undoFileWriter.Close();
+    return ret;
 }
 
 bool CBlockUndo::ReadFromDisk(const CDiskBlockPos &pos, const uint256 &hashBlock)
@@ -4887,5 +6088,7 @@ public:
         // orphan transactions
         mapOrphanTransactions.clear();
         mapOrphanTransactionsByPrev.clear();
+        mapOrphanPeerUsage.clear();
+        nOrphanTransactionsBytes = 0;
     }
 } instance_of_cmaincleanup;
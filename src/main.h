@@ -41,6 +41,7 @@
 class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
+class CCoinsViewDB;
 class CInv;
 class CScriptCheck;
 class CValidationInterface;
@@ -66,12 +67,34 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxorphantxsize, maximum kilobytes of orphan transactions kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE = 500;
+/** Largest orphan transaction we keep, in bytes */
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+/** Expiration time for orphan transactions in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum time between orphan transactions expire time checks in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+/** Default for -maxmempool, maximum megabytes of memory the mempool may use */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -limitancestorcount, max number of in-mempool ancestors a transaction may have */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 100;
+/** Default for -limitancestorsize, maximum kilobytes of a transaction with its in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 900;
+/** Default for -limitdescendantcount, max number of in-mempool descendants a transaction may have */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 1000;
+/** Default for -limitdescendantsize, maximum kilobytes of a transaction with its in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 2500;
+/** Number of transactions LoadMempool accepts per cs_main lock */
+static const unsigned int MEMPOOL_LOAD_BATCH_SIZE = 1000;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** The stdio buffer size used when appending to blk?????.dat and rev?????.dat files */
+static const unsigned int BLOCKFILE_WRITE_BUFFER_SIZE = 0x100000; // 1 MiB
 /** Coinbase transaction outputs can only be spent after this number of new blocks (network rule) */
 static const int BREADCRUMBBASE_MATURITY = 100;
 /** Maximum number of script-checking threads allowed */
@@ -85,6 +108,32 @@ static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached their tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Default for -compactblocks, relaying new blocks as compact blocks to and from peers supporting them */
+static const bool DEFAULT_COMPACT_BLOCKS = true;
+/** Depth below the tip up to which blocks asked for in compact form are sent that way (and full otherwise) */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Depth below the tip up to which the transactions of a compact block are served */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Depth below the tip up to which blocks served to peers are kept in the relay cache */
+static const int MAX_RELAY_CACHE_BLOCK_DEPTH = 10;
+/** Maximum number of headers to announce when relaying blocks with headers message. */
+static const unsigned int MAX_BLOCKS_TO_ANNOUNCE = 8;
+/** Maximum number of transaction announcements tracked per peer; more are ignored until some are resolved */
+static const unsigned int MAX_PEER_TX_ANNOUNCEMENTS = 5000;
+/** Maximum number of transactions requested from a peer that it hasn't delivered yet */
+static const unsigned int MAX_PEER_TX_IN_FLIGHT = 100;
+/** Time in seconds to wait for a requested transaction before asking another peer that announced it */
+static const unsigned int TX_REQUEST_TIMEOUT = 60;
+/** Delay in seconds before requesting a transaction from an inbound peer, so outbound peers get asked first */
+static const unsigned int INBOUND_PEER_TX_DELAY = 2;
+/** Extra delay in seconds for transactions announced by a peer that has MAX_PEER_TX_IN_FLIGHT requests outstanding */
+static const unsigned int OVERLOADED_PEER_TX_DELAY = 2;
+/** Default for -feefilter, telling peers our mempool minimum fee rate so they skip announcing cheaper transactions */
+static const bool DEFAULT_FEEFILTER = true;
+/** Average delay (in seconds) between feefilter broadcasts */
+static const unsigned int AVG_FEEFILTER_BROADCAST_INTERVAL = 10 * 60;
+/** Maximum delay (in seconds) before sending a feefilter after our minimum fee rate changed substantially */
+static const unsigned int MAX_FEEFILTER_CHANGE_DELAY = 5 * 60;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
@@ -138,6 +187,7 @@ extern bool fCheckBlockIndex;
 extern unsigned int nCoinCacheSize;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
+extern bool fCompactBlocks;
 
 /** Best header we've seen so far (used for getheaders queries' starting points). */
 extern CBlockIndex *pindexBestHeader;
@@ -189,6 +239,8 @@ bool LoadBlockIndex();
 void UnloadBlockIndex();
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
+/** Whether ProcessMessage handles strCommand */
+bool IsKnownMessageType(const std::string& strCommand);
 /**
  * Send queued protocol messages to be sent to a give node.
  *
@@ -222,7 +274,20 @@ void FlushStateToDisk();
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectInsaneFee=false);
+                        bool* pfMissingInputs, bool fRejectInsaneFee=false, int64_t nAcceptTime=0);
+
+/**
+ * Same as AcceptToMemoryPool, but for callers that do not hold cs_main: it
+ * is only taken for the policy and UTXO checks and for the insertion, and
+ * the scripts are verified in between without it.
+ */
+bool AcceptToMemoryPoolConcurrent(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                  bool* pfMissingInputs, bool fRejectInsaneFee=false);
+
+/** Save pool to mempool.dat, parents before children */
+bool DumpMempool(CTxMemPool& pool);
+/** Re-accept the transactions saved in mempool.dat into pool */
+bool LoadMempool(CTxMemPool& pool);
 
 
 struct CNodeStateStats {
@@ -547,6 +612,9 @@ extern CCoinsViewCache *pcoinsTip;
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/** Global variable that points to the coin database backing pcoinsTip (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
 struct CBlockTemplate
 {
     CBlock block;
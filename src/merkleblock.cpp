@@ -7,7 +7,17 @@
 
 #include "hash.h"
 #include "primitives/block.h" // for MAX_BLOCK_SIZE
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
 #include "utilstrencodings.h"
+#include "version.h"
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+
+#include <limits>
+
+#include <boost/foreach.hpp>
 
 using namespace std;
 
@@ -150,3 +160,105 @@ uint256 CPartialMerkleTree::ExtractMatches(std::vector<uint256> &vMatch) {
         return 0;
     return hashMerkleRoot;
 }
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) :
+    nNonce(GetRand(std::numeric_limits<uint64_t>::max())), header(block.GetBlockHeader())
+{
+    FillShortTxIDSelector();
+
+    // The coinbase is never in the receiver's mempool
+    vPrefilledTxn.resize(1);
+    vPrefilledTxn[0].index = 0;
+    vPrefilledTxn[0].tx = block.vtx[0];
+
+    vShortTxIDs.resize(block.vtx.size() - 1);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        vShortTxIDs[i - 1] = GetShortID(block.vtx[i].GetHash());
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector()
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << header << nNonce;
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write((const unsigned char*)&ss[0], ss.size()).Finalize(hash);
+    nShortIDKey0 = ReadLE64(hash);
+    nShortIDKey1 = ReadLE64(hash + 8);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(nShortIDKey0, nShortIDKey1, txhash) & 0xffffffffffffULL;
+}
+
+ReadStatus CPartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool)
+{
+    if (cmpctblock.header.IsNull() || cmpctblock.BlockTxCount() == 0 || cmpctblock.BlockTxCount() > MAX_BLOCK_TXN)
+        return READ_INVALID;
+
+    header = cmpctblock.header;
+    vTxnAvailable.assign(cmpctblock.BlockTxCount(), CTransactionRef());
+
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilledTxn) {
+        if (prefilled.index >= vTxnAvailable.size() || prefilled.tx.IsNull())
+            return READ_INVALID;
+        vTxnAvailable[prefilled.index] = MakeTransactionRef(prefilled.tx);
+    }
+
+    // Short IDs fill the positions that were not prefilled, in order
+    map<uint64_t, size_t> mapShortIDs;
+    size_t nIndex = 0;
+    BOOST_FOREACH(uint64_t nShortID, cmpctblock.vShortTxIDs) {
+        while (vTxnAvailable[nIndex])
+            nIndex++;
+        if (!mapShortIDs.insert(make_pair(nShortID, nIndex)).second)
+            return READ_FAILED; // two transactions of the block share a short ID
+        nIndex++;
+    }
+
+    // A short ID matching more than one mempool transaction is left to be
+    // fetched, rather than guessed at.
+    LOCK(pool.cs);
+    for (map<uint256, CTxMemPoolEntry>::const_iterator it = pool.mapTx.begin(); it != pool.mapTx.end() && !mapShortIDs.empty(); it++) {
+        map<uint64_t, size_t>::iterator idit = mapShortIDs.find(cmpctblock.GetShortID(it->first));
+        if (idit == mapShortIDs.end())
+            continue;
+        if (!vTxnAvailable[idit->second]) {
+            vTxnAvailable[idit->second] = it->second.GetSharedTx();
+        } else {
+            vTxnAvailable[idit->second].reset();
+            mapShortIDs.erase(idit);
+        }
+    }
+
+    return READ_OK;
+}
+
+bool CPartiallyDownloadedBlock::IsTxAvailable(size_t index) const
+{
+    return index < vTxnAvailable.size() && vTxnAvailable[index].get() != NULL;
+}
+
+ReadStatus CPartiallyDownloadedBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vtxMissing) const
+{
+    block = CBlock(header);
+    block.vtx.resize(vTxnAvailable.size());
+
+    size_t nMissing = 0;
+    for (size_t i = 0; i < vTxnAvailable.size(); i++) {
+        if (vTxnAvailable[i]) {
+            block.vtx[i] = *vTxnAvailable[i];
+        } else {
+            if (nMissing >= vtxMissing.size())
+                return READ_INVALID;
+            block.vtx[i] = vtxMissing[nMissing++];
+        }
+    }
+    if (nMissing != vtxMissing.size())
+        return READ_INVALID;
+
+    if (block.BuildMerkleTree() != header.hashMerkleRoot)
+        return READ_FAILED;
+
+    return READ_OK;
+}
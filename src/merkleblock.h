@@ -11,8 +11,11 @@
 #include "primitives/block.h"
 #include "bloom.h"
 
+#include <ios>
 #include <vector>
 
+class CTxMemPool;
+
 /** Data structure that represents a partial merkle tree.
  *
  * It represents a subset of the txid's of a known block, in a way that
@@ -148,4 +151,189 @@ public:
     }
 };
 
+
+/** Upper bound on the transactions in a block, as used for CPartialMerkleTree */
+static const unsigned int MAX_BLOCK_TXN = MAX_BLOCK_SIZE / 60; // 60 is the lower bound for the size of a serialized CTransaction
+
+/** Outcome of decoding a compact block or filling in its transactions */
+enum ReadStatus
+{
+    READ_OK,
+    READ_INVALID, //! the data is invalid; the peer that sent it misbehaved
+    READ_FAILED,  //! the block could not be rebuilt; fetch it in full instead
+};
+
+/** Transaction sent in full along with a compact block */
+class CPrefilledTransaction
+{
+public:
+    //! Position in the block; differentially encoded by CBlockHeaderAndShortTxIDs
+    uint16_t index;
+    CTransaction tx;
+
+    CPrefilledTransaction() : index(0) {}
+};
+
+/**
+ * Block sent as its header and 6-byte short IDs of its transactions, so that
+ * the receiver can rebuild it from its own mempool. Transactions the receiver
+ * cannot have, like the coinbase, are included in full.
+ *
+ * Short IDs are SipHash-2-4 of the txid, keyed by the SHA256 of the header and
+ * a random nonce, so colliding transactions cannot be prepared in advance.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    uint64_t nShortIDKey0, nShortIDKey1;
+    uint64_t nNonce;
+
+    void FillShortTxIDSelector();
+
+public:
+    static const int SHORTTXIDS_LENGTH = 6;
+
+    CBlockHeader header;
+    std::vector<uint64_t> vShortTxIDs;
+    std::vector<CPrefilledTransaction> vPrefilledTxn;
+
+    CBlockHeaderAndShortTxIDs() : nShortIDKey0(0), nShortIDKey1(0), nNonce(0) {}
+
+    /** Encode block, sending only its coinbase in full */
+    explicit CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return vShortTxIDs.size() + vPrefilledTxn.size(); }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(header);
+        READWRITE(nNonce);
+
+        uint64_t nCount = vShortTxIDs.size();
+        READWRITE(COMPACTSIZE(nCount));
+        if (ser_action.ForRead()) {
+            if (nCount > MAX_BLOCK_TXN)
+                throw std::ios_base::failure("CBlockHeaderAndShortTxIDs : too many short IDs");
+            vShortTxIDs.resize(nCount);
+        }
+        for (size_t i = 0; i < vShortTxIDs.size(); i++) {
+            uint32_t nLow = vShortTxIDs[i] & 0xffffffff;
+            uint16_t nHigh = (vShortTxIDs[i] >> 32) & 0xffff;
+            READWRITE(nLow);
+            READWRITE(nHigh);
+            if (ser_action.ForRead())
+                vShortTxIDs[i] = ((uint64_t)nHigh << 32) | nLow;
+        }
+
+        nCount = vPrefilledTxn.size();
+        READWRITE(COMPACTSIZE(nCount));
+        if (ser_action.ForRead()) {
+            if (nCount > MAX_BLOCK_TXN)
+                throw std::ios_base::failure("CBlockHeaderAndShortTxIDs : too many prefilled transactions");
+            vPrefilledTxn.resize(nCount);
+        }
+        // Each index is sent as its distance from the one after the previous
+        // index, so they are strictly increasing by construction.
+        uint64_t nNext = 0;
+        for (size_t i = 0; i < vPrefilledTxn.size(); i++) {
+            uint64_t nOffset = ser_action.ForRead() ? 0 : vPrefilledTxn[i].index - nNext;
+            READWRITE(COMPACTSIZE(nOffset));
+            if (ser_action.ForRead()) {
+                if (nNext + nOffset > 0xffff)
+                    throw std::ios_base::failure("CBlockHeaderAndShortTxIDs : prefilled index overflow");
+                vPrefilledTxn[i].index = nNext + nOffset;
+            }
+            READWRITE(vPrefilledTxn[i].tx);
+            nNext = (uint64_t)vPrefilledTxn[i].index + 1;
+        }
+
+        if (ser_action.ForRead())
+            FillShortTxIDSelector();
+    }
+};
+
+/** Request for the transactions of a compact block the receiver did not have */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    //! Positions in the block, in increasing order; differentially encoded
+    std::vector<uint16_t> vIndexes;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(blockhash);
+
+        uint64_t nCount = vIndexes.size();
+        READWRITE(COMPACTSIZE(nCount));
+        if (ser_action.ForRead()) {
+            if (nCount > MAX_BLOCK_TXN)
+                throw std::ios_base::failure("CBlockTransactionsRequest : too many indexes");
+            vIndexes.resize(nCount);
+        }
+        uint64_t nNext = 0;
+        for (size_t i = 0; i < vIndexes.size(); i++) {
+            uint64_t nOffset = ser_action.ForRead() ? 0 : vIndexes[i] - nNext;
+            READWRITE(COMPACTSIZE(nOffset));
+            if (ser_action.ForRead()) {
+                if (nNext + nOffset > 0xffff)
+                    throw std::ios_base::failure("CBlockTransactionsRequest : index overflow");
+                vIndexes[i] = nNext + nOffset;
+            }
+            nNext = (uint64_t)vIndexes[i] + 1;
+        }
+    }
+};
+
+/** The transactions asked for by a CBlockTransactionsRequest, in the same order */
+class CBlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> vtx;
+
+    CBlockTransactions() {}
+    explicit CBlockTransactions(const CBlockTransactionsRequest& req) :
+        blockhash(req.blockhash), vtx(req.vIndexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(blockhash);
+        READWRITE(vtx);
+    }
+};
+
+/**
+ * A compact block being rebuilt: the transactions found so far are shared
+ * with the mempool, and the rest are fetched from the peer that sent it.
+ */
+class CPartiallyDownloadedBlock
+{
+private:
+    std::vector<CTransactionRef> vTxnAvailable;
+
+public:
+    CBlockHeader header;
+
+    /** Fill in the prefilled transactions and whatever pool has of the rest */
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool);
+
+    bool IsTxAvailable(size_t index) const;
+
+    /**
+     * Build the full block, taking the transactions that were not available
+     * from vtxMissing, in order. READ_FAILED means the result did not match
+     * the header (e.g. after a short ID collision).
+     */
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtxMissing) const;
+};
+
 #endif // BITBREADCRUMB_MERKLEBLOCK_H
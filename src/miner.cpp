@@ -89,256 +89,448 @@ void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
         pblock->nBits = GetNextWorkRequired(pindexPrev, pblock);
 }
 
-CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
+/**
+ * Fills a block template by walking the mempool's priority and ancestor
+ * score indexes best-first. The last assembler is kept around so that the next
+ * CreateNewBlock call only has to look at transactions that arrived since.
+ */
+class CBlockAssembler
 {
-    // Create new block
-    auto_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
-    if(!pblocktemplate.get())
-        return NULL;
-    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
-
-    // -regtest only: allow overriding block.nVersion with
-    // -blockversion=N to test forking scenarios
-    if (Params().MineBlocksOnDemand())
-        pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
+public:
+    enum { TX_ADDED, TX_NO_ROOM, TX_SKIPPED };
+
+    CBlockTemplate blocktemplate;
+    CBlockIndex* pindexPrev;
+    const int nHeight;
+    const CScript scriptPubKey;
+    const int nBlockVersion;
+    const unsigned int nBlockMaxSize;
+    const unsigned int nBlockPrioritySize;
+    const unsigned int nBlockMinSize;
+
+    //! Mempool state this template reflects
+    uint64_t nLastSequence;
+    unsigned int nTransactionsReordered;
+
+private:
+    CCoinsViewCache view;
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    int nBlockSigOps;
+    CAmount nFees;
+    CFeeRate feeRateFloor; //! Lowest fee rate taken in fee order, 0 if none
+    bool fPrintPriority;
+
+    std::set<uint256> setIncluded;
+    std::set<uint256> setSeen;
+    std::vector<uint256> vRetry; //! Not final yet, or waiting on such; looked at again when patching
+    std::map<uint256, COrphan> mapWaiting; //! Waiting for in-mempool parents to enter the block
+    std::vector<TxPriority> vecReady; //! Heap of waiting transactions whose parents all made it
+    TxPriorityCompare comparer;
+
+    double GetPriority(const CTxMemPoolEntry& entry, double dIndexPriority) const
+    {
+        // mapIndex holds the priority on entry; its coins have aged since.
+        return dIndexPriority + entry.GetPriority(nHeight) - entry.GetPriority(entry.GetHeight());
+    }
 
-    // Create coinbase tx
-    CMutableTransaction txNew;
-    txNew.vin.resize(1);
-    txNew.vin[0].prevout.SetNull();
-    txNew.vout.resize(1);
-    txNew.vout[0].scriptPubKey = scriptPubKeyIn;
+    int TryAdd(const CTxMemPoolEntry& entry, double dPriority, const CFeeRate& feeRate, bool fSortedByFee);
+    /** index is keyed by the current priority when !fSortedByFee */
+    template <typename Index> void AddFromIndex(const Index& index, bool fSortedByFee);
+    void AddPackages();
 
-    // Add dummy coinbase tx as first transaction
-    pblock->vtx.push_back(CTransaction());
-    pblocktemplate->vTxFees.push_back(-1); // updated at end
-    pblocktemplate->vTxSigOps.push_back(-1); // updated at end
+public:
+    CBlockAssembler(CBlockIndex* pindexPrevIn, const CScript& scriptPubKeyIn, int nBlockVersionIn,
+                    unsigned int nBlockMaxSizeIn, unsigned int nBlockPrioritySizeIn, unsigned int nBlockMinSizeIn) :
+        pindexPrev(pindexPrevIn), nHeight(pindexPrevIn->nHeight + 1), scriptPubKey(scriptPubKeyIn),
+        nBlockVersion(nBlockVersionIn), nBlockMaxSize(nBlockMaxSizeIn),
+        nBlockPrioritySize(nBlockPrioritySizeIn), nBlockMinSize(nBlockMinSizeIn),
+        nLastSequence(mempool.GetLastSequence()), nTransactionsReordered(mempool.GetTransactionsReordered()),
+        view(pcoinsTip), nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0), feeRateFloor(0),
+        fPrintPriority(GetBoolArg("-printpriority", false)), comparer(false)
+    {
+        blocktemplate.block.nVersion = nBlockVersion;
+        // Add dummy coinbase tx as first transaction
+        blocktemplate.block.vtx.push_back(CTransaction());
+        blocktemplate.vTxFees.push_back(-1); // updated at end
+        blocktemplate.vTxSigOps.push_back(-1); // updated at end
+    }
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
+    bool IsCompatible(const CBlockIndex* pindexPrevIn, const CScript& scriptPubKeyIn, int nBlockVersionIn,
+                      unsigned int nBlockMaxSizeIn, unsigned int nBlockPrioritySizeIn, unsigned int nBlockMinSizeIn) const
+    {
+        return pindexPrev == pindexPrevIn && nHeight == pindexPrevIn->nHeight + 1 &&
+               scriptPubKey == scriptPubKeyIn && nBlockVersion == nBlockVersionIn &&
+               nBlockMaxSize == nBlockMaxSizeIn && nBlockPrioritySize == nBlockPrioritySizeIn &&
+               nBlockMinSize == nBlockMinSizeIn &&
+               nTransactionsReordered == mempool.GetTransactionsReordered();
+    }
 
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+    /** Fill an empty template from the whole mempool */
+    void AddTransactions();
+    /**
+     * Extend the template with transactions that arrived after it was built.
+     * Returns false if a rebuild would make a better block.
+     */
+    bool AddNewTransactions();
+    /** Fill in the coinbase and header, and check the result */
+    bool Finish(CValidationState& state);
+};
 
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+int CBlockAssembler::TryAdd(const CTxMemPoolEntry& entry, double dPriority, const CFeeRate& feeRate, bool fSortedByFee)
+{
+    const CTransaction& tx = entry.GetTx();
+    const uint256& hash = tx.GetHash();
+    if (tx.IsCoinBase())
+        return TX_SKIPPED;
+    if (!IsFinalTx(tx, nHeight)) {
+        vRetry.push_back(hash);
+        return TX_SKIPPED;
+    }
 
-    // Collect memory pool transactions into the block
-    CAmount nFees = 0;
+    // Size limits
+    unsigned int nTxSize = entry.GetTxSize();
+    if (nBlockSize + nTxSize >= nBlockMaxSize)
+        return TX_NO_ROOM;
 
-    {
-        LOCK2(cs_main, mempool.cs);
-        CBlockIndex* pindexPrev = chainActive.Tip();
-        const int nHeight = pindexPrev->nHeight + 1;
-        CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
-        {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight))
-                continue;
+    // Legacy limits on sigOps:
+    unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+    if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        return TX_NO_ROOM;
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
+    // Skip free transactions if we're past the minimum block size:
+    double dPriorityDelta = 0;
+    CAmount nFeeDelta = 0;
+    mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
+    if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+        return TX_SKIPPED;
 
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
+    if (!view.HaveInputs(tx))
+        return TX_SKIPPED;
 
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
+    CAmount nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
 
-                int nConf = nHeight - coins->nHeight;
+    nTxSigOps += GetP2SHSigOpCount(tx, view);
+    if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        return TX_NO_ROOM;
 
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
+    // Note that flags: we don't want to set mempool/IsStandard()
+    // policy here, but we still have to ensure that the block we
+    // create only contains transactions that are valid in new blocks.
+    CValidationState state;
+    if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+        return TX_SKIPPED;
+
+    CTxUndo txundo;
+    UpdateCoins(tx, state, view, txundo, nHeight);
+
+    // Added
+    blocktemplate.block.vtx.push_back(tx);
+    blocktemplate.vTxFees.push_back(nTxFees);
+    blocktemplate.vTxSigOps.push_back(nTxSigOps);
+    nBlockSize += nTxSize;
+    ++nBlockTx;
+    nBlockSigOps += nTxSigOps;
+    nFees += nTxFees;
+    setIncluded.insert(hash);
+    if (fSortedByFee && (feeRateFloor == CFeeRate(0) || feeRate < feeRateFloor))
+        feeRateFloor = feeRate;
+
+    if (fPrintPriority)
+    {
+        LogPrintf("priority %.1f fee %s txid %s\n",
+            dPriority, feeRate.ToString(), tx.GetHash().ToString());
+    }
 
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
+    // Transactions that were only waiting for this one can go next
+    BOOST_FOREACH(const uint256& hashChild, mempool.mapIndex[hash].setChildren)
+    {
+        std::map<uint256, COrphan>::iterator it = mapWaiting.find(hashChild);
+        if (it == mapWaiting.end())
+            continue;
+        it->second.setDependsOn.erase(hash);
+        if (it->second.setDependsOn.empty())
+        {
+            vecReady.push_back(TxPriority(it->second.dPriority, it->second.feeRate, it->second.ptx));
+            std::push_heap(vecReady.begin(), vecReady.end(), comparer);
+            mapWaiting.erase(it);
+        }
+    }
+    return TX_ADDED;
+}
 
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
+template <typename Index>
+void CBlockAssembler::AddFromIndex(const Index& index, bool fSortedByFee)
+{
+    comparer = TxPriorityCompare(fSortedByFee);
+    std::make_heap(vecReady.begin(), vecReady.end(), comparer);
 
-            CFeeRate feeRate(nTotalIn-tx.GetValueOut(), nTxSize);
+    typename Index::const_reverse_iterator it = index.rbegin();
+    while (true)
+    {
+        // Skip whatever an earlier phase already dealt with
+        while (it != index.rend() && setSeen.count(it->second))
+            ++it;
+        if (it == index.rend() && vecReady.empty())
+            break;
+
+        // Take the better of the next indexed transaction and the best one
+        // whose parents have just been added
+        TxPriority next;
+        bool fFromIndex = false;
+        if (it != index.rend())
+        {
+            const CTxMemPoolIndexEntry& indexEntry = mempool.mapIndex[it->second];
+            next = TxPriority(it->first, indexEntry.feeRate, &mempool.mapTx[it->second].GetTx());
+            fFromIndex = vecReady.empty() || !comparer(next, vecReady.front());
+        }
+        if (!fFromIndex)
+            next = vecReady.front();
+        const CTransaction& tx = *next.get<2>();
+        const uint256& hash = tx.GetHash();
+        const CTxMemPoolEntry& entry = mempool.mapTx[hash];
 
-            if (porphan)
+        if (fFromIndex)
+        {
+            // Has to wait for in-mempool parents that are not in the block yet
+            COrphan orphan(&tx);
+            BOOST_FOREACH(const uint256& hashParent, mempool.mapIndex[hash].setParents)
+                if (!setIncluded.count(hashParent))
+                    orphan.setDependsOn.insert(hashParent);
+            if (!orphan.setDependsOn.empty())
             {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
+                orphan.dPriority = next.get<0>();
+                orphan.feeRate = next.get<1>();
+                mapWaiting.insert(std::make_pair(hash, orphan));
+                setSeen.insert(hash);
+                ++it;
+                continue;
             }
-            else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
         }
 
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
+        if (fFromIndex)
+            ++it;
+        else
         {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+            std::pop_heap(vecReady.begin(), vecReady.end(), comparer);
+            vecReady.pop_back();
+        }
 
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
+        // Prioritise by fee once past the priority size or we run out of
+        // high-priority transactions; the fee phase gets another look at
+        // anything left out here.
+        double dPriority = next.get<0>();
+        if (!fSortedByFee &&
+            ((nBlockSize + entry.GetTxSize() >= nBlockPrioritySize) || !AllowFree(dPriority)))
+        {
+            setSeen.erase(hash);
+            break;
+        }
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+        setSeen.insert(hash);
+        TryAdd(entry, dPriority, next.get<1>(), fSortedByFee);
+    }
+}
 
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+void CBlockAssembler::AddPackages()
+{
+    // Whatever the priority phase left waiting for parents gets another
+    // look as part of its package.
+    for (std::map<uint256, COrphan>::const_iterator it = mapWaiting.begin(); it != mapWaiting.end(); ++it)
+        setSeen.erase(it->first);
+    BOOST_FOREACH(const TxPriority& txPriority, vecReady)
+        setSeen.erase(txPriority.get<2>()->GetHash());
+    mapWaiting.clear();
+    vecReady.clear();
+
+    std::set<std::pair<CFeeRate, uint256> >::const_reverse_iterator it = mempool.setByAncestorScore.rbegin();
+    for (; it != mempool.setByAncestorScore.rend(); ++it)
+    {
+        const uint256& hash = it->second;
+        if (setSeen.count(hash) || setIncluded.count(hash))
+            continue;
+
+        // A transaction goes in together with the ancestors it needs, so
+        // a child can pay for its parents. Fewer ancestors sorts parents first.
+        std::set<uint256> setPackage;
+        mempool.CalculateAncestors(hash, setPackage);
+        setPackage.insert(hash);
+        std::vector<std::pair<int64_t, uint256> > vPackage;
+        uint64_t nPackageSize = 0;
+        bool fFailed = false;
+        BOOST_FOREACH(const uint256& hashMember, setPackage)
+        {
+            if (setIncluded.count(hashMember))
                 continue;
+            if (setSeen.count(hashMember))
+                fFailed = true;
+            vPackage.push_back(std::make_pair(mempool.mapIndex[hashMember].nCountWithAncestors, hashMember));
+            nPackageSize += mempool.mapTx[hashMember].GetTxSize();
+        }
+        if (fFailed)
+        {
+            // An ancestor was already tried and left out
+            setSeen.insert(hash);
+            vRetry.push_back(hash);
+            continue;
+        }
+        if (nBlockSize + nPackageSize >= nBlockMaxSize)
+            continue;
 
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
+        std::sort(vPackage.begin(), vPackage.end());
+        for (unsigned int i = 0; i < vPackage.size(); i++)
+        {
+            const uint256& hashMember = vPackage[i].second;
+            const CTxMemPoolEntry& entry = mempool.mapTx[hashMember];
+            setSeen.insert(hashMember);
+            if (TryAdd(entry, GetPriority(entry, mempool.mapIndex[hashMember].dPriority), it->first, true) != TX_ADDED)
             {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                for (unsigned int j = i + 1; j < vPackage.size(); j++)
+                {
+                    setSeen.insert(vPackage[j].second);
+                    vRetry.push_back(vPackage[j].second);
+                }
+                break;
             }
+        }
+    }
+}
 
-            if (!view.HaveInputs(tx))
-                continue;
+void CBlockAssembler::AddTransactions()
+{
+    if (nBlockPrioritySize > 0)
+    {
+        // Only re-keys the index when the tip has moved since the last template
+        mempool.SetPriorityHeight(nHeight);
+        AddFromIndex(mempool.setByPriority, false);
+    }
+    AddPackages();
+    setSeen.clear();
 
-            CAmount nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
+    nLastSequence = mempool.GetLastSequence();
+}
 
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+bool CBlockAssembler::AddNewTransactions()
+{
+    std::vector<uint256> vCandidates;
+    vCandidates.swap(vRetry);
+    std::map<uint64_t, uint256>::const_iterator it = mempool.mapSequence.upper_bound(nLastSequence);
+    for (; it != mempool.mapSequence.end(); ++it)
+        vCandidates.push_back(it->second);
+    nLastSequence = mempool.GetLastSequence();
+
+    BOOST_FOREACH(const uint256& hash, vCandidates)
+    {
+        std::map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.find(hash);
+        if (mi == mempool.mapTx.end() || setIncluded.count(hash))
+            continue;
+        const CTxMemPoolEntry& entry = mi->second;
+        const CTxMemPoolIndexEntry& indexEntry = mempool.mapIndex[hash];
+
+        bool fParentsIncluded = true;
+        BOOST_FOREACH(const uint256& hashParent, indexEntry.setParents)
+            if (!setIncluded.count(hashParent))
+                fParentsIncluded = false;
+        if (!fParentsIncluded)
+        {
+            vRetry.push_back(hash);
+            continue;
+        }
 
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-                continue;
+        double dPriority = GetPriority(entry, indexEntry.dPriority);
+        bool fSortedByFee = (nBlockSize + entry.GetTxSize() >= nBlockPrioritySize) || !AllowFree(dPriority);
+        // A transaction that pays more than something already in the block
+        // but does not fit means the block should be rebuilt from scratch.
+        int nResult = TryAdd(entry, dPriority, indexEntry.feeRate, fSortedByFee);
+        if (nResult == TX_NO_ROOM && indexEntry.feeRate > feeRateFloor)
+            return false;
+        // Anything else left out may fit a later patch (TryAdd already
+        // kept the ones that are not final yet)
+        if (nResult != TX_ADDED && IsFinalTx(entry.GetTx(), nHeight))
+            vRetry.push_back(hash);
+    }
+    return true;
+}
 
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
+bool CBlockAssembler::Finish(CValidationState& state)
+{
+    CBlock *pblock = &blocktemplate.block; // pointer for convenience
 
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+    nLastBlockTx = nBlockTx;
+    nLastBlockSize = nBlockSize;
+    LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
 
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
+    // Compute final coinbase transaction.
+    CMutableTransaction txNew;
+    txNew.vin.resize(1);
+    txNew.vin[0].prevout.SetNull();
+    txNew.vout.resize(1);
+    txNew.vout[0].scriptPubKey = scriptPubKey;
+    txNew.vout[0].nValue = GetBlockValue(nHeight, nFees);
+    txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
+    pblock->vtx[0] = txNew;
+    blocktemplate.vTxFees[0] = -nFees;
+
+    // Fill in header
+    pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
+    UpdateTime(pblock, pindexPrev);
+    pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock);
+    pblock->nNonce         = 0;
+    blocktemplate.vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
+
+    return TestBlockValidity(state, *pblock, pindexPrev, false, false);
+}
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+//! Last template handed out, protected by cs_main
+static CBlockAssembler* pcachedAssembler = NULL;
+
+CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
+{
+    // -regtest only: allow overriding block.nVersion with
+    // -blockversion=N to test forking scenarios
+    int nBlockVersion = CBlockHeader::CURRENT_VERSION;
+    if (Params().MineBlocksOnDemand())
+        nBlockVersion = GetArg("-blockversion", nBlockVersion);
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-        LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
-
-        // Compute final coinbase transaction.
-        txNew.vout[0].nValue = GetBlockValue(nHeight, nFees);
-        txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
-        pblock->vtx[0] = txNew;
-        pblocktemplate->vTxFees[0] = -nFees;
-
-        // Fill in header
-        pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
-        UpdateTime(pblock, pindexPrev);
-        pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock);
-        pblock->nNonce         = 0;
-        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
-
-        CValidationState state;
-        if (!TestBlockValidity(state, *pblock, pindexPrev, false, false))
-            throw std::runtime_error("CreateNewBlock() : TestBlockValidity failed");
+    // Largest block you're willing to create:
+    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
+
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+
+    LOCK2(cs_main, mempool.cs);
+    CBlockIndex* pindexPrev = chainActive.Tip();
+
+    // Patch the last template if nothing left the mempool since it was
+    // built, otherwise collect memory pool transactions into a new block.
+    bool fPatched = pcachedAssembler &&
+        pcachedAssembler->IsCompatible(pindexPrev, scriptPubKeyIn, nBlockVersion, nBlockMaxSize, nBlockPrioritySize, nBlockMinSize) &&
+        pcachedAssembler->AddNewTransactions();
+    if (!fPatched)
+    {
+        delete pcachedAssembler;
+        pcachedAssembler = new CBlockAssembler(pindexPrev, scriptPubKeyIn, nBlockVersion, nBlockMaxSize, nBlockPrioritySize, nBlockMinSize);
+        pcachedAssembler->AddTransactions();
+    }
+
+    CValidationState state;
+    if (!pcachedAssembler->Finish(state))
+    {
+        delete pcachedAssembler;
+        pcachedAssembler = NULL;
+        throw std::runtime_error("CreateNewBlock() : TestBlockValidity failed");
     }
 
-    return pblocktemplate.release();
+    return new CBlockTemplate(pcachedAssembler->blocktemplate);
 }
 
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
@@ -12,6 +12,7 @@
 #include "addrman.h"
 #include "chainparams.h"
 #include "clientversion.h"
+#include "memusage.h"
 #include "primitives/transaction.h"
 #include "ui_interface.h"
 
@@ -19,6 +20,7 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -29,6 +31,8 @@
 #endif
 
 #include <boost/filesystem.hpp>
+#include <boost/function.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/thread.hpp>
 
 // Dump addresses to peers.dat every 15 minutes (900s)
@@ -38,6 +42,10 @@
 #define MSG_NOSIGNAL 0
 #endif
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 // Fix for ancient MinGW versions, that don't have defined these in ws2tcpip.h.
 // Todo: Can be removed when our pull-tester is upgraded to a modern MinGW version.
 #ifdef WIN32
@@ -82,10 +90,14 @@ bool fAddressesInitialized = false;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
-deque<pair<int64_t, CInv> > vRelayExpiration;
-CCriticalSection cs_mapRelay;
-limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
+CRelayCache relayCache(DEFAULT_RELAY_CACHE_SIZE * 1000000);
+static CCriticalSection cs_fileCapture;
+static CAutoFile* pfileCapture = NULL; //! protected by cs_fileCapture
+static uint64_t nCaptureSize = 0; //! size of the capture file, protected by cs_fileCapture
+static uint64_t nCaptureMaxSize = 0; //! protected by cs_fileCapture
+//! Whether pfileCapture is open. Read without cs_fileCapture, so that the
+//! message handler threads don't queue up on it when nothing is captured.
+static volatile bool fCapturing = false;
 
 static deque<string> vOneShots;
 CCriticalSection cs_vOneShots;
@@ -105,6 +117,25 @@ static CSemaphore *semOutbound = NULL;
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
 
+#ifdef USE_EPOLL
+/** Most socket events ThreadSocketHandler picks up per epoll_wait call */
+static const int MAX_SOCKET_EVENTS = 256;
+/** epoll instance the listening and peer sockets are registered with */
+static int hSocketEvents = -1;
+
+static bool RegisterSocketEvents(SOCKET hSocket, void* ptr, uint32_t nEvents)
+{
+    struct epoll_event event;
+    event.events = nEvents;
+    event.data.ptr = ptr;
+    if (epoll_ctl(hSocketEvents, EPOLL_CTL_ADD, hSocket, &event) == SOCKET_ERROR) {
+        LogPrintf("Error: Couldn't watch socket for events: %s\n", NetworkErrorString(WSAGetLastError()));
+        return false;
+    }
+    return true;
+}
+#endif
+
 void AddOneShot(string strDest)
 {
     LOCK(cs_vOneShots);
@@ -349,6 +380,9 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+CCriticalSection CNode::cs_totalMsgStats;
+MsgStatsMap CNode::mapTotalRecvMsgStats;
+MsgStatsMap CNode::mapTotalSendMsgStats;
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -414,6 +448,10 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
         pnode->AddRef();
+#ifdef USE_EPOLL
+        if (!RegisterSocketEvents(hSocket, pnode, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET))
+            pnode->CloseSocketDisconnect();
+#endif
 
         {
             LOCK(cs_vNodes);
@@ -537,6 +575,15 @@ void CNode::copyStats(CNodeStats &stats)
     X(nSendBytes);
     X(nRecvBytes);
     X(fWhitelisted);
+    {
+        LOCK(cs_feeFilter);
+        X(minFeeFilter);
+    }
+    {
+        LOCK(cs_msgStats);
+        X(mapRecvMsgStats);
+        X(mapSendMsgStats);
+    }
 
     // It is common for nodes with good ping times to suddenly become lagged,
     // due to a new block arriving or other large transfer.
@@ -595,22 +642,85 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
     return true;
 }
 
+/**
+ * Receive buffers are handed out in a few size classes and kept on free lists
+ * when their message is done with, so a busy node mostly reuses buffers rather
+ * than allocating and freeing one for every message. A message moves up to
+ * the next class as its data arrives, so the memory committed ahead of what a
+ * peer actually sent stays bounded.
+ */
+static const int RECV_BUFFER_CLASSES = 5;
+static const size_t RECV_BUFFER_CLASS_SIZE[RECV_BUFFER_CLASSES] = {4 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024, MAX_PROTOCOL_MESSAGE_LENGTH};
+/** Number of idle buffers kept per size class */
+static const size_t RECV_BUFFER_CLASS_KEEP[RECV_BUFFER_CLASSES] = {64, 16, 4, 2, 1};
+static std::vector<std::vector<char> > vRecvBufferPool[RECV_BUFFER_CLASSES];
+static CCriticalSection cs_vRecvBufferPool;
+
+/** Put a buffer that is no longer needed on the free list of its class */
+static void ReleaseRecvBuffer(std::vector<char>& vch)
+{
+    if (vch.capacity() < RECV_BUFFER_CLASS_SIZE[0])
+        return;
+    int nClass = RECV_BUFFER_CLASSES - 1;
+    while (vch.capacity() < RECV_BUFFER_CLASS_SIZE[nClass])
+        nClass--;
+
+    LOCK(cs_vRecvBufferPool);
+    if (vRecvBufferPool[nClass].size() >= RECV_BUFFER_CLASS_KEEP[nClass])
+        return;
+    vch.clear();
+    vRecvBufferPool[nClass].push_back(std::vector<char>());
+    vRecvBufferPool[nClass].back().swap(vch);
+}
+
+/** Move the contents of vRecv to a buffer of the smallest class that holds nSize bytes */
+static void GrowRecvBuffer(CNetDataStream& vRecv, size_t nSize)
+{
+    std::vector<char> vch;
+    int nClass = 0;
+    while (nClass < RECV_BUFFER_CLASSES && RECV_BUFFER_CLASS_SIZE[nClass] < nSize)
+        nClass++;
+    if (nClass < RECV_BUFFER_CLASSES) {
+        {
+            LOCK(cs_vRecvBufferPool);
+            if (!vRecvBufferPool[nClass].empty()) {
+                vch.swap(vRecvBufferPool[nClass].back());
+                vRecvBufferPool[nClass].pop_back();
+            }
+        }
+        vch.reserve(RECV_BUFFER_CLASS_SIZE[nClass]);
+    } else {
+        vch.reserve(nSize);
+    }
+
+    vch.insert(vch.end(), vRecv.begin(), vRecv.end());
+    vRecv.SwapBuffer(vch);
+    ReleaseRecvBuffer(vch);
+}
+
+CNetMessage::~CNetMessage()
+{
+    std::vector<char> vch;
+    vRecv.SwapBuffer(vch);
+    ReleaseRecvBuffer(vch);
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
+    unsigned int nRemaining = sizeof(hdrbuf) - nHdrPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
     memcpy(&hdrbuf[nHdrPos], pch, nCopy);
     nHdrPos += nCopy;
 
     // if header incomplete, exit
-    if (nHdrPos < 24)
+    if (nHdrPos < sizeof(hdrbuf))
         return nCopy;
 
     // deserialize to CMessageHeader
     try {
-        hdrbuf >> hdr;
+        CDataReader(hdrbuf, sizeof(hdrbuf), vRecv.GetType(), vRecv.GetVersion()) >> hdr;
     }
     catch (const std::exception &) {
         return -1;
@@ -631,12 +741,10 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
-    }
+    if (vRecv.capacity() < nDataPos + nCopy)
+        GrowRecvBuffer(vRecv, nDataPos + nCopy);
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    vRecv.write(pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
@@ -650,26 +758,272 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+CSharedPayload::CSharedPayload(std::vector<char>& vData)
+{
+    uint256 hash = Hash(vData.begin(), vData.end());
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    boost::shared_ptr<std::vector<char> > pdata = boost::make_shared<std::vector<char> >();
+    pdata->swap(vData);
+    data = pdata;
+}
+
+CRelayCache::CRelayCache(size_t nMaxUsageIn) : nUsage(0), nMaxUsage(nMaxUsageIn)
+{
+}
+
+size_t CRelayCache::EntryUsage(const CSharedPayload& payload)
+{
+    return memusage::DynamicUsage(payload.data) + memusage::DynamicUsage(*payload.data) +
+        memusage::MallocUsage(sizeof(memusage::stl_tree_node<std::pair<const CInv, EntryList::iterator> >)) +
+        memusage::MallocUsage(sizeof(EntryList::value_type) + 2 * sizeof(void*));
+}
+
+void CRelayCache::Erase(EntryList::iterator it)
+{
+    nUsage -= EntryUsage(it->payload);
+    mapEntries.erase(it->inv);
+    listEntries.erase(it);
+}
+
+void CRelayCache::Trim()
+{
+    while (nUsage > nMaxUsage && !listEntries.empty())
+        Erase(--listEntries.end());
+}
+
+void CRelayCache::Insert(const CInv& inv, const CSharedPayload& payload)
+{
+    LOCK(cs);
+    int64_t nNow = GetTime();
+    map<CInv, EntryList::iterator>::iterator mi = mapEntries.find(inv);
+    if (mi != mapEntries.end()) {
+        if (mi->second->nTimeExpire > nNow) {
+            // Keep the payload we have, peers may already be sent it
+            listEntries.splice(listEntries.begin(), listEntries, mi->second);
+            return;
+        }
+        Erase(mi->second);
+    }
+    listEntries.push_front(CEntry(inv, payload, nNow + RELAY_CACHE_EXPIRY));
+    mapEntries.insert(std::make_pair(inv, listEntries.begin()));
+    nUsage += EntryUsage(payload);
+    Trim();
+}
+
+bool CRelayCache::Get(const CInv& inv, CSharedPayload& payload)
+{
+    LOCK(cs);
+    map<CInv, EntryList::iterator>::iterator mi = mapEntries.find(inv);
+    if (mi == mapEntries.end())
+        return false;
+    if (mi->second->nTimeExpire <= GetTime()) {
+        Erase(mi->second);
+        return false;
+    }
+    listEntries.splice(listEntries.begin(), listEntries, mi->second);
+    payload = mi->second->payload;
+    return true;
+}
+
+void CRelayCache::SetMaxUsage(size_t nMaxUsageIn)
+{
+    LOCK(cs);
+    nMaxUsage = nMaxUsageIn;
+    Trim();
+}
+
+size_t CRelayCache::GetUsage() const
+{
+    LOCK(cs);
+    return nUsage;
+}
+
+size_t CRelayCache::size() const
+{
+    LOCK(cs);
+    return mapEntries.size();
+}
+
+static const char pchCaptureMagic[8] = {'m', 's', 'g', 'c', 'a', 'p', 't', 0};
+
+CCaptureFileHeader::CCaptureFileHeader()
+{
+    memcpy(pchMagic, pchCaptureMagic, sizeof(pchMagic));
+    nVersion = CURRENT_VERSION;
+    memcpy(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE);
+}
+
+bool CCaptureFileHeader::IsValid() const
+{
+    return memcmp(pchMagic, pchCaptureMagic, sizeof(pchMagic)) == 0 && nVersion == CURRENT_VERSION &&
+           memcmp(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE) == 0;
+}
+
+bool OpenMessageCapture(const boost::filesystem::path& path, uint64_t nMaxSize)
+{
+    LOCK(cs_fileCapture);
+    if (pfileCapture)
+        return true;
+
+    uint64_t nSize = boost::filesystem::exists(path) ? boost::filesystem::file_size(path) : 0;
+    if (nSize > 0) {
+        // Only append to a log of the same format and network
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        CCaptureFileHeader header;
+        bool fValid = false;
+        try {
+            filein >> header;
+            fValid = header.IsValid();
+        } catch (const std::exception&) {
+        }
+        if (!fValid)
+            return error("%s: %s is not a message capture from this network", __func__, path.string());
+    }
+
+    FILE* file = fopen(path.string().c_str(), "ab");
+    if (!file)
+        return error("%s: failed to open %s", __func__, path.string());
+    pfileCapture = new CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (nSize == 0) {
+        CCaptureFileHeader header;
+        try {
+            *pfileCapture << header;
+        } catch (const std::exception& e) {
+            delete pfileCapture;
+            pfileCapture = NULL;
+            return error("%s: failed to write to %s: %s", __func__, path.string(), e.what());
+        }
+        nSize = ::GetSerializeSize(header, SER_DISK, CLIENT_VERSION);
+    }
+    nCaptureSize = nSize;
+    nCaptureMaxSize = nMaxSize;
+    fCapturing = true;
+    LogPrintf("Capturing received messages to %s\n", path.string());
+    return true;
+}
+
+void CloseMessageCapture()
+{
+    LOCK(cs_fileCapture);
+    fCapturing = false;
+    delete pfileCapture;
+    pfileCapture = NULL;
+}
+
+void CaptureMessage(const CNode* pnode, const CNetMessage& msg)
+{
+    if (!fCapturing)
+        return;
+    LOCK(cs_fileCapture);
+    if (!pfileCapture)
+        return;
+
+    CCapturedMessage record;
+    record.nodeid = pnode->id;
+    record.fInbound = pnode->fInbound;
+    record.nTime = msg.nTime;
+    record.strCommand = msg.hdr.GetCommand();
+    record.vPayload.assign(msg.vRecv.begin(), msg.vRecv.begin() + msg.hdr.nMessageSize);
+    uint64_t nRecordSize = ::GetSerializeSize(record, SER_DISK, CLIENT_VERSION);
+    if (nCaptureSize + nRecordSize > nCaptureMaxSize) {
+        LogPrintf("%s: -capturemaxsize reached, no longer capturing\n", __func__);
+        fCapturing = false;
+        delete pfileCapture;
+        pfileCapture = NULL;
+        return;
+    }
+    try {
+        *pfileCapture << record;
+        nCaptureSize += nRecordSize;
+    } catch (const std::exception& e) {
+        LogPrintf("%s: write failed, no longer capturing: %s\n", __func__, e.what());
+        fCapturing = false;
+        delete pfileCapture;
+        pfileCapture = NULL;
+    }
+}
+
+/** Maximum number of buffers handed to a single send call */
+static const int MAX_SEND_SEGMENTS = 64;
+
+struct CSendSegment
+{
+    const char* pch;
+    size_t nLen;
+};
+
+/**
+ * Send the given buffers back to back, with a single sendmsg() call where
+ * the platform has one. Returns the number of bytes sent, or -1 on error.
+ */
+static int SendSegments(SOCKET hSocket, const CSendSegment* pseg, int nSegments)
+{
+#ifdef WIN32
+    return send(hSocket, pseg[0].pch, pseg[0].nLen, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+    struct iovec iov[MAX_SEND_SEGMENTS];
+    for (int i = 0; i < nSegments; i++) {
+        iov[i].iov_base = (void*)pseg[i].pch;
+        iov[i].iov_len = pseg[i].nLen;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = nSegments;
+    return sendmsg(hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+}
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CNetSendMsg>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        // Gather the headers and payloads of as many queued messages as fit
+        // in one call, leaving out what was already sent of the first one.
+        assert(it->size() > pnode->nSendOffset);
+        CSendSegment seg[MAX_SEND_SEGMENTS];
+        int nSegments = 0;
+        size_t nOffered = 0;
+        size_t nSkip = pnode->nSendOffset;
+        for (std::deque<CNetSendMsg>::const_iterator mi = it; mi != pnode->vSendMsg.end() && nSegments + 2 <= MAX_SEND_SEGMENTS; mi++) {
+            if (nSkip < mi->nHeaderSize) {
+                seg[nSegments].pch = mi->pchHeader + nSkip;
+                seg[nSegments].nLen = mi->nHeaderSize - nSkip;
+                nOffered += seg[nSegments++].nLen;
+                nSkip = 0;
+            } else {
+                nSkip -= mi->nHeaderSize;
+            }
+            const std::vector<char>& payload = *mi->payload;
+            if (nSkip < payload.size()) {
+                seg[nSegments].pch = &payload[nSkip];
+                seg[nSegments].nLen = payload.size() - nSkip;
+                nOffered += seg[nSegments++].nLen;
+            }
+            nSkip = 0;
+        }
+
+        int nBytes = SendSegments(pnode->hSocket, seg, nSegments);
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                size_t nRemaining = it->size() - pnode->nSendOffset;
+                if (nLeft < nRemaining) {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nRemaining;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= it->size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            if ((size_t)nBytes < nOffered) {
+                // could not send everything offered; stop sending more
                 break;
             }
         } else {
@@ -696,9 +1050,118 @@ void SocketSendData(CNode *pnode)
 
 static list<CNode*> vNodesDisconnected;
 
+/**
+ * Read what the socket has, up to one buffer full; call with cs_vRecvMsg
+ * held. Returns whether there may be more to read right away.
+ */
+static bool SocketRecvData(CNode *pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return true;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+static void AcceptConnection(const ListenSocket& hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+    }
+    else if (!IsSelectableSocket(hSocket))
+    {
+        LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
+        CloseSocket(hSocket);
+    }
+    else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+    {
+        LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
+        CloseSocket(hSocket);
+    }
+    else if (CNode::IsBanned(addr) && !whitelisted)
+    {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        CloseSocket(hSocket);
+    }
+    else
+    {
+        // According to the internet TCP_NODELAY is not carried into accepted sockets
+        // on all platforms.  Set it again here just to be sure.
+        int set = 1;
+#ifdef WIN32
+        setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, (const char*)&set, sizeof(int));
+#else
+        setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, (void*)&set, sizeof(int));
+#endif
+
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        pnode->fWhitelisted = whitelisted;
+#ifdef USE_EPOLL
+        if (!RegisterSocketEvents(hSocket, pnode, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET))
+            pnode->CloseSocketDisconnect();
+#endif
+
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+    }
+}
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+#ifdef USE_EPOLL
+    bool fSocketWork = false;
+#endif
     while (true)
     {
         //
@@ -764,6 +1227,49 @@ void ThreadSocketHandler()
             uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
         }
 
+#ifdef USE_EPOLL
+        //
+        // Collect readiness changes. Peer sockets are registered once and
+        // edge-triggered: an event only flags the peer, and the flag stays
+        // until a recv would block. Wait only when no peer has work left
+        // from the last round; the timeout still drives vSend and the
+        // inactivity checks below.
+        //
+        std::set<SOCKET> setAcceptReady;
+        {
+            struct epoll_event events[MAX_SOCKET_EVENTS];
+            int nEvents = epoll_wait(hSocketEvents, events, MAX_SOCKET_EVENTS, fSocketWork ? 0 : 50);
+            boost::this_thread::interruption_point();
+            if (nEvents == SOCKET_ERROR)
+            {
+                int nErr = WSAGetLastError();
+                if (nErr != WSAEINTR)
+                {
+                    LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(nErr));
+                    MilliSleep(50);
+                }
+                nEvents = 0;
+            }
+            for (int i = 0; i < nEvents; i++)
+            {
+                const ListenSocket* pListenSocket = NULL;
+                BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+                    if (events[i].data.ptr == &hListenSocket)
+                        pListenSocket = &hListenSocket;
+                if (pListenSocket)
+                {
+                    setAcceptReady.insert(pListenSocket->socket);
+                    continue;
+                }
+                CNode* pnode = (CNode*)events[i].data.ptr;
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    pnode->fSocketReadable = true;
+                if (events[i].events & EPOLLOUT)
+                    pnode->fSocketWriteEvent = true;
+            }
+        }
+        fSocketWork = false;
+#else
         //
         // Find which sockets have data to receive
         //
@@ -845,74 +1351,19 @@ void ThreadSocketHandler()
             FD_ZERO(&fdsetError);
             MilliSleep(timeout.tv_usec/1000);
         }
+#endif
 
         //
         // Accept new connections
         //
         BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
-            {
-                struct sockaddr_storage sockaddr;
-                socklen_t len = sizeof(sockaddr);
-                SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
-                CAddress addr;
-                int nInbound = 0;
-
-                if (hSocket != INVALID_SOCKET)
-                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                        LogPrintf("Warning: Unknown socket family\n");
-
-                bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH(CNode* pnode, vNodes)
-                        if (pnode->fInbound)
-                            nInbound++;
-                }
-
-                if (hSocket == INVALID_SOCKET)
-                {
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK)
-                        LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                }
-                else if (!IsSelectableSocket(hSocket))
-                {
-                    LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
-                    CloseSocket(hSocket);
-                }
-                else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
-                {
-                    LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                }
-                else if (CNode::IsBanned(addr) && !whitelisted)
-                {
-                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                }
-                else
-                {
-                    // According to the internet TCP_NODELAY is not carried into accepted sockets
-                    // on all platforms.  Set it again here just to be sure.
-                    int set = 1;
-#ifdef WIN32
-                    setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, (const char*)&set, sizeof(int));
+#ifdef USE_EPOLL
+            if (hListenSocket.socket != INVALID_SOCKET && setAcceptReady.count(hListenSocket.socket))
 #else
-                    setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, (void*)&set, sizeof(int));
+            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
 #endif
-
-                    CNode* pnode = new CNode(hSocket, addr, "", true);
-                    pnode->AddRef();
-                    pnode->fWhitelisted = whitelisted;
-
-                    {
-                        LOCK(cs_vNodes);
-                        vNodes.push_back(pnode);
-                    }
-                }
-            }
+                AcceptConnection(hListenSocket);
         }
 
         //
@@ -934,44 +1385,44 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+#ifdef USE_EPOLL
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                // Same policy as the select() interest: drain the send
+                // buffer first, and leave a full receive buffer alone.
+                bool fSendPending = false;
                 {
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend && pnode->fSocketWriteEvent)
                     {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
+                        pnode->fSocketWriteEvent = false;
+                        if (!pnode->vSendMsg.empty())
+                            SocketSendData(pnode);
+                    }
+                    else if (pnode->fSocketWriteEvent)
+                        fSocketWork = true;
+                    fSendPending = lockSend && !pnode->vSendMsg.empty();
+                }
+                if (pnode->fSocketReadable && !fSendPending)
+                {
+                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                    if (lockRecv && (
+                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    {
+                        if (SocketRecvData(pnode))
+                            fSocketWork = true;
+                        else
+                            pnode->fSocketReadable = false;
                     }
                 }
             }
+#else
+            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv)
+                    SocketRecvData(pnode);
+            }
 
             //
             // Send
@@ -984,6 +1435,7 @@ void ThreadSocketHandler()
                 if (lockSend)
                     SocketSendData(pnode);
             }
+#endif
 
             //
             // Inactivity checking
@@ -1431,23 +1883,34 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
-void ThreadMessageHandler()
+/**
+ * Message handler worker nWorker of nWorkers. Every peer is served by exactly
+ * one worker (chosen by node id), so a peer's messages are still processed in
+ * order while a slow peer only holds up the peers sharing its worker.
+ */
+void ThreadMessageHandler(int nWorker, int nWorkers)
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
     {
         vector<CNode*> vNodesCopy;
+        size_t nNodesTotal;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
+            nNodesTotal = vNodes.size();
+            BOOST_FOREACH(CNode* pnode, vNodes) {
+                if (pnode->id % nWorkers != nWorker)
+                    continue;
                 pnode->AddRef();
+                vNodesCopy.push_back(pnode);
             }
         }
 
-        // Poll the connected nodes for messages
+        // Poll the connected nodes for messages. Each worker picks its own
+        // trickle node with a probability proportional to its share of the
+        // peers, which keeps about one trickle node per round overall.
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
+        if (!vNodesCopy.empty() && GetRand(nNodesTotal) < vNodesCopy.size())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
         bool fSleep = true;
@@ -1650,8 +2113,25 @@ void static Discover(boost::thread_group& threadGroup)
 #endif
 }
 
-void StartNode(boost::thread_group& threadGroup)
+bool StartNode(boost::thread_group& threadGroup, string& strError)
 {
+#ifdef USE_EPOLL
+    if (hSocketEvents == -1) {
+        hSocketEvents = epoll_create1(EPOLL_CLOEXEC);
+        if (hSocketEvents == -1) {
+            strError = strprintf("Error: Couldn't create epoll instance: %s", NetworkErrorString(WSAGetLastError()));
+            LogPrintf("%s\n", strError);
+            return false;
+        }
+    }
+#endif
+
+    if (GetBoolArg("-capturemessages", false) &&
+        !OpenMessageCapture(GetDataDir() / "msgcapture.dat", GetArg("-capturemaxsize", DEFAULT_CAPTURE_MAX_SIZE) * 1000000)) {
+        strError = strprintf("Error: Couldn't capture messages to %s, see debug.log", (GetDataDir() / "msgcapture.dat").string());
+        return false;
+    }
+
     uiInterface.InitMessage(_("Loading addresses..."));
     // Load addresses for peers.dat
     int64_t nStart = GetTimeMillis();
@@ -1687,6 +2167,12 @@ void StartNode(boost::thread_group& threadGroup)
     // Map ports with UPnP
     MapPort(GetBoolArg("-upnp", DEFAULT_UPNP));
 
+#ifdef USE_EPOLL
+    // Listening sockets stay level-triggered, one accept per round as with select()
+    BOOST_FOREACH(ListenSocket& hListenSocket, vhListenSocket)
+        RegisterSocketEvents(hListenSocket.socket, &hListenSocket, EPOLLIN);
+#endif
+
     // Send and receive from sockets, accept connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
@@ -1696,11 +2182,18 @@ void StartNode(boost::thread_group& threadGroup)
     // Initiate outbound connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
+    relayCache.SetMaxUsage(GetArg("-relaycachesize", DEFAULT_RELAY_CACHE_SIZE) * 1000000);
+
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    int nMsgHandlerThreads = std::max(1, std::min((int)GetArg("-msghandlerthreads", DEFAULT_MSGHANDLER_THREADS), MAX_MSGHANDLER_THREADS));
+    for (int i = 0; i < nMsgHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand",
+                                              boost::function<void()>(boost::bind(&ThreadMessageHandler, i, nMsgHandlerThreads))));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
+
+    return true;
 }
 
 bool StopNode()
@@ -1716,6 +2209,7 @@ bool StopNode()
         DumpAddresses();
         fAddressesInitialized = false;
     }
+    CloseMessageCapture();
 
     return true;
 }
@@ -1744,6 +2238,11 @@ public:
         vNodes.clear();
         vNodesDisconnected.clear();
         vhListenSocket.clear();
+#ifdef USE_EPOLL
+        if (hSocketEvents != -1)
+            close(hSocketEvents);
+        hSocketEvents = -1;
+#endif
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -1765,28 +2264,14 @@ instance_of_cnetcleanup;
 
 void RelayTransaction(const CTransaction& tx)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, ss);
+    RelayTransaction(tx, MakeSharedPayload(tx));
 }
 
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
+void RelayTransaction(const CTransaction& tx, const CSharedPayload& payload)
 {
     CInv inv(MSG_TX, tx.GetHash());
-    {
-        LOCK(cs_mapRelay);
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
-        {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
-        }
-
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
-    }
+    // Save original serialized message so newer versions are preserved
+    relayCache.Insert(inv, payload);
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
@@ -1826,6 +2311,43 @@ uint64_t CNode::GetTotalBytesSent()
     return nTotalBytesSent;
 }
 
+void CNode::RecordRecvMsg(const std::string& strCommand, uint64_t nBytes, int64_t nTime, int64_t nLockWait)
+{
+    {
+        LOCK(cs_msgStats);
+        mapRecvMsgStats[strCommand].Add(nBytes, nTime, nLockWait);
+    }
+    LOCK(cs_totalMsgStats);
+    mapTotalRecvMsgStats[strCommand].Add(nBytes, nTime, nLockWait);
+}
+
+void CNode::RecordRecvTime(const std::string& strCommand, int64_t nTime, int64_t nLockWait)
+{
+    {
+        LOCK(cs_msgStats);
+        mapRecvMsgStats[strCommand].AddTime(nTime, nLockWait);
+    }
+    LOCK(cs_totalMsgStats);
+    mapTotalRecvMsgStats[strCommand].AddTime(nTime, nLockWait);
+}
+
+void CNode::RecordSendMsg(const std::string& strCommand, uint64_t nBytes, int64_t nTime)
+{
+    {
+        LOCK(cs_msgStats);
+        mapSendMsgStats[strCommand].Add(nBytes, nTime, 0);
+    }
+    LOCK(cs_totalMsgStats);
+    mapTotalSendMsgStats[strCommand].Add(nBytes, nTime, 0);
+}
+
+void CNode::GetTotalMsgStats(MsgStatsMap& mapRecv, MsgStatsMap& mapSend)
+{
+    LOCK(cs_totalMsgStats);
+    mapRecv = mapTotalRecvMsgStats;
+    mapSend = mapTotalSendMsgStats;
+}
+
 void CNode::Fuzz(int nChance)
 {
     if (!fSuccessfullyConnected) return; // Don't fuzz initial handshake
@@ -1965,7 +2487,10 @@ bool CAddrDB::Read(CAddrMan& addr)
 unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 
-CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) :
+    ssSend(SER_NETWORK, INIT_PROTO_VERSION),
+    addrKnown(ADDR_KNOWN_SIZE, ADDR_KNOWN_FP_RATE),
+    filterInventoryKnown(INVENTORY_KNOWN_SIZE, INVENTORY_KNOWN_FP_RATE)
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -1986,6 +2511,8 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     fNetworkNode = false;
     fSuccessfullyConnected = false;
     fDisconnect = false;
+    fSocketReadable = false;
+    fSocketWriteEvent = false;
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
@@ -1993,12 +2520,15 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nStartingHeight = -1;
     fGetAddr = false;
     fRelayTxes = false;
-    setInventoryKnown.max_size(SendBufferSize() / 1000);
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
     nPingUsecStart = 0;
     nPingUsecTime = 0;
     fPingQueued = false;
+    minFeeFilter = 0;
+    lastSentFeeFilter = 0;
+    nextSendTimeFeeFilter = 0;
+    nSendMsgStart = 0;
 
     {
         LOCK(cs_nLastNodeId);
@@ -2027,41 +2557,13 @@ CNode::~CNode()
     GetNodeSignals().FinalizeNode(GetId());
 }
 
-void CNode::AskFor(const CInv& inv)
-{
-    if (mapAskFor.size() > MAPASKFOR_MAX_SZ)
-        return;
-    // We're using mapAskFor as a priority queue,
-    // the key is the earliest time the request can be sent
-    int64_t nRequestTime;
-    limitedmap<CInv, int64_t>::const_iterator it = mapAlreadyAskedFor.find(inv);
-    if (it != mapAlreadyAskedFor.end())
-        nRequestTime = it->second;
-    else
-        nRequestTime = 0;
-    LogPrint("net", "askfor %s  %d (%s) peer=%d\n", inv.ToString(), nRequestTime, DateTimeStrFormat("%H:%M:%S", nRequestTime/1000000), id);
-
-    // Make sure not to reuse time indexes to keep things in the same order
-    int64_t nNow = GetTimeMicros() - 1000000;
-    static int64_t nLastTime;
-    ++nLastTime;
-    nNow = std::max(nNow, nLastTime);
-    nLastTime = nNow;
-
-    // Each retry is 2 minutes after the last
-    nRequestTime = std::max(nRequestTime + 2 * 60 * 1000000, nNow);
-    if (it != mapAlreadyAskedFor.end())
-        mapAlreadyAskedFor.update(it, nRequestTime);
-    else
-        mapAlreadyAskedFor.insert(std::make_pair(inv, nRequestTime));
-    mapAskFor.insert(std::make_pair(nRequestTime, inv));
-}
-
 void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
     assert(ssSend.size() == 0);
     ssSend << CMessageHeader(pszCommand, 0);
+    strSendCommand = pszCommand;
+    nSendMsgStart = GetTimeMicros();
     LogPrint("net", "sending: %s ", SanitizeString(pszCommand));
 }
 
@@ -2103,14 +2605,45 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
     memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
+    RecordSendMsg(strSendCommand, ssSend.size(), GetTimeMicros() - nSendMsgStart);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
-
-    // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
-        SocketSendData(this);
+    // The header was serialized in front of the payload, so the queued
+    // message needs none of its own.
+    CNetSendMsg msg;
+    boost::shared_ptr<std::vector<char> > pdata = boost::make_shared<std::vector<char> >();
+    ssSend.GetAndClear(*pdata);
+    msg.payload = pdata;
+    QueueSendMsg(msg);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
+
+void CNode::PushSharedMessage(const char* pszCommand, const CSharedPayload& payload)
+{
+    CMessageHeader hdr(pszCommand, payload.size());
+    hdr.nChecksum = payload.nChecksum;
+    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+    ssHeader << hdr;
+    assert(ssHeader.size() == CMessageHeader::HEADER_SIZE);
+
+    CNetSendMsg msg;
+    memcpy(msg.pchHeader, &ssHeader[0], ssHeader.size());
+    msg.nHeaderSize = ssHeader.size();
+    msg.payload = payload.data;
+
+    LOCK(cs_vSend);
+    LogPrint("net", "sending: %s (%d bytes, shared) peer=%d\n", SanitizeString(pszCommand), payload.size(), id);
+    RecordSendMsg(pszCommand, msg.size(), 0); // the payload was built once for all peers
+    QueueSendMsg(msg);
+}
+
+void CNode::QueueSendMsg(const CNetSendMsg& msg)
+{
+    vSendMsg.push_back(msg);
+    nSendSize += msg.size();
+
+    // If write queue was empty, attempt "optimistic write". Nodes without a
+    // socket, like the ones duckcoin-replay drives, just queue.
+    if (vSendMsg.size() == 1 && hSocket != INVALID_SOCKET)
+        SocketSendData(this);
+}
@@ -6,11 +6,10 @@
 #ifndef BITBREADCRUMB_NET_H
 #define BITBREADCRUMB_NET_H
 
+#include "amount.h"
 #include "bloom.h"
 #include "compat.h"
 #include "hash.h"
-#include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
@@ -19,7 +18,10 @@
 #include "uint256.h"
 #include "utilstrencodings.h"
 
+#include <algorithm>
 #include <deque>
+#include <list>
+#include <map>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -28,6 +30,7 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
@@ -46,6 +49,12 @@ static const int TIMEOUT_INTERVAL = 20 * 60;
 static const unsigned int MAX_INV_SZ = 50000;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
+/** Number of addresses remembered per peer as known to it, and the false positive rate of that filter */
+static const unsigned int ADDR_KNOWN_SIZE = 5000;
+static const double ADDR_KNOWN_FP_RATE = 0.001;
+/** Number of inventory items remembered per peer as known to it, and the false positive rate of that filter */
+static const unsigned int INVENTORY_KNOWN_SIZE = 10000;
+static const double INVENTORY_KNOWN_FP_RATE = 0.000001;
 /** Maximum length of incoming protocol messages (no message over 2 MiB is currently acceptable). */
 static const unsigned int MAX_PROTOCOL_MESSAGE_LENGTH = 2 * 1024 * 1024;
 /** -listen default */
@@ -56,8 +65,16 @@ static const bool DEFAULT_UPNP = USE_UPNP;
 #else
 static const bool DEFAULT_UPNP = false;
 #endif
-/** The maximum number of entries in mapAskFor */
-static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** Default number of message handler threads */
+static const int DEFAULT_MSGHANDLER_THREADS = 1;
+/** Maximum number of message handler threads */
+static const int MAX_MSGHANDLER_THREADS = 16;
+/** Default for -relaycachesize, the memory (in MB) for serialized transactions and blocks kept to serve peers */
+static const unsigned int DEFAULT_RELAY_CACHE_SIZE = 32;
+/** Seconds a relay cache entry may be served for after it was inserted */
+static const int64_t RELAY_CACHE_EXPIRY = 15 * 60;
+/** Default for -capturemaxsize, the size (in MB) msgcapture.dat may grow to before capturing stops */
+static const unsigned int DEFAULT_CAPTURE_MAX_SIZE = 1000;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -73,7 +90,7 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 void MapPort(bool fUseUPnP);
 unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhitelisted = false);
-void StartNode(boost::thread_group& threadGroup);
+bool StartNode(boost::thread_group& threadGroup, std::string& strError);
 bool StopNode();
 void SocketSendData(CNode *pnode);
 
@@ -129,10 +146,6 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
-extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
-extern CCriticalSection cs_mapRelay;
-extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
 
 extern std::vector<std::string> vAddedNodes;
 extern CCriticalSection cs_vAddedNodes;
@@ -148,6 +161,38 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/** Counters for one type of message, sent or received */
+class CMsgStats
+{
+public:
+    uint64_t nCount;
+    uint64_t nBytes;   //!< including message headers
+    int64_t nTime;     //!< usec spent processing them if received, building them if sent
+    int64_t nMaxTime;  //!< longest nTime of a single message
+    int64_t nLockWait; //!< part of nTime spent waiting for cs_main
+
+    CMsgStats() : nCount(0), nBytes(0), nTime(0), nMaxTime(0), nLockWait(0) {}
+
+    void Add(uint64_t nBytesIn, int64_t nTimeIn, int64_t nLockWaitIn)
+    {
+        nCount++;
+        nBytes += nBytesIn;
+        nTime += nTimeIn;
+        nMaxTime = std::max(nMaxTime, nTimeIn);
+        nLockWait += nLockWaitIn;
+    }
+
+    //! Add time spent on behalf of messages already counted
+    void AddTime(int64_t nTimeIn, int64_t nLockWaitIn)
+    {
+        nTime += nTimeIn;
+        nLockWait += nLockWaitIn;
+    }
+};
+
+/** Message stats by command */
+typedef std::map<std::string, CMsgStats> MsgStatsMap;
+
 class CNodeStats
 {
 public:
@@ -167,6 +212,9 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    CAmount minFeeFilter;
+    MsgStatsMap mapRecvMsgStats;
+    MsgStatsMap mapSendMsgStats;
 };
 
 
@@ -176,22 +224,22 @@ class CNetMessage {
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
-    CDataStream hdrbuf;             // partially received header
+    char hdrbuf[CMessageHeader::HEADER_SIZE]; // partially received header
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
-    CDataStream vRecv;              // received message data
+    CNetDataStream vRecv;           // received message data, in a pooled buffer
     unsigned int nDataPos;
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
-        hdrbuf.resize(24);
+    CNetMessage(int nTypeIn, int nVersionIn) : vRecv(nTypeIn, nVersionIn) {
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
     }
+    ~CNetMessage();
 
     bool complete() const
     {
@@ -202,7 +250,6 @@ public:
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
@@ -211,6 +258,97 @@ public:
 };
 
 
+/**
+ * Serialized message payload with its checksum. It is immutable once built,
+ * so it can be queued to any number of peers without being copied or hashed
+ * again.
+ */
+class CSharedPayload
+{
+public:
+    boost::shared_ptr<const std::vector<char> > data;
+    unsigned int nChecksum;
+
+    CSharedPayload() : nChecksum(0) {}
+    //! Take over the contents of vData (which is left empty)
+    explicit CSharedPayload(std::vector<char>& vData);
+
+    bool IsNull() const { return !data; }
+    size_t size() const { return data->size(); }
+};
+
+template<typename T>
+CSharedPayload MakeSharedPayload(const T& obj)
+{
+    CNetDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << obj;
+    std::vector<char> vData;
+    ss.GetAndClear(vData);
+    return CSharedPayload(vData);
+}
+
+/**
+ * Message queued for sending: a header of its own (which may be empty, when
+ * the payload already starts with one) followed by a possibly shared payload.
+ */
+class CNetSendMsg
+{
+public:
+    char pchHeader[CMessageHeader::HEADER_SIZE];
+    unsigned int nHeaderSize;
+    boost::shared_ptr<const std::vector<char> > payload;
+
+    CNetSendMsg() : nHeaderSize(0) {}
+
+    size_t size() const { return nHeaderSize + payload->size(); }
+};
+
+/**
+ * Serialized transactions and blocks that were relayed or served recently,
+ * kept as shared payloads so that sending them to more peers costs neither a
+ * serialization nor a copy. The least recently used ones are evicted to stay
+ * within a memory budget, and none is served once RELAY_CACHE_EXPIRY has
+ * passed, so a transaction that left the mempool stops being handed out.
+ */
+class CRelayCache
+{
+private:
+    struct CEntry
+    {
+        CInv inv;
+        CSharedPayload payload;
+        int64_t nTimeExpire;
+
+        CEntry(const CInv& invIn, const CSharedPayload& payloadIn, int64_t nTimeExpireIn) :
+            inv(invIn), payload(payloadIn), nTimeExpire(nTimeExpireIn) {}
+    };
+    typedef std::list<CEntry> EntryList;
+
+    mutable CCriticalSection cs;
+    EntryList listEntries; //! most recently used first
+    std::map<CInv, EntryList::iterator> mapEntries;
+    size_t nUsage;
+    size_t nMaxUsage;
+
+    static size_t EntryUsage(const CSharedPayload& payload);
+    void Erase(EntryList::iterator it);
+    void Trim();
+
+public:
+    explicit CRelayCache(size_t nMaxUsageIn);
+
+    void Insert(const CInv& inv, const CSharedPayload& payload);
+    //! Look up an unexpired inv, making it the most recently used entry
+    bool Get(const CInv& inv, CSharedPayload& payload);
+    void SetMaxUsage(size_t nMaxUsageIn);
+    //! Approximate memory used by the cached payloads, in bytes
+    size_t GetUsage() const;
+    size_t size() const;
+};
+
+extern CRelayCache relayCache;
+
+
 
 
 
@@ -221,11 +359,11 @@ public:
     // socket
     uint64_t nServices;
     SOCKET hSocket;
-    CDataStream ssSend;
+    CNetDataStream ssSend;
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CNetSendMsg> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -253,6 +391,9 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    // Edge-triggered socket readiness, only kept by ThreadSocketHandler with USE_EPOLL
+    bool fSocketReadable;
+    bool fSocketWriteEvent;
     // We use fRelayTxes for two purposes -
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in their version message that we should not relay tx invs
@@ -284,15 +425,17 @@ public:
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    CRollingBloomFilter addrKnown;
+    CCriticalSection cs_vAddrToSend; // protects vAddrToSend and addrKnown
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
-    std::multimap<int64_t, CInv> mapAskFor;
+    // Block hashes to announce, with headers if the peer prefers them (protected by cs_inventory)
+    std::vector<uint256> vBlockHashesToAnnounce;
 
     // Ping time measurement:
     // The pong reply we're expecting, or 0 if no pong expected.
@@ -304,6 +447,21 @@ public:
     // Whether a ping is requested.
     bool fPingQueued;
 
+    // Fee rate (per kB) below which the peer doesn't want transactions announced.
+    CAmount minFeeFilter;
+    CCriticalSection cs_feeFilter;
+    // The fee filter we last sent the peer, and when we check it again (in usec).
+    CAmount lastSentFeeFilter;
+    int64_t nextSendTimeFeeFilter;
+
+    // Per-command message stats
+    MsgStatsMap mapRecvMsgStats;
+    MsgStatsMap mapSendMsgStats;
+    CCriticalSection cs_msgStats;
+    // Command of the message being built in ssSend, and when it was begun (in usec)
+    std::string strSendCommand;
+    int64_t nSendMsgStart;
+
     CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false);
     ~CNode();
 
@@ -313,6 +471,9 @@ private:
     static CCriticalSection cs_totalBytesSent;
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
+    static CCriticalSection cs_totalMsgStats;
+    static MsgStatsMap mapTotalRecvMsgStats;
+    static MsgStatsMap mapTotalSendMsgStats;
 
     CNode(const CNode&);
     void operator=(const CNode&);
@@ -364,7 +525,8 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        LOCK(cs_vAddrToSend);
+        addrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
@@ -372,7 +534,8 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr)) {
+        LOCK(cs_vAddrToSend);
+        if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
             } else {
@@ -386,7 +549,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -394,12 +557,16 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
         }
     }
 
-    void AskFor(const CInv& inv);
+    void PushBlockHash(const uint256 &hash)
+    {
+        LOCK(cs_inventory);
+        vBlockHashesToAnnounce.push_back(hash);
+    }
 
     // TODO: Document the postcondition of this function.  Is cs_vSend locked?
     void BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend);
@@ -410,6 +577,12 @@ public:
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void EndMessage() UNLOCK_FUNCTION(cs_vSend);
 
+    //! Queue a message whose payload is shared with other peers, without copying it
+    void PushSharedMessage(const char* pszCommand, const CSharedPayload& payload);
+
+    //! Append msg to the send queue and try to send it; call with cs_vSend held
+    void QueueSendMsg(const CNetSendMsg& msg);
+
     void PushVersion();
 
 
@@ -604,13 +777,83 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    //! Count a message we processed, taking nTime usec of which nLockWait waiting for cs_main
+    void RecordRecvMsg(const std::string& strCommand, uint64_t nBytes, int64_t nTime, int64_t nLockWait);
+    //! Add nTime usec of work for received strCommand messages, without counting another one
+    void RecordRecvTime(const std::string& strCommand, int64_t nTime, int64_t nLockWait);
+    //! Count a message we queued, taking nTime usec to build
+    void RecordSendMsg(const std::string& strCommand, uint64_t nBytes, int64_t nTime);
+    //! Message stats of all peers since startup
+    static void GetTotalMsgStats(MsgStatsMap& mapRecv, MsgStatsMap& mapSend);
 };
 
 
 
 class CTransaction;
 void RelayTransaction(const CTransaction& tx);
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
+void RelayTransaction(const CTransaction& tx, const CSharedPayload& payload);
+
+/**
+ * Start of a -capturemessages log. Appending to, or replaying, a log in
+ * another format or from another network is refused.
+ */
+class CCaptureFileHeader
+{
+public:
+    static const int CURRENT_VERSION = 1;
+
+    char pchMagic[8];
+    int nVersion;
+    unsigned char pchMessageStart[MESSAGE_START_SIZE]; //!< network the messages were received on
+
+    //! A header for a log of the current format and network
+    CCaptureFileHeader();
+    bool IsValid() const;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(FLATDATA(pchMagic));
+        READWRITE(this->nVersion);
+        READWRITE(FLATDATA(pchMessageStart));
+    }
+};
+
+/**
+ * A received message as logged by -capturemessages. The log is a
+ * CCaptureFileHeader followed by a plain sequence of these, which
+ * duckcoin-replay feeds back through ProcessMessage.
+ */
+class CCapturedMessage
+{
+public:
+    NodeId nodeid;
+    bool fInbound;
+    int64_t nTime; //!< time of receipt, in microseconds
+    std::string strCommand;
+    std::vector<char> vPayload;
+
+    CCapturedMessage() : nodeid(-1), fInbound(false), nTime(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(nodeid);
+        READWRITE(fInbound);
+        READWRITE(nTime);
+        READWRITE(strCommand);
+        READWRITE(vPayload);
+    }
+};
+
+//! Start appending every received message to the file at path, until it is nMaxSize bytes
+bool OpenMessageCapture(const boost::filesystem::path& path, uint64_t nMaxSize);
+void CloseMessageCapture();
+//! Log msg, received from pnode, if a capture file is open
+void CaptureMessage(const CNode* pnode, const CNetMessage& msg);
 
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
@@ -11,6 +11,9 @@
 #include "serialize.h"
 #include "uint256.h"
 
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+
 /** An outpoint - a combination of a transaction hash and an index n into its vout */
 class COutPoint
 {
@@ -266,4 +269,12 @@ struct CMutableTransaction
     uint256 GetHash() const;
 };
 
+/**
+ * Reference-counted handle to an immutable transaction, so that the mempool,
+ * the orphan pool and the transactions they hand out share one copy.
+ */
+typedef boost::shared_ptr<const CTransaction> CTransactionRef;
+
+static inline CTransactionRef MakeTransactionRef(const CTransaction& tx) { return boost::make_shared<CTransaction>(tx); }
+
 #endif // BITBREADCRUMB_PRIMITIVES_TRANSACTION_H
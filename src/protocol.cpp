@@ -18,7 +18,8 @@ static const char* ppszTypeName[] =
     "ERROR",
     "tx",
     "block",
-    "filtered block"
+    "filtered block",
+    "compact block"
 };
 
 CMessageHeader::CMessageHeader()
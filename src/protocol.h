@@ -147,6 +147,9 @@ enum {
     // Nodes may always request a MSG_FILTERED_BLOCK in a getdata, however,
     // MSG_FILTERED_BLOCK should not appear in any invs except as a part of getdata.
     MSG_FILTERED_BLOCK,
+    // Like MSG_FILTERED_BLOCK, MSG_CMPCT_BLOCK is only used in getdata, to ask
+    // a peer advertising NODE_COMPACT_BLOCKS for a block in compact form.
+    MSG_CMPCT_BLOCK,
 };
 
 #endif // BITBREADCRUMB_PROTOCOL_H
@@ -7,6 +7,7 @@
 #include "main.h"
 #include "rpcserver.h"
 #include "sync.h"
+#include "txdb.h"
 #include "util.h"
 
 #include <stdint.h>
@@ -163,6 +164,12 @@ Value getrawmempool(const Array& params, bool fHelp)
             "    \"height\" : n,           (numeric) block height when transaction entered pool\n"
             "    \"startingpriority\" : n, (numeric) priority when transaction entered pool\n"
             "    \"currentpriority\" : n,  (numeric) transaction priority now\n"
+            "    \"ancestorcount\" : n,    (numeric) number of in-mempool ancestor transactions, including this one\n"
+            "    \"ancestorsize\" : n,     (numeric) size of in-mempool ancestors, including this one\n"
+            "    \"ancestorfees\" : n,     (numeric) fees of in-mempool ancestors, including this one, with prioritisetransaction deltas\n"
+            "    \"descendantcount\" : n,  (numeric) number of in-mempool descendant transactions, including this one\n"
+            "    \"descendantsize\" : n,   (numeric) size of in-mempool descendants, including this one\n"
+            "    \"descendantfees\" : n,   (numeric) fees of in-mempool descendants, including this one, with prioritisetransaction deltas\n"
             "    \"depends\" : [           (array) unconfirmed transactions used as inputs for this transaction\n"
             "        \"transactionid\",    (string) parent transaction id\n"
             "       ... ]\n"
@@ -192,6 +199,13 @@ Value getrawmempool(const Array& params, bool fHelp)
             info.push_back(Pair("height", (int)e.GetHeight()));
             info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
             info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
+            const CTxMemPoolIndexEntry& index = mempool.mapIndex[hash];
+            info.push_back(Pair("ancestorcount", index.nCountWithAncestors));
+            info.push_back(Pair("ancestorsize", index.nSizeWithAncestors));
+            info.push_back(Pair("ancestorfees", ValueFromAmount(index.nModFeesWithAncestors)));
+            info.push_back(Pair("descendantcount", index.nCountWithDescendants));
+            info.push_back(Pair("descendantsize", index.nSizeWithDescendants));
+            info.push_back(Pair("descendantfees", ValueFromAmount(index.nModFeesWithDescendants)));
             const CTransaction& tx = e.GetTx();
             set<string> setDepends;
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
@@ -342,6 +356,98 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+static Object DBStatsToJSON(const CLevelDBWrapper& db)
+{
+    const CLevelDBOptions& dbOptions = db.GetDBOptions();
+    Object options;
+    options.push_back(Pair("cache", (uint64_t)dbOptions.nCacheSize));
+    options.push_back(Pair("writebuffer", (uint64_t)dbOptions.GetWriteBufferSize()));
+    options.push_back(Pair("bloombits", dbOptions.nBloomBits));
+    options.push_back(Pair("compression", dbOptions.fCompression));
+    options.push_back(Pair("maxopenfiles", dbOptions.nMaxOpenFiles));
+
+    Object ret;
+    ret.push_back(Pair("options", options));
+    ret.push_back(Pair("approximate_size", db.GetApproximateSize()));
+    ret.push_back(Pair("stats", db.GetProperty("leveldb.stats")));
+    ret.push_back(Pair("sstables", db.GetProperty("leveldb.sstables")));
+    return ret;
+}
+
+Value getdbstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbstats\n"
+            "\nReturns LevelDB tuning and statistics for the chainstate and block index databases.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"chainstate\": {             (json object) the chainstate database\n"
+            "    \"options\": {              (json object) tuning the database was opened with\n"
+            "      \"cache\": n,             (numeric) cache budget in bytes\n"
+            "      \"writebuffer\": n,       (numeric) write buffer size in bytes\n"
+            "      \"bloombits\": n,         (numeric) bloom filter bits per key\n"
+            "      \"compression\": true|false,\n"
+            "      \"maxopenfiles\": n\n"
+            "    },\n"
+            "    \"approximate_size\": n,    (numeric) approximate size on disk in bytes\n"
+            "    \"stats\": \"...\",           (string) LevelDB's leveldb.stats property\n"
+            "    \"sstables\": \"...\"         (string) LevelDB's leveldb.sstables property\n"
+            "  },\n"
+            "  \"blockindex\": { ... }       (json object) the block index database, same fields\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getdbstats", "")
+            + HelpExampleRpc("getdbstats", "")
+        );
+
+    LOCK(cs_main);
+
+    Object ret;
+    ret.push_back(Pair("chainstate", DBStatsToJSON(pcoinsdbview->GetDB())));
+    ret.push_back(Pair("blockindex", DBStatsToJSON(*pblocktree)));
+    return ret;
+}
+
+Value compactchainstate(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "compactchainstate\n"
+            "\nCompacts the whole chainstate database now, instead of waiting for the node to go idle.\n"
+            "Note this call may take some time. It works through the database in slices, and a\n"
+            "shutdown requested meanwhile waits for the current slice to finish.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"size_before\": n,   (numeric) approximate database size in bytes before compacting\n"
+            "  \"size_after\": n,    (numeric) approximate database size in bytes afterwards\n"
+            "  \"time\": n           (numeric) time taken in seconds\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("compactchainstate", "")
+            + HelpExampleRpc("compactchainstate", "")
+        );
+
+    uint64_t nSizeBefore;
+    {
+        LOCK(cs_main);
+        nSizeBefore = pcoinsdbview->GetDB().GetApproximateSize();
+    }
+    int64_t nStart = GetTimeMillis();
+    if (!CompactChainstate())
+        throw JSONRPCError(RPC_MISC_ERROR, "Shutdown requested before compaction finished");
+    int64_t nElapsed = GetTimeMillis() - nStart;
+
+    Object ret;
+    ret.push_back(Pair("size_before", nSizeBefore));
+    {
+        LOCK(cs_main);
+        ret.push_back(Pair("size_after", pcoinsdbview->GetDB().GetApproximateSize()));
+    }
+    ret.push_back(Pair("time", nElapsed * 0.001));
+    return ret;
+}
+
 Value gettxout(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -591,6 +697,9 @@ Value getmempoolinfo(const Array& params, bool fHelp)
             "{\n"
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
+            "  \"usage\": xxxxx               (numeric) Total memory usage for the mempool\n"
+            "  \"maxmempool\": xxxxx          (numeric) Maximum memory usage for the mempool\n"
+            "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee for tx to be accepted in duk/kb\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
@@ -600,6 +709,10 @@ Value getmempoolinfo(const Array& params, bool fHelp)
     Object ret;
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
+    ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    size_t nMaxMempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    ret.push_back(Pair("maxmempool", (int64_t) nMaxMempool));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(nMaxMempool).GetFeePerK())));
 
     return ret;
 }
@@ -73,6 +73,23 @@ static void CopyNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+static Object MsgStatsToJSON(const MsgStatsMap& mapStats, bool fReceived)
+{
+    Object obj;
+    for (MsgStatsMap::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it) {
+        const CMsgStats& stats = it->second;
+        Object entry;
+        entry.push_back(Pair("count", stats.nCount));
+        entry.push_back(Pair("bytes", stats.nBytes));
+        entry.push_back(Pair("time", stats.nTime / 1e6));
+        entry.push_back(Pair("maxtime", stats.nMaxTime / 1e6));
+        if (fReceived)
+            entry.push_back(Pair("lockwait", stats.nLockWait / 1e6));
+        obj.push_back(Pair(it->first, entry));
+    }
+    return obj;
+}
+
 Value getpeerinfo(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -103,7 +120,11 @@ Value getpeerinfo(const Array& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"
+            "    \"minfeefilter\": n,         (numeric) The minimum fee rate for transactions this peer accepts\n"
+            "    \"msgrecv\": {...},          (json object) Stats of the messages received from this peer, by command, as in getnetmsgstats\n"
+            "    \"msgsent\": {...},          (json object) Stats of the messages sent to this peer, by command, as in getnetmsgstats\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -152,6 +173,9 @@ Value getpeerinfo(const Array& params, bool fHelp)
             obj.push_back(Pair("inflight", heights));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
+        obj.push_back(Pair("minfeefilter", ValueFromAmount(stats.minFeeFilter)));
+        obj.push_back(Pair("msgrecv", MsgStatsToJSON(stats.mapRecvMsgStats, true)));
+        obj.push_back(Pair("msgsent", MsgStatsToJSON(stats.mapSendMsgStats, false)));
 
         ret.push_back(obj);
     }
@@ -351,6 +375,44 @@ Value getnettotals(const Array& params, bool fHelp)
     return obj;
 }
 
+Value getnetmsgstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getnetmsgstats\n"
+            "\nReturns counters for each type of P2P message, summed over all peers since startup.\n"
+            "Commands we don't know are counted as \"*other*\". The time of \"getdata\" also covers\n"
+            "answering requests left over from earlier rounds, relaying invs and requesting announced data.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"msgrecv\": {              (json object) Messages received and processed\n"
+            "    \"command\": {\n"
+            "      \"count\": n,             (numeric) Number of messages\n"
+            "      \"bytes\": n,             (numeric) Bytes, including message headers\n"
+            "      \"time\": n,              (numeric) Total seconds spent processing them\n"
+            "      \"maxtime\": n,           (numeric) Most seconds spent processing one of them\n"
+            "      \"lockwait\": n           (numeric) Seconds of time spent waiting for the main lock\n"
+            "    },\n"
+            "    ...\n"
+            "  },\n"
+            "  \"msgsent\": {              (json object) Messages queued for sending, as above without lockwait;\n"
+            "    ...                       time is spent building them\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getnetmsgstats", "")
+            + HelpExampleRpc("getnetmsgstats", "")
+       );
+
+    MsgStatsMap mapRecv, mapSend;
+    CNode::GetTotalMsgStats(mapRecv, mapSend);
+
+    Object obj;
+    obj.push_back(Pair("msgrecv", MsgStatsToJSON(mapRecv, true)));
+    obj.push_back(Pair("msgsent", MsgStatsToJSON(mapSend, false)));
+    return obj;
+}
+
 static Array GetNetworksInfo()
 {
     Array networks;
@@ -252,6 +252,7 @@ static const CRPCCommand vRPCCommands[] =
     { "network",            "addnode",                &addnode,                true,      true,       false },
     { "network",            "getaddednodeinfo",       &getaddednodeinfo,       true,      true,       false },
     { "network",            "getconnectioncount",     &getconnectioncount,     true,      false,      false },
+    { "network",            "getnetmsgstats",         &getnetmsgstats,         true,      true,       false },
     { "network",            "getnettotals",           &getnettotals,           true,      true,       false },
     { "network",            "getpeerinfo",            &getpeerinfo,            true,      false,      false },
     { "network",            "ping",                   &ping,                   true,      false,      false },
@@ -259,10 +260,12 @@ static const CRPCCommand vRPCCommands[] =
     /* Block chain and UTXO */
     { "blockchain",         "getblockchaininfo",      &getblockchaininfo,      true,      false,      false },
     { "blockchain",         "getbestblockhash",       &getbestblockhash,       true,      false,      false },
+    { "blockchain",         "compactchainstate",      &compactchainstate,      true,      true,       false },
     { "blockchain",         "getblockcount",          &getblockcount,          true,      false,      false },
     { "blockchain",         "getblock",               &getblock,               true,      false,      false },
     { "blockchain",         "getblockhash",           &getblockhash,           true,      false,      false },
     { "blockchain",         "getchaintips",           &getchaintips,           true,      false,      false },
+    { "blockchain",         "getdbstats",             &getdbstats,             true,      false,      false },
     { "blockchain",         "getdifficulty",          &getdifficulty,          true,      false,      false },
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true,      true,       false },
     { "blockchain",         "getrawmempool",          &getrawmempool,          true,      false,      false },
@@ -26,54 +26,51 @@
  * >> and << read and write unformatted data using the above serialization templates.
  * Fills with data in linear time; some stringstream implementations take N^2 time.
  */
-class CDataStream
+template <typename SerializeType>
+class CBaseDataStream
 {
 protected:
-    typedef CSerializeData vector_type;
+    typedef SerializeType vector_type;
     vector_type vch;
     unsigned int nReadPos;
 public:
     int nType;
     int nVersion;
 
-    typedef vector_type::allocator_type   allocator_type;
-    typedef vector_type::size_type        size_type;
-    typedef vector_type::difference_type  difference_type;
-    typedef vector_type::reference        reference;
-    typedef vector_type::const_reference  const_reference;
-    typedef vector_type::value_type       value_type;
-    typedef vector_type::iterator         iterator;
-    typedef vector_type::const_iterator   const_iterator;
-    typedef vector_type::reverse_iterator reverse_iterator;
+    typedef typename vector_type::allocator_type   allocator_type;
+    typedef typename vector_type::size_type        size_type;
+    typedef typename vector_type::difference_type  difference_type;
+    typedef typename vector_type::reference        reference;
+    typedef typename vector_type::const_reference  const_reference;
+    typedef typename vector_type::value_type       value_type;
+    typedef typename vector_type::iterator         iterator;
+    typedef typename vector_type::const_iterator   const_iterator;
+    typedef typename vector_type::reverse_iterator reverse_iterator;
 
-    explicit CDataStream(int nTypeIn, int nVersionIn)
+    explicit CBaseDataStream(int nTypeIn, int nVersionIn)
     {
         Init(nTypeIn, nVersionIn);
     }
 
-    CDataStream(const_iterator pbegin, const_iterator pend, int nTypeIn, int nVersionIn) : vch(pbegin, pend)
+    CBaseDataStream(const_iterator pbegin, const_iterator pend, int nTypeIn, int nVersionIn) : vch(pbegin, pend)
     {
         Init(nTypeIn, nVersionIn);
     }
 
 #if !defined(_MSC_VER) || _MSC_VER >= 1300
-    CDataStream(const char* pbegin, const char* pend, int nTypeIn, int nVersionIn) : vch(pbegin, pend)
+    CBaseDataStream(const char* pbegin, const char* pend, int nTypeIn, int nVersionIn) : vch(pbegin, pend)
     {
         Init(nTypeIn, nVersionIn);
     }
 #endif
 
-    CDataStream(const vector_type& vchIn, int nTypeIn, int nVersionIn) : vch(vchIn.begin(), vchIn.end())
+    template <typename A>
+    CBaseDataStream(const std::vector<char, A>& vchIn, int nTypeIn, int nVersionIn) : vch(vchIn.begin(), vchIn.end())
     {
         Init(nTypeIn, nVersionIn);
     }
 
-    CDataStream(const std::vector<char>& vchIn, int nTypeIn, int nVersionIn) : vch(vchIn.begin(), vchIn.end())
-    {
-        Init(nTypeIn, nVersionIn);
-    }
-
-    CDataStream(const std::vector<unsigned char>& vchIn, int nTypeIn, int nVersionIn) : vch(vchIn.begin(), vchIn.end())
+    CBaseDataStream(const std::vector<unsigned char>& vchIn, int nTypeIn, int nVersionIn) : vch(vchIn.begin(), vchIn.end())
     {
         Init(nTypeIn, nVersionIn);
     }
@@ -85,15 +82,15 @@ public:
         nVersion = nVersionIn;
     }
 
-    CDataStream& operator+=(const CDataStream& b)
+    CBaseDataStream& operator+=(const CBaseDataStream& b)
     {
         vch.insert(vch.end(), b.begin(), b.end());
         return *this;
     }
 
-    friend CDataStream operator+(const CDataStream& a, const CDataStream& b)
+    friend CBaseDataStream operator+(const CBaseDataStream& a, const CBaseDataStream& b)
     {
-        CDataStream ret = a;
+        CBaseDataStream ret = a;
         ret += b;
         return (ret);
     }
@@ -112,6 +109,7 @@ public:
     const_iterator end() const                       { return vch.end(); }
     iterator end()                                   { return vch.end(); }
     size_type size() const                           { return vch.size() - nReadPos; }
+    size_type capacity() const                       { return vch.capacity() - nReadPos; }
     bool empty() const                               { return vch.size() == nReadPos; }
     void resize(size_type n, value_type c=0)         { vch.resize(n + nReadPos, c); }
     void reserve(size_type n)                        { vch.reserve(n + nReadPos); }
@@ -206,7 +204,7 @@ public:
     // Stream subset
     //
     bool eof() const             { return size() == 0; }
-    CDataStream* rdbuf()         { return this; }
+    CBaseDataStream* rdbuf()         { return this; }
     int in_avail()               { return size(); }
 
     void SetType(int n)          { nType = n; }
@@ -216,7 +214,7 @@ public:
     void ReadVersion()           { *this >> nVersion; }
     void WriteVersion()          { *this << nVersion; }
 
-    CDataStream& read(char* pch, size_t nSize)
+    CBaseDataStream& read(char* pch, size_t nSize)
     {
         // Read from the beginning of the buffer
         unsigned int nReadPosNext = nReadPos + nSize;
@@ -236,7 +234,7 @@ public:
         return (*this);
     }
 
-    CDataStream& ignore(int nSize)
+    CBaseDataStream& ignore(int nSize)
     {
         // Ignore from the beginning of the buffer
         assert(nSize >= 0);
@@ -253,7 +251,7 @@ public:
         return (*this);
     }
 
-    CDataStream& write(const char* pch, size_t nSize)
+    CBaseDataStream& write(const char* pch, size_t nSize)
     {
         // Write to the end of the buffer
         vch.insert(vch.end(), pch, pch + nSize);
@@ -276,7 +274,7 @@ public:
     }
 
     template<typename T>
-    CDataStream& operator<<(const T& obj)
+    CBaseDataStream& operator<<(const T& obj)
     {
         // Serialize to this stream
         ::Serialize(*this, obj, nType, nVersion);
@@ -284,17 +282,98 @@ public:
     }
 
     template<typename T>
-    CDataStream& operator>>(T& obj)
+    CBaseDataStream& operator>>(T& obj)
     {
         // Unserialize from this stream
         ::Unserialize(*this, obj, nType, nVersion);
         return (*this);
     }
 
-    void GetAndClear(CSerializeData &data) {
+    void GetAndClear(vector_type &data) {
+        if (data.empty() && nReadPos == 0) {
+            // Hand over the buffer itself rather than a copy
+            data.swap(vch);
+            return;
+        }
         data.insert(data.end(), begin(), end());
         clear();
     }
+
+    //! Exchange the underlying buffer with vchIn, e.g. to reuse its allocation
+    void SwapBuffer(vector_type& vchIn)
+    {
+        vch.swap(vchIn);
+        nReadPos = 0;
+    }
+};
+
+typedef CBaseDataStream<CSerializeData> CDataStream;
+
+/** Stream for public data such as network messages. It works like
+ * CDataStream, but its buffer is not scrubbed when freed, so it must not
+ * be used for keys or other secrets.
+ */
+typedef CBaseDataStream<std::vector<char> > CNetDataStream;
+
+/** Non-owning, read-only stream over a contiguous range of bytes.
+ *
+ * Deserializes straight out of memory owned by someone else (e.g. a LevelDB
+ * slice), avoiding the copy into a CDataStream and its zeroing allocator.
+ * The underlying memory must outlive the reader.
+ */
+class CDataReader
+{
+private:
+    const char* pbegin;
+    size_t nSize;
+    size_t nReadPos;
+
+    int nType;
+    int nVersion;
+
+public:
+    CDataReader(const char* pbeginIn, size_t nSizeIn, int nTypeIn, int nVersionIn) :
+        pbegin(pbeginIn), nSize(nSizeIn), nReadPos(0), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    const char* begin() const    { return pbegin + nReadPos; }
+    const char* end() const      { return pbegin + nSize; }
+    size_t size() const          { return nSize - nReadPos; }
+    bool empty() const           { return nReadPos == nSize; }
+
+    //
+    // Stream subset
+    //
+    bool eof() const             { return empty(); }
+    int in_avail()               { return size(); }
+
+    int GetType()                { return nType; }
+    int GetVersion()             { return nVersion; }
+
+    CDataReader& read(char* pch, size_t nRead)
+    {
+        if (nRead > nSize - nReadPos)
+            throw std::ios_base::failure("CDataReader::read() : end of data");
+        memcpy(pch, pbegin + nReadPos, nRead);
+        nReadPos += nRead;
+        return (*this);
+    }
+
+    CDataReader& ignore(int nIgnore)
+    {
+        assert(nIgnore >= 0);
+        if ((size_t)nIgnore > nSize - nReadPos)
+            throw std::ios_base::failure("CDataReader::ignore() : end of data");
+        nReadPos += nIgnore;
+        return (*this);
+    }
+
+    template<typename T>
+    CDataReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
 };
 
 
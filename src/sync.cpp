@@ -20,6 +20,31 @@ void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
 }
 #endif /* DEBUG_LOCKCONTENTION */
 
+static const void* pLockWaitTracked = NULL;
+static boost::thread_specific_ptr<int64_t> pnLockWaitMicros;
+
+void SetLockWaitTracked(const void* cs)
+{
+    pLockWaitTracked = cs;
+}
+
+bool IsLockWaitTracked(const void* cs)
+{
+    return cs == pLockWaitTracked;
+}
+
+void AddLockWaitMicros(int64_t nMicros)
+{
+    if (pnLockWaitMicros.get() == NULL)
+        pnLockWaitMicros.reset(new int64_t(0));
+    *pnLockWaitMicros += nMicros;
+}
+
+int64_t GetLockWaitMicros()
+{
+    return pnLockWaitMicros.get() ? *pnLockWaitMicros : 0;
+}
+
 #ifdef DEBUG_LOCKORDER
 //
 // Early deadlock detection.
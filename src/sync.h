@@ -7,6 +7,9 @@
 #define BITBREADCRUMB_SYNC_H
 
 #include "threadsafety.h"
+#include "utiltime.h"
+
+#include <stdint.h>
 
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
@@ -104,6 +107,16 @@ void static inline AssertLockHeldInternal(const char* pszName, const char* pszFi
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine);
 #endif
 
+/**
+ * The time each thread spends blocked in LOCK() on one chosen lock (cs_main)
+ * is added up, so callers can tell how much of an operation went to waiting.
+ */
+void SetLockWaitTracked(const void* cs);
+bool IsLockWaitTracked(const void* cs);
+void AddLockWaitMicros(int64_t nMicros);
+//! Total time the calling thread has spent waiting for the tracked lock
+int64_t GetLockWaitMicros();
+
 /** Wrapper around boost::unique_lock<Mutex> */
 template <typename Mutex>
 class CMutexLock
@@ -114,14 +127,18 @@ private:
     void Enter(const char* pszName, const char* pszFile, int nLine)
     {
         EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()));
-#ifdef DEBUG_LOCKCONTENTION
         if (!lock.try_lock()) {
+#ifdef DEBUG_LOCKCONTENTION
             PrintLockContention(pszName, pszFile, nLine);
 #endif
-            lock.lock();
-#ifdef DEBUG_LOCKCONTENTION
+            if (IsLockWaitTracked(lock.mutex())) {
+                int64_t nStart = GetTimeMicros();
+                lock.lock();
+                AddLockWaitMicros(GetTimeMicros() - nStart);
+            } else {
+                lock.lock();
+            }
         }
-#endif
     }
 
     bool TryEnter(const char* pszName, const char* pszFile, int nLine)
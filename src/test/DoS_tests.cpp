@@ -16,6 +16,7 @@
 #include "serialize.h"
 #include "util.h"
 
+#include <limits>
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp> // for 'map_list_of()'
@@ -26,13 +27,15 @@
 // Tests this internal-to-main.cpp method:
 extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxOrphanBytes);
 struct COrphanTx {
-    CTransaction tx;
+    CTransactionRef tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nTxSize;
 };
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern std::map<COutPoint, std::set<uint256> > mapOrphanTransactionsByPrev;
 
 CService ip(uint32_t i)
 {
@@ -112,7 +115,7 @@ CTransaction RandomOrphan()
     it = mapOrphanTransactions.lower_bound(GetRandHash());
     if (it == mapOrphanTransactions.end())
         it = mapOrphanTransactions.begin();
-    return it->second.tx;
+    return *it->second.tx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -187,13 +190,75 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    LimitOrphanTxSize(40, std::numeric_limits<size_t>::max());
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, std::numeric_limits<size_t>::max());
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    LimitOrphanTxSize(0, std::numeric_limits<size_t>::max());
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
 }
 
+static CTransaction SimpleOrphan(unsigned int nInputs)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(nInputs);
+    for (unsigned int i = 0; i < nInputs; i++)
+    {
+        tx.vin[i].prevout.n = i;
+        tx.vin[i].prevout.hash = GetRandHash();
+        tx.vin[i].scriptSig << OP_1;
+    }
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphansLimits)
+{
+    // The prevout index is keyed by outpoint, not by parent txid
+    CTransaction txTwoInputs = SimpleOrphan(2);
+    BOOST_CHECK(AddOrphanTx(txTwoInputs, 0));
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByPrev.size(), 2);
+    BOOST_CHECK(mapOrphanTransactionsByPrev.count(txTwoInputs.vin[1].prevout));
+    EraseOrphansFor(0);
+    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+
+    // Peer 0 floods big orphans, peer 1 sends a couple of small ones
+    size_t nBytes = 0;
+    for (int i = 0; i < 10; i++)
+    {
+        CTransaction tx = SimpleOrphan(20);
+        BOOST_CHECK(AddOrphanTx(tx, 0));
+        nBytes += mapOrphanTransactions[tx.GetHash()].nTxSize;
+    }
+    std::vector<uint256> vSmall;
+    for (int i = 0; i < 2; i++)
+    {
+        CTransaction tx = SimpleOrphan(1);
+        BOOST_CHECK(AddOrphanTx(tx, 1));
+        nBytes += mapOrphanTransactions[tx.GetHash()].nTxSize;
+        vSmall.push_back(tx.GetHash());
+    }
+
+    // Hitting the byte limit evicts from the peer using the most memory
+    LimitOrphanTxSize(100, nBytes / 2);
+    BOOST_CHECK(mapOrphanTransactions.size() < 12);
+    BOOST_FOREACH(const uint256& hash, vSmall)
+        BOOST_CHECK(mapOrphanTransactions.count(hash));
+    size_t nBytesLeft = 0;
+    for (std::map<uint256, COrphanTx>::const_iterator it = mapOrphanTransactions.begin(); it != mapOrphanTransactions.end(); ++it)
+        nBytesLeft += it->second.nTxSize;
+    BOOST_CHECK(nBytesLeft <= nBytes / 2);
+
+    // Orphans expire after ORPHAN_TX_EXPIRE_TIME
+    int64_t nStartTime = GetTime();
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME + 1);
+    LimitOrphanTxSize(100, std::numeric_limits<size_t>::max());
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    SetMockTime(0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,127 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "merkleblock.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(compactblock_tests)
+
+static CBlock BuildBlock(int nTx)
+{
+    CBlock block;
+    block.nBits = 0x207fffff;
+    block.nTime = 1420070400;
+    for (int i = 0; i < nTx; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        if (i > 0)
+            tx.vin[0].prevout = COutPoint(uint256(i), 0);
+        tx.vin[0].scriptSig << i;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i;
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static CBlockHeaderAndShortTxIDs RoundTrip(const CBlockHeaderAndShortTxIDs& cmpctblock)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    CBlockHeaderAndShortTxIDs ret;
+    ss >> ret;
+    BOOST_CHECK(ss.empty());
+    return ret;
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_from_mempool)
+{
+    CBlock block = BuildBlock(4);
+    CTxMemPool pool(CFeeRate(0));
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        pool.addUnchecked(block.vtx[i].GetHash(), CTxMemPoolEntry(block.vtx[i], 0, 0, 0.0, 1));
+
+    CBlockHeaderAndShortTxIDs cmpctblock = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), block.vtx.size());
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilledTxn.size(), 1U);
+    BOOST_CHECK(cmpctblock.header.GetHash() == block.GetHash());
+
+    // Everything but the coinbase comes from the mempool
+    CPartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctblock, pool), READ_OK);
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(partialBlock.IsTxAvailable(i));
+
+    CBlock rebuilt;
+    BOOST_CHECK_EQUAL(partialBlock.FillBlock(rebuilt, vector<CTransaction>()), READ_OK);
+    BOOST_CHECK(rebuilt.GetHash() == block.GetHash());
+    BOOST_CHECK(rebuilt.BuildMerkleTree() == block.hashMerkleRoot);
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_missing_txn)
+{
+    CBlock block = BuildBlock(4);
+    CTxMemPool pool(CFeeRate(0));
+    pool.addUnchecked(block.vtx[1].GetHash(), CTxMemPoolEntry(block.vtx[1], 0, 0, 0.0, 1));
+    pool.addUnchecked(block.vtx[3].GetHash(), CTxMemPoolEntry(block.vtx[3], 0, 0, 0.0, 1));
+
+    CBlockHeaderAndShortTxIDs cmpctblock = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+    CPartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctblock, pool), READ_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(2));
+    BOOST_CHECK(partialBlock.IsTxAvailable(3));
+
+    // The request for the missing transaction survives serialization
+    CBlockTransactionsRequest req;
+    req.blockhash = block.GetHash();
+    req.vIndexes.push_back(2);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << req;
+    CBlockTransactionsRequest req2;
+    ss >> req2;
+    BOOST_CHECK(req2.blockhash == req.blockhash);
+    BOOST_CHECK(req2.vIndexes == req.vIndexes);
+
+    // Too few or too many transactions is the peer's fault...
+    CBlock rebuilt;
+    BOOST_CHECK_EQUAL(partialBlock.FillBlock(rebuilt, vector<CTransaction>()), READ_INVALID);
+    BOOST_CHECK_EQUAL(partialBlock.FillBlock(rebuilt, vector<CTransaction>(2, block.vtx[2])), READ_INVALID);
+
+    // ...while a wrong one is only caught by the merkle root
+    BOOST_CHECK_EQUAL(partialBlock.FillBlock(rebuilt, vector<CTransaction>(1, block.vtx[1])), READ_FAILED);
+
+    BOOST_CHECK_EQUAL(partialBlock.FillBlock(rebuilt, vector<CTransaction>(1, block.vtx[2])), READ_OK);
+    BOOST_CHECK(rebuilt.GetHash() == block.GetHash());
+    BOOST_CHECK(rebuilt.BuildMerkleTree() == block.hashMerkleRoot);
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_invalid)
+{
+    CBlock block = BuildBlock(3);
+    CTxMemPool pool(CFeeRate(0));
+
+    // A prefilled transaction beyond the end of the block
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    cmpctblock.vPrefilledTxn[0].index = 3;
+    CPartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctblock, pool), READ_INVALID);
+
+    // Two transactions sharing a short ID cannot be told apart
+    CBlockHeaderAndShortTxIDs cmpctblock2(block);
+    cmpctblock2.vShortTxIDs[1] = cmpctblock2.vShortTxIDs[0];
+    BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctblock2, pool), READ_FAILED);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,8 +3,11 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "primitives/transaction.h"
+#include "chainparams.h"
+#include "clientversion.h"
 #include "main.h"
 
+#include <boost/filesystem/operations.hpp>
 #include <boost/test/unit_test.hpp>
 
 BOOST_AUTO_TEST_SUITE(main_tests)
@@ -21,4 +24,39 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
     BOOST_CHECK(nSum == 8399999990760000ULL);
 }
 
+BOOST_AUTO_TEST_CASE(blockfile_buffered_write)
+{
+    // Use a file number well past anything InitBlockIndex touched
+    CBlock block = Params().GenesisBlock();
+    CDiskBlockPos pos1(1000, 0);
+    BOOST_CHECK(WriteBlockToDisk(block, pos1));
+    BOOST_CHECK_EQUAL(pos1.nPos, 8u);
+
+    // Blocks still buffered by the writer must be readable
+    CBlock blockRead;
+    BOOST_CHECK(ReadBlockFromDisk(blockRead, pos1));
+    BOOST_CHECK(blockRead.GetHash() == block.GetHash());
+
+    unsigned int nSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+    CDiskBlockPos pos2(1000, pos1.nPos + nSize);
+    BOOST_CHECK(WriteBlockToDisk(block, pos2));
+    BOOST_CHECK_EQUAL(pos2.nPos, pos1.nPos + nSize + 8);
+    BOOST_CHECK(ReadBlockFromDisk(blockRead, pos2));
+    BOOST_CHECK(blockRead.GetHash() == block.GetHash());
+    BOOST_CHECK(ReadBlockFromDisk(blockRead, pos1));
+    BOOST_CHECK(blockRead.GetHash() == block.GetHash());
+
+    FlushStateToDisk();
+    boost::filesystem::remove(GetBlockPosFilename(pos1, "blk"));
+}
+
+BOOST_AUTO_TEST_CASE(known_message_types)
+{
+    // Made-up commands are kept out of the message stats
+    BOOST_CHECK(IsKnownMessageType("getdata"));
+    BOOST_CHECK(IsKnownMessageType("sendcmpct"));
+    BOOST_CHECK(!IsKnownMessageType("madeup"));
+    BOOST_CHECK(!IsKnownMessageType(""));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,9 +3,12 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "pubkey.h"
+#include "script/standard.h"
 #include "txmempool.h"
 #include "util.h"
 
+#include <boost/filesystem/operations.hpp>
 #include <boost/test/unit_test.hpp>
 #include <list>
 
@@ -51,7 +54,7 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
 
 
     CTxMemPool testPool(CFeeRate(0));
-    std::list<CTransaction> removed;
+    std::list<CTransactionRef> removed;
 
     // Nothing in pool, remove should do nothing:
     testPool.remove(txParent, removed, true);
@@ -99,4 +102,365 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolIndexTest)
+{
+    // Test the ancestor score and priority indexes and the dependency links
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 33000LL;
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout.hash = txParent.GetHash();
+    txChild.vin[0].prevout.n = 0;
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 11000LL;
+    uint256 hashParent = txParent.GetHash();
+    uint256 hashChild = txChild.GetHash();
+
+    CTxMemPool testPool(CFeeRate(0));
+    testPool.setSanityCheck(true);
+    std::list<CTransactionRef> removed;
+
+    // Low fee, high priority parent; high fee, zero priority child
+    testPool.addUnchecked(hashParent, CTxMemPoolEntry(txParent, 1000, 0, 1e9, 1));
+    testPool.addUnchecked(hashChild, CTxMemPoolEntry(txChild, 100000, 0, 0.0, 1));
+    BOOST_CHECK_EQUAL(testPool.GetLastSequence(), 2U);
+    BOOST_CHECK(testPool.setByAncestorScore.rbegin()->second == hashChild);
+    BOOST_CHECK(testPool.setByPriority.rbegin()->second == hashParent);
+    BOOST_CHECK(testPool.mapIndex[hashChild].setParents.count(hashParent));
+    BOOST_CHECK(testPool.mapIndex[hashParent].setChildren.count(hashChild));
+
+    // Prioritising moves the parent to the front and counts as a reorder
+    unsigned int nReordered = testPool.GetTransactionsReordered();
+    testPool.PrioritiseTransaction(hashParent, hashParent.ToString(), 0.0, 1000000);
+    BOOST_CHECK(testPool.setByAncestorScore.rbegin()->second == hashParent);
+    BOOST_CHECK(testPool.GetTransactionsReordered() > nReordered);
+    testPool.ClearPrioritisation(hashParent);
+    BOOST_CHECK(testPool.setByAncestorScore.rbegin()->second == hashChild);
+
+    // Parent mined: the child loses its link
+    testPool.remove(txParent, removed, false);
+    BOOST_CHECK_EQUAL(testPool.size(), 1);
+    BOOST_CHECK(testPool.mapIndex[hashChild].setParents.empty());
+
+    // Parent back from a disconnected block: the link is restored
+    testPool.addUnchecked(hashParent, CTxMemPoolEntry(txParent, 1000, 0, 1e9, 1));
+    BOOST_CHECK(testPool.mapIndex[hashChild].setParents.count(hashParent));
+    BOOST_CHECK(testPool.mapIndex[hashParent].setChildren.count(hashChild));
+    BOOST_CHECK(testPool.mapSequence.rbegin()->second == hashParent);
+
+    testPool.remove(txParent, removed, true);
+    BOOST_CHECK_EQUAL(testPool.size(), 0);
+    BOOST_CHECK(testPool.mapIndex.empty());
+    BOOST_CHECK(testPool.setByAncestorScore.empty());
+    BOOST_CHECK(testPool.setByPriority.empty());
+    BOOST_CHECK(testPool.mapSequence.empty());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPriorityAgingTest)
+{
+    // A transaction that entered with a lower priority but spends more value
+    // ages faster, and overtakes the other once the priority height moves
+    CMutableTransaction txSmall;
+    txSmall.vin.resize(1);
+    txSmall.vin[0].scriptSig = CScript() << OP_11;
+    txSmall.vout.resize(1);
+    txSmall.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txSmall.vout[0].nValue = 1000LL;
+    CMutableTransaction txLarge = txSmall;
+    txLarge.vout[0].nValue = 100 * BREADCRUMB;
+    uint256 hashSmall = txSmall.GetHash();
+    uint256 hashLarge = txLarge.GetHash();
+
+    CTxMemPool testPool(CFeeRate(0));
+    testPool.setSanityCheck(true);
+    testPool.SetPriorityHeight(1);
+    testPool.addUnchecked(hashSmall, CTxMemPoolEntry(txSmall, 0, 0, 1e9, 1));
+    CTxMemPoolEntry entryLarge(txLarge, 0, 0, 0.0, 1);
+    testPool.addUnchecked(hashLarge, entryLarge);
+    BOOST_CHECK(testPool.setByPriority.rbegin()->second == hashSmall);
+
+    testPool.SetPriorityHeight(1001);
+    BOOST_CHECK(entryLarge.GetPriority(1001) > 1e9);
+    BOOST_CHECK(testPool.setByPriority.rbegin()->second == hashLarge);
+    BOOST_CHECK_EQUAL(testPool.setByPriority.size(), 2U);
+
+    // Transactions added later are keyed at the same height
+    CMutableTransaction txNew = txSmall;
+    txNew.vout[0].nValue = 2000LL;
+    testPool.addUnchecked(txNew.GetHash(), CTxMemPoolEntry(txNew, 0, 0, 1e13, 1));
+    BOOST_CHECK(testPool.setByPriority.rbegin()->second == txNew.GetHash());
+    BOOST_CHECK(testPool.setByPriority.begin()->second == hashSmall);
+
+    // Back to a lower height, as after a reorg
+    testPool.SetPriorityHeight(1);
+    BOOST_CHECK(testPool.setByPriority.begin()->second == hashLarge);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+    pool.setSanityCheck(true);
+
+    // Three unrelated transactions paying 10, 20 and 30 per byte, and a
+    // child of the cheapest one paying 15 per byte
+    CMutableTransaction tx[3];
+    for (int i = 0; i < 3; i++)
+    {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_1 << i;
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10 * BREADCRUMB;
+    }
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_2;
+    txChild.vin[0].prevout.hash = tx[0].GetHash();
+    txChild.vin[0].prevout.n = 0;
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+    txChild.vout[0].nValue = 10 * BREADCRUMB;
+
+    for (int i = 0; i < 3; i++)
+    {
+        unsigned int nSize = ::GetSerializeSize(tx[i], SER_NETWORK, PROTOCOL_VERSION);
+        pool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], 10000 * (i + 1) * nSize / 1000, 0, 0.0, 1));
+    }
+    unsigned int nChildSize = ::GetSerializeSize(txChild, SER_NETWORK, PROTOCOL_VERSION);
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 15 * nChildSize, 0, 0.0, 1));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), 0);
+
+    // Usage only shrinks as transactions leave
+    size_t nUsage = pool.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage > pool.GetTotalTxSize());
+    pool.TrimToSize(nUsage);
+    BOOST_CHECK_EQUAL(pool.size(), 4);
+
+    // Trimming a little evicts the cheapest package: the first transaction
+    // and its child
+    unsigned int nParentSize = ::GetSerializeSize(tx[0], SER_NETWORK, PROTOCOL_VERSION);
+    CFeeRate packageRate(10 * nParentSize + 15 * nChildSize, nParentSize + nChildSize);
+    pool.TrimToSize(nUsage - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    BOOST_CHECK(!pool.exists(tx[0].GetHash()));
+    BOOST_CHECK(!pool.exists(txChild.GetHash()));
+    BOOST_CHECK(pool.DynamicMemoryUsage() < nUsage);
+
+    // New transactions now have to beat it, plus the relay fee
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), packageRate.GetFeePerK() + 1000);
+
+    // Which decays once a block has come in
+    std::vector<CTransaction> vtx;
+    std::list<CTransactionRef> conflicts;
+    pool.removeForBlock(vtx, 1, conflicts);
+    SetMockTime(GetTime() + ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK(pool.GetMinFee(pool.DynamicMemoryUsage() * 4).GetFeePerK() < packageRate.GetFeePerK() + 1000);
+    SetMockTime(GetTime() + 10 * ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), 0);
+    SetMockTime(0);
+
+    pool.clear();
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPackageTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+    pool.setSanityCheck(true);
+
+    // A chain of three: tx[0] <- tx[1] <- tx[2]
+    CMutableTransaction tx[3];
+    unsigned int nSize[3];
+    for (int i = 0; i < 3; i++)
+    {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11 << i;
+        if (i > 0) {
+            tx[i].vin[0].prevout.hash = tx[i-1].GetHash();
+            tx[i].vin[0].prevout.n = 0;
+        }
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10 * BREADCRUMB;
+        nSize[i] = ::GetSerializeSize(tx[i], SER_NETWORK, PROTOCOL_VERSION);
+        pool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], 1000 * (i + 1), 0, 0.0, 1));
+    }
+
+    const CTxMemPoolIndexEntry& first = pool.mapIndex[tx[0].GetHash()];
+    const CTxMemPoolIndexEntry& middle = pool.mapIndex[tx[1].GetHash()];
+    const CTxMemPoolIndexEntry& last = pool.mapIndex[tx[2].GetHash()];
+    BOOST_CHECK_EQUAL(first.nCountWithAncestors, 1);
+    BOOST_CHECK_EQUAL(first.nCountWithDescendants, 3);
+    BOOST_CHECK_EQUAL(first.nSizeWithDescendants, nSize[0] + nSize[1] + nSize[2]);
+    BOOST_CHECK_EQUAL(first.nModFeesWithDescendants, 6000);
+    BOOST_CHECK_EQUAL(middle.nCountWithAncestors, 2);
+    BOOST_CHECK_EQUAL(middle.nModFeesWithAncestors, 3000);
+    BOOST_CHECK_EQUAL(middle.nCountWithDescendants, 2);
+    BOOST_CHECK_EQUAL(last.nCountWithAncestors, 3);
+    BOOST_CHECK_EQUAL(last.nSizeWithAncestors, nSize[0] + nSize[1] + nSize[2]);
+    BOOST_CHECK_EQUAL(last.nModFeesWithAncestors, 6000);
+
+    // Prioritising the middle one shows up on both sides of it
+    pool.PrioritiseTransaction(tx[1].GetHash(), tx[1].GetHash().ToString(), 0, 10000);
+    BOOST_CHECK_EQUAL(first.nModFeesWithDescendants, 16000);
+    BOOST_CHECK_EQUAL(last.nModFeesWithAncestors, 16000);
+    pool.ClearPrioritisation(tx[1].GetHash());
+    BOOST_CHECK_EQUAL(first.nModFeesWithDescendants, 6000);
+
+    // A fourth link is over an ancestor limit of three
+    CMutableTransaction txNext;
+    txNext.vin.resize(1);
+    txNext.vin[0].prevout.hash = tx[2].GetHash();
+    txNext.vin[0].prevout.n = 0;
+    txNext.vout.resize(1);
+    txNext.vout[0].nValue = 10 * BREADCRUMB;
+    std::set<uint256> setAncestors;
+    std::string errString;
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(txNext, 100, setAncestors, 3, 100000, 100, 100000, errString));
+    setAncestors.clear();
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(txNext, 100, setAncestors, 4, 100000, 100, 100000, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 3);
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(txNext, 100, setAncestors, 4, 100000, 3, 100000, errString));
+
+    // Confirming the first leaves the totals of the other two
+    std::vector<CTransaction> vtx;
+    vtx.push_back(tx[0]);
+    std::list<CTransactionRef> conflicts;
+    pool.removeForBlock(vtx, 1, conflicts);
+    BOOST_CHECK_EQUAL(middle.nCountWithAncestors, 1);
+    BOOST_CHECK_EQUAL(middle.nModFeesWithAncestors, 2000);
+    BOOST_CHECK_EQUAL(last.nCountWithAncestors, 2);
+    BOOST_CHECK_EQUAL(last.nSizeWithAncestors, nSize[1] + nSize[2]);
+
+    // Putting it back after a reorg joins them up again
+    pool.addUnchecked(tx[0].GetHash(), CTxMemPoolEntry(tx[0], 1000, 0, 0.0, 1));
+    BOOST_CHECK_EQUAL(pool.mapIndex[tx[0].GetHash()].nCountWithDescendants, 3);
+    BOOST_CHECK_EQUAL(last.nCountWithAncestors, 3);
+    BOOST_CHECK_EQUAL(last.nModFeesWithAncestors, 6000);
+
+    // Removing the middle one with its descendants leaves the first alone
+    std::list<CTransactionRef> removed;
+    pool.remove(tx[1], removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    BOOST_CHECK_EQUAL(pool.mapIndex[tx[0].GetHash()].nCountWithDescendants, 1);
+    BOOST_CHECK_EQUAL(pool.mapIndex[tx[0].GetHash()].nModFeesWithDescendants, 1000);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolConflictsForBlockTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // Two pool transactions spend outputs that a block spends differently,
+    // and share a child
+    CMutableTransaction txSpend[2];
+    CMutableTransaction txBlock;
+    txBlock.vin.resize(2);
+    txBlock.vout.resize(1);
+    txBlock.vout[0].nValue = BREADCRUMB;
+    for (int i = 0; i < 2; i++)
+    {
+        txSpend[i].vin.resize(1);
+        txSpend[i].vin[0].prevout.hash = uint256(i + 1);
+        txSpend[i].vin[0].prevout.n = 0;
+        txSpend[i].vout.resize(1);
+        txSpend[i].vout[0].nValue = BREADCRUMB;
+        txBlock.vin[i].prevout = txSpend[i].vin[0].prevout;
+        pool.addUnchecked(txSpend[i].GetHash(), CTxMemPoolEntry(txSpend[i], 0, 0, 0.0, 1));
+    }
+    CMutableTransaction txChild;
+    txChild.vin.resize(2);
+    for (int i = 0; i < 2; i++)
+    {
+        txChild.vin[i].prevout.hash = txSpend[i].GetHash();
+        txChild.vin[i].prevout.n = 0;
+    }
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = BREADCRUMB;
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 0, 0, 0.0, 1));
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+
+    std::vector<CTransaction> vtx;
+    vtx.push_back(txBlock);
+    std::list<CTransactionRef> conflicts;
+    pool.removeForBlock(vtx, 2, conflicts);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK_EQUAL(conflicts.size(), 3);
+    BOOST_CHECK_EQUAL(pool.mapNextTx.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolDumpLoadTest)
+{
+    // Standard outputs anyone can spend, put straight into the UTXO set
+    CScript scriptRedeem = CScript() << OP_TRUE;
+    CScript scriptPubKey = GetScriptForDestination(CScriptID(scriptRedeem));
+    CScript scriptSig = CScript() << std::vector<unsigned char>(scriptRedeem.begin(), scriptRedeem.end());
+    CMutableTransaction txFunding;
+    txFunding.vin.resize(1);
+    txFunding.vin[0].prevout.hash = uint256(1);
+    txFunding.vout.resize(2);
+    for (int i = 0; i < 2; i++)
+    {
+        txFunding.vout[i].scriptPubKey = scriptPubKey;
+        txFunding.vout[i].nValue = BREADCRUMB;
+    }
+    pcoinsTip->ModifyCoins(txFunding.GetHash())->FromTx(txFunding, 0);
+
+    // A parent and child, and an unrelated transaction that goes first
+    CMutableTransaction tx[3];
+    for (int i = 0; i < 3; i++)
+    {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = scriptSig;
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = scriptPubKey;
+    }
+    tx[0].vin[0].prevout = COutPoint(txFunding.GetHash(), 0);
+    tx[0].vout[0].nValue = BREADCRUMB - CENT;
+    tx[1].vin[0].prevout = COutPoint(tx[0].GetHash(), 0);
+    tx[1].vout[0].nValue = BREADCRUMB - 2 * CENT;
+    tx[2].vin[0].prevout = COutPoint(txFunding.GetHash(), 1);
+    tx[2].vout[0].nValue = BREADCRUMB - CENT;
+
+    CTxMemPool pool(::minRelayTxFee);
+    {
+        LOCK(cs_main);
+        int64_t nTime[3] = { 2000, 3000, 1000 };
+        for (int i = 0; i < 3; i++)
+        {
+            CValidationState state;
+            BOOST_CHECK(AcceptToMemoryPool(pool, state, tx[i], false, NULL, false, nTime[i]));
+        }
+    }
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+    pool.PrioritiseTransaction(tx[1].GetHash(), tx[1].GetHash().ToString(), 1e6, 5000);
+    // Deltas for transactions not in the pool are kept as well
+    pool.PrioritiseTransaction(uint256(2), uint256(2).ToString(), -1e6, -5000);
+
+    BOOST_CHECK(DumpMempool(pool));
+    CTxMemPool poolLoaded(::minRelayTxFee);
+    BOOST_CHECK(LoadMempool(poolLoaded));
+
+    BOOST_CHECK_EQUAL(poolLoaded.size(), pool.size());
+    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = pool.mapTx.begin(); it != pool.mapTx.end(); ++it)
+    {
+        std::map<uint256, CTxMemPoolEntry>::const_iterator itLoaded = poolLoaded.mapTx.find(it->first);
+        BOOST_REQUIRE(itLoaded != poolLoaded.mapTx.end());
+        BOOST_CHECK_EQUAL(itLoaded->second.GetTime(), it->second.GetTime());
+        BOOST_CHECK_EQUAL(itLoaded->second.GetFee(), it->second.GetFee());
+        BOOST_CHECK_EQUAL(poolLoaded.mapIndex[it->first].nModFee, pool.mapIndex[it->first].nModFee);
+    }
+    BOOST_CHECK(poolLoaded.mapDeltas == pool.mapDeltas);
+    BOOST_CHECK_EQUAL(poolLoaded.mapIndex[tx[1].GetHash()].nModFee, CENT + 5000);
+
+    boost::filesystem::remove(GetDataDir() / "mempool.dat");
+    pcoinsTip->ModifyCoins(txFunding.GetHash())->Clear();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,170 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "clientversion.h"
+#include "net.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <vector>
+
+#include <boost/filesystem/operations.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+static CSharedPayload MakePayload(size_t nSize, char ch)
+{
+    vector<char> vData(nSize, ch);
+    return CSharedPayload(vData);
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_lru)
+{
+    CInv inv1(MSG_TX, uint256(1)), inv2(MSG_TX, uint256(2)), inv3(MSG_BLOCK, uint256(3));
+    CRelayCache cache(0);
+    CSharedPayload payload;
+    const int64_t nStartTime = 1400000000;
+    SetMockTime(nStartTime);
+
+    // Nothing fits in an empty budget
+    cache.Insert(inv1, MakePayload(1000, 'a'));
+    BOOST_CHECK_EQUAL(cache.size(), 0U);
+    BOOST_CHECK_EQUAL(cache.GetUsage(), 0U);
+    BOOST_CHECK(!cache.Get(inv1, payload));
+
+    // Room for two entries but not three
+    cache.SetMaxUsage(1000000);
+    cache.Insert(inv1, MakePayload(1000, 'a'));
+    BOOST_CHECK_EQUAL(cache.size(), 1U);
+    cache.SetMaxUsage(2 * cache.GetUsage() + 100);
+    cache.Insert(inv2, MakePayload(1000, 'b'));
+    BOOST_CHECK_EQUAL(cache.size(), 2U);
+
+    // Looking up inv1 makes inv2 the one to go
+    BOOST_CHECK(cache.Get(inv1, payload));
+    BOOST_CHECK_EQUAL(payload.size(), 1000U);
+    BOOST_CHECK_EQUAL((*payload.data)[0], 'a');
+    cache.Insert(inv3, MakePayload(1000, 'c'));
+    BOOST_CHECK_EQUAL(cache.size(), 2U);
+    BOOST_CHECK(!cache.Get(inv2, payload));
+    BOOST_CHECK(cache.Get(inv3, payload));
+    BOOST_CHECK(cache.Get(inv1, payload));
+
+    // Payloads are shared, not copied, and re-inserting keeps the first one
+    CSharedPayload payload2;
+    cache.Insert(inv1, MakePayload(1000, 'd'));
+    BOOST_CHECK(cache.Get(inv1, payload2));
+    BOOST_CHECK(payload2.data == payload.data);
+
+    // A different type with the same hash is a different entry
+    BOOST_CHECK(!cache.Get(CInv(MSG_CMPCT_BLOCK, uint256(3)), payload));
+
+    // Entries are not served once expired, and re-inserting starts afresh
+    SetMockTime(nStartTime + RELAY_CACHE_EXPIRY - 1);
+    BOOST_CHECK(cache.Get(inv1, payload));
+    SetMockTime(nStartTime + RELAY_CACHE_EXPIRY);
+    BOOST_CHECK(!cache.Get(inv1, payload));
+    BOOST_CHECK_EQUAL(cache.size(), 1U);
+    cache.Insert(inv3, MakePayload(1000, 'e'));
+    BOOST_CHECK(cache.Get(inv3, payload));
+    BOOST_CHECK_EQUAL((*payload.data)[0], 'e');
+    SetMockTime(0);
+
+    cache.SetMaxUsage(0);
+    BOOST_CHECK_EQUAL(cache.size(), 0U);
+    BOOST_CHECK_EQUAL(cache.GetUsage(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(msgstats)
+{
+    MsgStatsMap mapRecvBefore, mapSendBefore;
+    CNode::GetTotalMsgStats(mapRecvBefore, mapSendBefore);
+
+    CNode node(INVALID_SOCKET, CAddress());
+    node.PushMessage("ping", (uint64_t)1);
+    node.RecordRecvMsg("pong", 32, 100, 10);
+    node.RecordRecvMsg("pong", 32, 300, 0);
+    node.RecordRecvTime("pong", 50, 5);
+
+    CNodeStats stats;
+    node.copyStats(stats);
+    const CMsgStats& sent = stats.mapSendMsgStats["ping"];
+    BOOST_CHECK_EQUAL(sent.nCount, 1U);
+    BOOST_CHECK_EQUAL(sent.nBytes, CMessageHeader::HEADER_SIZE + 8U);
+    const CMsgStats& recv = stats.mapRecvMsgStats["pong"];
+    BOOST_CHECK_EQUAL(recv.nCount, 2U);
+    BOOST_CHECK_EQUAL(recv.nBytes, 64U);
+    BOOST_CHECK_EQUAL(recv.nTime, 450);
+    BOOST_CHECK_EQUAL(recv.nMaxTime, 300);
+    BOOST_CHECK_EQUAL(recv.nLockWait, 15);
+
+    // The totals count every peer
+    MsgStatsMap mapRecv, mapSend;
+    CNode::GetTotalMsgStats(mapRecv, mapSend);
+    BOOST_CHECK_EQUAL(mapRecv["pong"].nCount, mapRecvBefore["pong"].nCount + 2);
+    BOOST_CHECK_EQUAL(mapSend["ping"].nBytes, mapSendBefore["ping"].nBytes + CMessageHeader::HEADER_SIZE + 8);
+}
+
+/** Have node receive a message with an nSize byte payload, and return it */
+static CNetMessage ReceiveMessage(CNode& node, const char* pszCommand, unsigned int nSize)
+{
+    vector<char> vPayload(nSize, 'x');
+    CMessageHeader hdr(pszCommand, nSize);
+    uint256 hash = Hash(vPayload.begin(), vPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    ss.write(&vPayload[0], nSize);
+
+    LOCK(node.cs_vRecvMsg);
+    BOOST_CHECK(node.ReceiveMsgBytes(&ss[0], ss.size()));
+    CNetMessage msg = node.vRecvMsg.back();
+    node.vRecvMsg.clear();
+    return msg;
+}
+
+BOOST_AUTO_TEST_CASE(message_capture)
+{
+    boost::filesystem::path path = GetDataDir() / "msgcapture_test.dat";
+    boost::filesystem::remove(path);
+    CNode node(INVALID_SOCKET, CAddress());
+
+    // Room for the header and one record, but not two
+    BOOST_CHECK(OpenMessageCapture(path, 200));
+    CaptureMessage(&node, ReceiveMessage(node, "ping", 100));
+    CaptureMessage(&node, ReceiveMessage(node, "pong", 100));
+    CloseMessageCapture();
+
+    CCaptureFileHeader header;
+    CCapturedMessage record;
+    {
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        filein >> header >> record;
+        BOOST_CHECK(header.IsValid());
+        BOOST_CHECK_EQUAL(record.nodeid, node.GetId());
+        BOOST_CHECK_EQUAL(record.strCommand, "ping");
+        BOOST_CHECK_EQUAL(record.vPayload.size(), 100U);
+        BOOST_CHECK_THROW(filein >> record, std::ios_base::failure);
+    }
+
+    // Appending keeps the one header
+    uint64_t nSize = boost::filesystem::file_size(path);
+    BOOST_CHECK(OpenMessageCapture(path, 1000));
+    CaptureMessage(&node, ReceiveMessage(node, "pong", 100));
+    CloseMessageCapture();
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), 2 * nSize - ::GetSerializeSize(header, SER_DISK, CLIENT_VERSION));
+
+    // Anything else is left alone
+    {
+        CAutoFile fileout(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        fileout << record;
+    }
+    BOOST_CHECK(!OpenMessageCapture(path, 1000));
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
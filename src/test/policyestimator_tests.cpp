@@ -0,0 +1,70 @@
+// Copyright (c) 2011-2014 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "clientversion.h"
+#include "main.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <boost/test/unit_test.hpp>
+#include <list>
+
+BOOST_AUTO_TEST_SUITE(policyestimator_tests)
+
+BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
+{
+    CTxMemPool mpool(CFeeRate(1000));
+    std::list<CTransactionRef> dummyConflicted;
+    BOOST_CHECK(mpool.estimateFee(1) == CFeeRate(0));
+    BOOST_CHECK_EQUAL(mpool.estimatePriority(1), -1);
+
+    // Every block ten transactions come in at each of ten fee rates, 1000
+    // to 10000 per kB. The next block confirms the top five rates; the rest
+    // never confirm.
+    int nCount = 0;
+    for (unsigned int nHeight = 1; nHeight <= 100; nHeight++)
+    {
+        std::vector<CTransaction> vtxBlock;
+        for (int j = 0; j < 10; j++)
+        {
+            for (int k = 0; k < 10; k++)
+            {
+                CMutableTransaction tx;
+                tx.vin.resize(1);
+                tx.vin[0].scriptSig = CScript() << OP_1 << ++nCount;
+                tx.vout.resize(1);
+                tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+                tx.vout[0].nValue = BREADCRUMB;
+                unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+                CAmount nFee = (CAmount)(j + 1) * 1000 * nSize / 1000;
+                mpool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, nFee, 0, 0.0, nHeight));
+                if (j >= 5)
+                    vtxBlock.push_back(tx);
+            }
+        }
+        mpool.removeForBlock(vtxBlock, nHeight + 1, dummyConflicted);
+    }
+
+    // Next block: the cheapest rate that always made it
+    CFeeRate feeEstimate = mpool.estimateFee(1);
+    BOOST_CHECK(feeEstimate.GetFeePerK() > 5500 && feeEstimate.GetFeePerK() < 6500);
+    // Waiting longer never costs more
+    for (int i = 1; i < 25; i++)
+        BOOST_CHECK(mpool.estimateFee(i + 1) <= mpool.estimateFee(i));
+    BOOST_CHECK(mpool.estimateFee(0) == CFeeRate(0));
+    BOOST_CHECK(mpool.estimateFee(26) == CFeeRate(0));
+    BOOST_CHECK_EQUAL(mpool.estimatePriority(1), -1);
+
+    // The state survives a round trip through fee_estimates.dat
+    CAutoFile file(tmpfile(), SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK(mpool.WriteFeeEstimates(file));
+    rewind(file.Get());
+    CTxMemPool mpoolRead(CFeeRate(1000));
+    BOOST_CHECK(mpoolRead.ReadFeeEstimates(file));
+    for (int i = 1; i <= 25; i++)
+        BOOST_CHECK(mpoolRead.estimateFee(i) == mpool.estimateFee(i));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -161,4 +161,65 @@ BOOST_AUTO_TEST_CASE(insert_delete)
     BOOST_CHECK_EQUAL(ss.size(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(data_reader)
+{
+    CDataStream ss(SER_DISK, 0);
+    ss << (uint32_t)0x01020304 << std::string("duck") << (unsigned char)0xff;
+    std::vector<char> vch(ss.begin(), ss.end());
+
+    // Reads the same values as CDataStream, without taking a copy
+    CDataReader reader(&vch[0], vch.size(), SER_DISK, 0);
+    BOOST_CHECK_EQUAL(reader.size(), vch.size());
+    uint32_t n;
+    std::string str;
+    reader >> n >> str;
+    BOOST_CHECK_EQUAL(n, 0x01020304U);
+    BOOST_CHECK_EQUAL(str, "duck");
+    BOOST_CHECK_EQUAL(reader.size(), 1U);
+    BOOST_CHECK(reader.begin() == &vch[vch.size() - 1]);
+
+    // Reading past the end throws and leaves the position alone
+    uint32_t nTooBig;
+    BOOST_CHECK_THROW(reader >> nTooBig, std::ios_base::failure);
+    BOOST_CHECK_EQUAL(reader.size(), 1U);
+    unsigned char ch;
+    reader >> ch;
+    BOOST_CHECK_EQUAL(ch, 0xff);
+    BOOST_CHECK(reader.eof());
+    BOOST_CHECK_THROW(reader.ignore(1), std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(net_data_stream)
+{
+    CNetDataStream ss(SER_NETWORK, 0);
+    ss << (uint32_t)0x01020304 << std::string("duck");
+    BOOST_CHECK_EQUAL(ss.size(), 9U);
+
+    // GetAndClear hands over the buffer itself when it can
+    std::vector<char> vch;
+    const char* pchData = &ss[0];
+    ss.GetAndClear(vch);
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK_EQUAL(vch.size(), 9U);
+    BOOST_CHECK(&vch[0] == pchData);
+
+    // ...and appends a copy of what is left unread otherwise
+    ss << (uint32_t)0x05060708 << (unsigned char)0xff;
+    uint32_t n;
+    ss >> n;
+    BOOST_CHECK_EQUAL(n, 0x05060708U);
+    ss.GetAndClear(vch);
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK_EQUAL(vch.size(), 10U);
+    BOOST_CHECK_EQUAL(vch[9], (char)0xff);
+
+    // SwapBuffer exchanges the buffers and rewinds
+    ss << (unsigned char)0x01;
+    ss.SwapBuffer(vch);
+    BOOST_CHECK_EQUAL(ss.size(), 10U);
+    BOOST_CHECK_EQUAL(vch.size(), 1U);
+    ss >> n;
+    BOOST_CHECK_EQUAL(n, 0x01020304U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
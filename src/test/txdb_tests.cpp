@@ -0,0 +1,112 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "leveldbwrapper.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(txdb_tests)
+
+static const size_t MiB = 1 << 20;
+
+static CDBCacheSizes SizesFor(const std::string& strDbCache, const std::string& strArg = "", const std::string& strValue = "")
+{
+    mapArgs.erase("-dbcache");
+    mapArgs.erase("-txindex");
+    mapArgs.erase("-blockindexdbcache");
+    mapArgs.erase("-chainstatedbcache");
+    if (!strDbCache.empty())
+        mapArgs["-dbcache"] = strDbCache;
+    if (!strArg.empty())
+        mapArgs[strArg] = strValue;
+    CDBCacheSizes sizes = CalculateDBCacheSizes();
+    BOOST_CHECK_EQUAL(sizes.nBlockTreeDBCache + sizes.nCoinDBCache + sizes.nCoinCacheUsage,
+                      (size_t)std::max(std::min(GetArg("-dbcache", nDefaultDbCache), nMaxDbCache), nMinDbCache) * MiB);
+    return sizes;
+}
+
+BOOST_AUTO_TEST_CASE(dbcache_split)
+{
+    std::map<std::string, std::string> mapArgsSaved = mapArgs;
+
+    // The block index gets an eighth, at most 2 MiB, and the chainstate
+    // database half of the rest
+    CDBCacheSizes sizes = SizesFor("");
+    BOOST_CHECK_EQUAL(sizes.nBlockTreeDBCache, 2 * MiB);
+    BOOST_CHECK_EQUAL(sizes.nCoinDBCache, (size_t)(nDefaultDbCache - 2) * MiB / 2);
+    BOOST_CHECK_EQUAL(sizes.nCoinCacheUsage, sizes.nCoinDBCache);
+
+    sizes = SizesFor("8");
+    BOOST_CHECK_EQUAL(sizes.nBlockTreeDBCache, 1 * MiB);
+    BOOST_CHECK_EQUAL(sizes.nCoinDBCache, 7 * MiB / 2);
+
+    // -dbcache is clamped to its range
+    sizes = SizesFor("1");
+    BOOST_CHECK_EQUAL(sizes.nBlockTreeDBCache, (size_t)nMinDbCache * MiB / 8);
+    SizesFor("1000000");
+
+    // -txindex lifts the 2 MiB cap on the block index
+    sizes = SizesFor("100", "-txindex", "1");
+    BOOST_CHECK_EQUAL(sizes.nBlockTreeDBCache, 100 * MiB / 8);
+
+    // Explicit sizes are taken out of -dbcache, between 1 MiB and half of what is left
+    sizes = SizesFor("100", "-blockindexdbcache", "8");
+    BOOST_CHECK_EQUAL(sizes.nBlockTreeDBCache, 8 * MiB);
+    BOOST_CHECK_EQUAL(sizes.nCoinDBCache, 92 * MiB / 2);
+    sizes = SizesFor("100", "-blockindexdbcache", "1000");
+    BOOST_CHECK_EQUAL(sizes.nBlockTreeDBCache, 50 * MiB);
+    sizes = SizesFor("100", "-chainstatedbcache", "10");
+    BOOST_CHECK_EQUAL(sizes.nBlockTreeDBCache, 2 * MiB);
+    BOOST_CHECK_EQUAL(sizes.nCoinDBCache, 10 * MiB);
+    BOOST_CHECK_EQUAL(sizes.nCoinCacheUsage, 88 * MiB);
+    sizes = SizesFor("100", "-chainstatedbcache", "1000");
+    BOOST_CHECK_EQUAL(sizes.nCoinDBCache, 49 * MiB);
+    sizes = SizesFor("100", "-chainstatedbcache", "0");
+    BOOST_CHECK_EQUAL(sizes.nCoinDBCache, 1 * MiB);
+
+    mapArgs = mapArgsSaved;
+}
+
+BOOST_AUTO_TEST_CASE(leveldb_cache_split)
+{
+    // Half of a database's cache goes to the block cache and a quarter to
+    // each write buffer, unless the write buffer size is set
+    CLevelDBOptions dbOptions(8 * MiB);
+    BOOST_CHECK_EQUAL(dbOptions.GetBlockCacheSize(), 4 * MiB);
+    BOOST_CHECK_EQUAL(dbOptions.GetWriteBufferSize(), 2 * MiB);
+    dbOptions.nWriteBufferSize = 1 * MiB;
+    BOOST_CHECK_EQUAL(dbOptions.GetBlockCacheSize(), 4 * MiB);
+    BOOST_CHECK_EQUAL(dbOptions.GetWriteBufferSize(), 1 * MiB);
+}
+
+BOOST_AUTO_TEST_CASE(db_options_args)
+{
+    std::map<std::string, std::string> mapArgsSaved = mapArgs;
+
+    mapArgs["-chainstatedbbloombits"] = "0";
+    mapArgs["-chainstatedbwritebuffer"] = "16";
+    mapArgs["-chainstatedbcompression"] = "1";
+    CLevelDBOptions dbOptions = GetDBOptions("chainstatedb", 8 * MiB);
+    BOOST_CHECK_EQUAL(dbOptions.nCacheSize, 8 * MiB);
+    BOOST_CHECK_EQUAL(dbOptions.nBloomBits, 0);
+    BOOST_CHECK_EQUAL(dbOptions.GetWriteBufferSize(), 16 * MiB);
+    BOOST_CHECK(dbOptions.fCompression);
+
+    // Each database only reads its own overrides
+    CLevelDBOptions dbDefaults(8 * MiB);
+    dbOptions = GetDBOptions("blockindexdb", 8 * MiB);
+    BOOST_CHECK_EQUAL(dbOptions.nBloomBits, dbDefaults.nBloomBits);
+    BOOST_CHECK_EQUAL(dbOptions.GetWriteBufferSize(), dbDefaults.GetWriteBufferSize());
+    BOOST_CHECK_EQUAL(dbOptions.fCompression, dbDefaults.fCompression);
+
+    mapArgs = mapArgsSaved;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
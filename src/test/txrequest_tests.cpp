@@ -0,0 +1,169 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txrequest.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(txrequest_tests)
+
+static const int64_t TIMEOUT = 60 * 1000000LL;
+
+static vector<uint256> Requestable(CTxRequestTracker& tracker, NodeId peer, int64_t nNow)
+{
+    vector<uint256> vRequest;
+    tracker.GetRequestable(peer, nNow, vRequest);
+    return vRequest;
+}
+
+BOOST_AUTO_TEST_CASE(txrequest_preference)
+{
+    CTxRequestTracker tracker(100, 100, TIMEOUT);
+    uint256 hash(1);
+
+    // An inbound peer announces first, but an outbound peer is still asked
+    BOOST_CHECK(tracker.ReceivedInv(0, hash, false, 1000));
+    BOOST_CHECK(tracker.ReceivedInv(1, hash, true, 1000));
+    BOOST_CHECK(!tracker.ReceivedInv(1, hash, true, 1000));
+    BOOST_CHECK_EQUAL(tracker.Size(), 2U);
+
+    BOOST_CHECK(Requestable(tracker, 1, 999).empty());
+    BOOST_CHECK(Requestable(tracker, 0, 1000).empty());
+    vector<uint256> vRequest = Requestable(tracker, 1, 1000);
+    BOOST_CHECK_EQUAL(vRequest.size(), 1U);
+    BOOST_CHECK(vRequest[0] == hash);
+    BOOST_CHECK_EQUAL(tracker.CountInFlight(1), 1U);
+
+    // Only one peer is asked at a time
+    BOOST_CHECK(Requestable(tracker, 0, 2000).empty());
+    BOOST_CHECK(Requestable(tracker, 1, 2000).empty());
+
+    // Receiving it makes everyone forget about it
+    tracker.ReceivedResponse(1, hash);
+    tracker.ForgetTxHash(hash);
+    BOOST_CHECK_EQUAL(tracker.Size(), 0U);
+    BOOST_CHECK_EQUAL(tracker.Count(0), 0U);
+    BOOST_CHECK_EQUAL(tracker.CountInFlight(1), 0U);
+    BOOST_CHECK(Requestable(tracker, 0, 3000).empty());
+}
+
+BOOST_AUTO_TEST_CASE(txrequest_fallback)
+{
+    CTxRequestTracker tracker(100, 100, TIMEOUT);
+    uint256 hash(1), hash2(2);
+
+    tracker.ReceivedInv(0, hash, true, 0);
+    tracker.ReceivedInv(1, hash, true, 10);
+    tracker.ReceivedInv(2, hash, false, 0);
+    BOOST_CHECK_EQUAL(Requestable(tracker, 0, 100).size(), 1U);
+
+    // Peer 0 doesn't answer in time: the next preferred peer is asked
+    BOOST_CHECK(Requestable(tracker, 1, 99 + TIMEOUT).empty());
+    BOOST_CHECK_EQUAL(Requestable(tracker, 1, 100 + TIMEOUT).size(), 1U);
+    BOOST_CHECK_EQUAL(tracker.CountInFlight(0), 0U);
+
+    // Peer 1 doesn't have it after all: on to peer 2
+    tracker.ReceivedResponse(1, hash);
+    BOOST_CHECK_EQUAL(Requestable(tracker, 2, 200 + TIMEOUT).size(), 1U);
+
+    // Nobody left to ask once peer 2 leaves
+    tracker.DisconnectedPeer(2);
+    BOOST_CHECK_EQUAL(tracker.Size(), 0U);
+
+    // A peer that timed out loses out against an equally preferred one
+    tracker.ReceivedInv(0, hash2, true, 0);
+    tracker.ReceivedInv(1, hash2, true, 10);
+    BOOST_CHECK(Requestable(tracker, 0, 1000 + TIMEOUT).empty());
+    BOOST_CHECK_EQUAL(Requestable(tracker, 1, 1000 + TIMEOUT).size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(txrequest_disconnect)
+{
+    CTxRequestTracker tracker(100, 100, TIMEOUT);
+    uint256 hash(1);
+
+    tracker.ReceivedInv(0, hash, true, 0);
+    tracker.ReceivedInv(1, hash, false, 0);
+    BOOST_CHECK_EQUAL(Requestable(tracker, 0, 0).size(), 1U);
+    BOOST_CHECK(Requestable(tracker, 1, 0).empty());
+
+    // The request is handed over right away when its peer goes
+    tracker.DisconnectedPeer(0);
+    BOOST_CHECK_EQUAL(tracker.Size(), 1U);
+    BOOST_CHECK_EQUAL(Requestable(tracker, 1, 0).size(), 1U);
+    tracker.DisconnectedPeer(1);
+    BOOST_CHECK_EQUAL(tracker.Size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(txrequest_many_announcers)
+{
+    CTxRequestTracker tracker(100, 100, TIMEOUT);
+    uint256 hash(1);
+    const int nPeers = 50;
+
+    for (int i = 0; i < nPeers; i++)
+        tracker.ReceivedInv(i, hash, true, i);
+    BOOST_CHECK_EQUAL(Requestable(tracker, 0, 100).size(), 1U);
+
+    // While peer 0 is asked, the others are parked after one look
+    for (int i = 1; i < nPeers; i++) {
+        BOOST_CHECK(Requestable(tracker, i, 100).empty());
+        BOOST_CHECK_EQUAL(tracker.CountCandidates(i), 0U);
+        BOOST_CHECK_EQUAL(tracker.Count(i), 1U);
+    }
+
+    // A notfound hands the request to the next announcer
+    tracker.ReceivedResponse(0, hash);
+    for (int i = 1; i < nPeers; i++)
+        BOOST_CHECK_EQUAL(tracker.CountCandidates(i), 1U);
+    BOOST_CHECK(Requestable(tracker, 2, 200).empty());
+    BOOST_CHECK_EQUAL(Requestable(tracker, 1, 200).size(), 1U);
+    BOOST_CHECK(Requestable(tracker, 2, 200).empty());
+    BOOST_CHECK_EQUAL(tracker.CountCandidates(2), 0U);
+
+    // So does an expired request
+    BOOST_CHECK_EQUAL(Requestable(tracker, 2, 200 + TIMEOUT).size(), 1U);
+    BOOST_CHECK_EQUAL(tracker.CountInFlight(1), 0U);
+
+    // And a disconnect
+    tracker.DisconnectedPeer(2);
+    BOOST_CHECK_EQUAL(Requestable(tracker, 3, 300 + TIMEOUT).size(), 1U);
+    BOOST_CHECK_EQUAL(tracker.Count(2), 0U);
+
+    tracker.ForgetTxHash(hash);
+    BOOST_CHECK_EQUAL(tracker.Size(), 0U);
+    for (int i = 0; i < nPeers; i++)
+        BOOST_CHECK_EQUAL(tracker.CountCandidates(i), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(txrequest_limits)
+{
+    CTxRequestTracker tracker(3, 2, TIMEOUT);
+
+    // Announcements beyond the per-peer limit are ignored
+    for (int i = 1; i <= 4; i++)
+        BOOST_CHECK_EQUAL(tracker.ReceivedInv(0, uint256(i), true, i), i <= 3);
+    BOOST_CHECK_EQUAL(tracker.Count(0), 3U);
+    tracker.ReceivedInv(1, uint256(3), false, 0);
+
+    // No more than two requests in flight; the third goes to another peer
+    vector<uint256> vRequest = Requestable(tracker, 0, 100);
+    BOOST_CHECK_EQUAL(vRequest.size(), 2U);
+    BOOST_CHECK(vRequest[0] == uint256(1));
+    BOOST_CHECK(vRequest[1] == uint256(2));
+    vRequest = Requestable(tracker, 1, 100);
+    BOOST_CHECK_EQUAL(vRequest.size(), 1U);
+    BOOST_CHECK(vRequest[0] == uint256(3));
+
+    // Answers make room for new announcements
+    tracker.ReceivedResponse(0, uint256(1));
+    BOOST_CHECK_EQUAL(tracker.Count(0), 2U);
+    BOOST_CHECK(tracker.ReceivedInv(0, uint256(4), true, 200));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
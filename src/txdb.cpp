@@ -5,6 +5,7 @@
 
 #include "txdb.h"
 
+#include "init.h"
 #include "pow.h"
 #include "uint256.h"
 
@@ -25,7 +26,10 @@ void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
     batch.Write('B', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe), nBatchWrites(0) {
+}
+
+CCoinsViewDB::CCoinsViewDB(const CLevelDBOptions& dbOptions, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", dbOptions, fMemory, fWipe), nBatchWrites(0) {
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
@@ -60,12 +64,61 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
         BatchWriteHashBestChain(batch, hashBlock);
 
     LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    nBatchWrites++;
     return db.WriteBatch(batch);
 }
 
+CDBCacheSizes CalculateDBCacheSizes()
+{
+    CDBCacheSizes sizes;
+    size_t nTotalCache = (GetArg("-dbcache", nDefaultDbCache) << 20);
+    if (nTotalCache < (nMinDbCache << 20))
+        nTotalCache = (nMinDbCache << 20); // total cache cannot be less than nMinDbCache
+    else if (nTotalCache > (nMaxDbCache << 20))
+        nTotalCache = (nMaxDbCache << 20); // total cache cannot be greater than nMaxDbCache
+    sizes.nBlockTreeDBCache = nTotalCache / 8;
+    if (sizes.nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false))
+        sizes.nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
+    if (mapArgs.count("-blockindexdbcache"))
+        sizes.nBlockTreeDBCache = std::min((size_t)std::max(GetArg("-blockindexdbcache", 0), (int64_t)1) << 20, nTotalCache / 2);
+    nTotalCache -= sizes.nBlockTreeDBCache;
+    sizes.nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
+    if (mapArgs.count("-chainstatedbcache"))
+        sizes.nCoinDBCache = std::min((size_t)std::max(GetArg("-chainstatedbcache", 0), (int64_t)1) << 20, nTotalCache / 2);
+    sizes.nCoinCacheUsage = nTotalCache - sizes.nCoinDBCache;
+    return sizes;
+}
+
+CLevelDBOptions GetDBOptions(const std::string& strName, size_t nCacheSize)
+{
+    CLevelDBOptions dbOptions(nCacheSize);
+    dbOptions.nBloomBits = std::max((int)GetArg("-" + strName + "bloombits", dbOptions.nBloomBits), 0);
+    dbOptions.nWriteBufferSize = (size_t)std::max(GetArg("-" + strName + "writebuffer", 0), (int64_t)0) << 20;
+    dbOptions.fCompression = GetBoolArg("-" + strName + "compression", dbOptions.fCompression);
+    return dbOptions;
+}
+
+void CCoinsViewDB::CompactSlice(unsigned int nSlice, unsigned int nSlices)
+{
+    // Coin keys are 'c' followed by the txid, whose first byte is uniformly
+    // distributed; split on it. The last slice also takes the other record types.
+    std::string strBegin(1, 'c'), strEnd(1, 'c');
+    strBegin += (char)(nSlice * 256 / nSlices);
+    if (nSlice + 1 < nSlices)
+        strEnd += (char)((nSlice + 1) * 256 / nSlices);
+    else
+        strEnd = std::string(1, '\xff');
+    if (nSlice == 0)
+        strBegin = "";
+    db.CompactRange(strBegin, strEnd);
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
 }
 
+CBlockTreeDB::CBlockTreeDB(const CLevelDBOptions& dbOptions, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", dbOptions, fMemory, fWipe) {
+}
+
 bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
     return Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
@@ -100,10 +153,7 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 }
 
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
-    /* It seems that there are no "const iterators" for LevelDB.  Since we
-       only need read operations on it, use a const-cast to get around
-       that restriction.  */
-    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
+    boost::scoped_ptr<CLevelDBIterator> pcursor(db.NewIterator());
     pcursor->SeekToFirst();
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
@@ -113,13 +163,11 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            CDataReader ssKey = pcursor->GetKey();
             char chType;
             ssKey >> chType;
             if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                CDataReader ssValue = pcursor->GetValue();
                 CCoins coins;
                 ssValue >> coins;
                 uint256 txhash;
@@ -138,7 +186,7 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
                         nTotalAmount += out.nValue;
                     }
                 }
-                stats.nSerializedSize += 32 + slValue.size();
+                stats.nSerializedSize += 32 + pcursor->GetValueSize();
                 ss << VARINT(0);
             }
             pcursor->Next();
@@ -177,23 +225,19 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
 
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
-    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+    boost::scoped_ptr<CLevelDBIterator> pcursor(NewIterator());
 
-    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
-    ssKeySet << make_pair('b', uint256(0));
-    pcursor->Seek(ssKeySet.str());
+    pcursor->Seek(make_pair('b', uint256(0)));
 
     // Load mapBlockIndex
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            CDataReader ssKey = pcursor->GetKey();
             char chType;
             ssKey >> chType;
             if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                CDataReader ssValue = pcursor->GetValue();
                 CDiskBlockIndex diskindex;
                 ssValue >> diskindex;
 
@@ -232,3 +276,60 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
 
     return true;
 }
+
+bool CompactChainstate()
+{
+    CCoinsViewDB *pcoinsdb;
+    {
+        LOCK(cs_main);
+        pcoinsdb = pcoinsdbview;
+    }
+    // LevelDB compactions run concurrently with reads and writes; pcoinsdbview
+    // itself is only replaced during startup.
+    // LevelDB can't interrupt a compaction, so shutdown is only checked
+    // between slices.
+    for (unsigned int nSlice = 0; nSlice < CHAINSTATE_COMPACT_SLICES; nSlice++) {
+        if (ShutdownRequested())
+            return false;
+        pcoinsdb->CompactSlice(nSlice, CHAINSTATE_COMPACT_SLICES);
+    }
+    return true;
+}
+
+void ThreadCompactChainstate()
+{
+    int64_t nIdleTime = GetArg("-compactidle", DEFAULT_COMPACT_IDLE);
+    CCoinsViewDB *pcoinsdb;
+    uint64_t nBatchWritesCompacted, nBatchWritesSweep = 0;
+    {
+        LOCK(cs_main);
+        pcoinsdb = pcoinsdbview;
+        nBatchWritesCompacted = pcoinsdb->GetBatchWrites();
+    }
+
+    unsigned int nSlice = 0;
+    while (true) {
+        MilliSleep(1000);
+
+        if (IsInitialBlockDownload() || GetTime() - nTimeBestReceived < nIdleTime)
+            continue;
+        if (nSlice == 0) {
+            // Only start a new sweep once the chainstate has been written to since the last one
+            LOCK(cs_main);
+            nBatchWritesSweep = pcoinsdb->GetBatchWrites();
+            if (nBatchWritesSweep == nBatchWritesCompacted)
+                continue;
+        }
+
+        int64_t nStart = GetTimeMillis();
+        pcoinsdb->CompactSlice(nSlice, CHAINSTATE_COMPACT_SLICES);
+        int64_t nElapsed = GetTimeMillis() - nStart;
+        LogPrint("coindb", "Compacted chainstate slice %u/%u in %dms\n", nSlice + 1, CHAINSTATE_COMPACT_SLICES, nElapsed);
+
+        if (++nSlice == CHAINSTATE_COMPACT_SLICES) {
+            nSlice = 0;
+            nBatchWritesCompacted = nBatchWritesSweep;
+        }
+        MilliSleep(nElapsed * CHAINSTATE_COMPACT_THROTTLE);
+    }
+}
@@ -23,20 +23,49 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! -compactidle default (seconds without a new tip before compacting the chainstate, 0 = off)
+static const int64_t DEFAULT_COMPACT_IDLE = 60;
+//! Number of key ranges a chainstate compaction sweep is split into
+static const unsigned int CHAINSTATE_COMPACT_SLICES = 16;
+//! Idle compaction sleeps this many times as long as each slice took, capping its share of disk time
+static const unsigned int CHAINSTATE_COMPACT_THROTTLE = 3;
+
+/** How the -dbcache budget is divided, in bytes */
+struct CDBCacheSizes
+{
+    size_t nBlockTreeDBCache;
+    size_t nCoinDBCache;
+    size_t nCoinCacheUsage; //! What is left for the in-memory coins cache
+};
+
+/** Divide -dbcache between the databases, following -blockindexdbcache, -chainstatedbcache and -txindex */
+CDBCacheSizes CalculateDBCacheSizes();
+
+/** Options for one database, with the -<strName>bloombits, -<strName>writebuffer and -<strName>compression overrides */
+CLevelDBOptions GetDBOptions(const std::string& strName, size_t nCacheSize);
 
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDBWrapper db;
+    //! Number of BatchWrite calls so far
+    uint64_t nBatchWrites;
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CCoinsViewDB(const CLevelDBOptions& dbOptions, bool fMemory = false, bool fWipe = false);
 
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
     bool HaveCoins(const uint256 &txid) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     bool GetStats(CCoinsStats &stats) const;
+
+    const CLevelDBWrapper& GetDB() const { return db; }
+    uint64_t GetBatchWrites() const { return nBatchWrites; }
+
+    /** Compact slice nSlice of nSlices equal slices of the coin key space */
+    void CompactSlice(unsigned int nSlice, unsigned int nSlices);
 };
 
 /** Access to the block database (blocks/index/) */
@@ -44,6 +73,7 @@ class CBlockTreeDB : public CLevelDBWrapper
 {
 public:
     CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CBlockTreeDB(const CLevelDBOptions& dbOptions, bool fMemory = false, bool fWipe = false);
 private:
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
@@ -62,4 +92,13 @@ public:
     bool LoadBlockIndexGuts();
 };
 
+/**
+ * Compact the whole chainstate database now, one slice at a time. Returns
+ * false if a shutdown was requested before all slices were done.
+ */
+bool CompactChainstate();
+
+/** Compact the chainstate in throttled slices whenever the node is at the tip and idle */
+void ThreadCompactChainstate();
+
 #endif // BITBREADCRUMB_TXDB_H
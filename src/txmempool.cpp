@@ -6,18 +6,17 @@
 #include "txmempool.h"
 
 #include "clientversion.h"
+#include "core_memusage.h"
 #include "main.h"
 #include "streams.h"
 #include "util.h"
 #include "utilmoneystr.h"
 #include "version.h"
 
-#include <boost/circular_buffer.hpp>
-
 using namespace std;
 
 CTxMemPoolEntry::CTxMemPoolEntry():
-    nFee(0), nTxSize(0), nModSize(0), nTime(0), dPriority(0.0)
+    nFee(0), nTxSize(0), nModSize(0), nUsageSize(0), nTime(0), dPriority(0.0)
 {
     nHeight = MEMPOOL_HEIGHT;
 }
@@ -25,11 +24,23 @@ CTxMemPoolEntry::CTxMemPoolEntry():
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
                                  int64_t _nTime, double _dPriority,
                                  unsigned int _nHeight):
+    tx(MakeTransactionRef(_tx)), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight)
+{
+    nTxSize = ::GetSerializeSize(*tx, SER_NETWORK, PROTOCOL_VERSION);
+
+    nModSize = tx->CalculateModifiedSize(nTxSize);
+    nUsageSize = RecursiveDynamicUsage(*tx) + memusage::DynamicUsage(tx);
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
+                                 int64_t _nTime, double _dPriority,
+                                 unsigned int _nHeight):
     tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight)
 {
-    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nTxSize = ::GetSerializeSize(*tx, SER_NETWORK, PROTOCOL_VERSION);
 
-    nModSize = tx.CalculateModifiedSize(nTxSize);
+    nModSize = tx->CalculateModifiedSize(nTxSize);
+    nUsageSize = RecursiveDynamicUsage(*tx) + memusage::DynamicUsage(tx);
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -40,169 +51,418 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
 double
 CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
 {
-    CAmount nValueIn = tx.GetValueOut()+nFee;
+    CAmount nValueIn = tx->GetValueOut()+nFee;
     double deltaPriority = ((double)(currentHeight-nHeight)*nValueIn)/nModSize;
     double dResult = dPriority + deltaPriority;
     return dResult;
 }
 
+/** Transactions confirmed this many blocks ago count half as much as new ones after ~350 blocks */
+static const double FEE_ESTIMATE_DECAY = .998;
+/** Share of a bucket range's transactions that must confirm in time for its fee to be the answer */
+static const double MIN_SUCCESS_PCT = .95;
+/** Decayed transactions per block a bucket range needs before it says anything */
+static const double SUFFICIENT_FEETXS = 1;
+static const double SUFFICIENT_PRITXS = .2;
+/** Ratio between neighbouring bucket boundaries */
+static const double FEE_SPACING = 1.1;
+static const double PRI_SPACING = 2;
 /**
- * Keep track of fee/priority for transactions confirmed within N blocks
+ * Version required to read the bucketed fee_estimates.dat format. It is above
+ * any release that reads the old samples format, so those start over instead.
  */
-class CBlockAverage
+static const int FEE_ESTIMATES_BUCKETED_VERSION = 109900;
+
+/**
+ * Confirmation statistics for transactions grouped into buckets by fee rate
+ * or by priority. Per bucket it keeps exponentially decaying counts of the
+ * transactions that confirmed and of those that confirmed within 1, 2, ...
+ * blocks, plus the transactions still waiting. The state has a fixed size
+ * and old blocks fade out instead of being dropped from a window.
+ */
+class CConfirmStats
 {
 private:
-    boost::circular_buffer<CFeeRate> feeSamples;
-    boost::circular_buffer<double> prioritySamples;
-
-    template<typename T> std::vector<T> buf2vec(boost::circular_buffer<T> buf) const
+    //! Upper bound of each bucket; the last one catches everything above
+    std::vector<double> buckets;
+    //! Bucket boundary to index, to find the bucket of a value
+    std::map<double, unsigned int> bucketMap;
+
+    //! Decaying count of confirmed transactions per bucket
+    std::vector<double> txCtAvg;
+    //! Decaying count of transactions confirmed within Y blocks, per [Y-1][bucket]
+    std::vector<std::vector<double> > confAvg;
+    //! Decaying sum of the fee rates or priorities of confirmed transactions per bucket
+    std::vector<double> avg;
+
+    //! The same for the block being processed, until UpdateMovingAverages
+    std::vector<int> curBlockTxCt;
+    std::vector<std::vector<int> > curBlockConf;
+    std::vector<double> curBlockVal;
+
+    //! Transactions waiting for confirmation, per [entry height % max confirms][bucket]
+    std::vector<std::vector<int> > unconfTxs;
+    //! Transactions waiting for longer than that, per bucket
+    std::vector<int> oldUnconfTxs;
+
+    double decay;
+    std::string dataTypeString;
+
+    void Resize()
     {
-        std::vector<T> vec(buf.begin(), buf.end());
-        return vec;
+        unsigned int nMaxConfirms = confAvg.size();
+        curBlockTxCt.assign(buckets.size(), 0);
+        curBlockConf.assign(nMaxConfirms, std::vector<int>(buckets.size(), 0));
+        curBlockVal.assign(buckets.size(), 0);
+        unconfTxs.assign(nMaxConfirms, std::vector<int>(buckets.size(), 0));
+        oldUnconfTxs.assign(buckets.size(), 0);
+        bucketMap.clear();
+        for (unsigned int i = 0; i < buckets.size(); i++)
+            bucketMap[buckets[i]] = i;
     }
 
 public:
-    CBlockAverage() : feeSamples(100), prioritySamples(100) { }
-
-    void RecordFee(const CFeeRate& feeRate) {
-        feeSamples.push_back(feeRate);
+    void Initialize(const std::vector<double>& defaultBuckets, unsigned int nMaxConfirms, double decayIn, const std::string& dataTypeStringIn)
+    {
+        decay = decayIn;
+        dataTypeString = dataTypeStringIn;
+        buckets = defaultBuckets;
+        txCtAvg.assign(buckets.size(), 0);
+        confAvg.assign(nMaxConfirms, std::vector<double>(buckets.size(), 0));
+        avg.assign(buckets.size(), 0);
+        Resize();
     }
 
-    void RecordPriority(double priority) {
-        prioritySamples.push_back(priority);
-    }
+    unsigned int GetMaxConfirms() const { return confAvg.size(); }
 
-    size_t FeeSamples() const { return feeSamples.size(); }
-    size_t GetFeeSamples(std::vector<CFeeRate>& insertInto) const
+    /** Start a new block: forget this height's slot of unconfirmed counts */
+    void ClearCurrent(unsigned int nBlockHeight)
     {
-        BOOST_FOREACH(const CFeeRate& f, feeSamples)
-            insertInto.push_back(f);
-        return feeSamples.size();
+        unsigned int nBlockIndex = nBlockHeight % unconfTxs.size();
+        for (unsigned int j = 0; j < buckets.size(); j++) {
+            oldUnconfTxs[j] += unconfTxs[nBlockIndex][j];
+            unconfTxs[nBlockIndex][j] = 0;
+            for (unsigned int i = 0; i < curBlockConf.size(); i++)
+                curBlockConf[i][j] = 0;
+            curBlockTxCt[j] = 0;
+            curBlockVal[j] = 0;
+        }
     }
-    size_t PrioritySamples() const { return prioritySamples.size(); }
-    size_t GetPrioritySamples(std::vector<double>& insertInto) const
+
+    /** A transaction with value val confirmed after blocksToConfirm blocks */
+    void Record(int blocksToConfirm, double val)
     {
-        BOOST_FOREACH(double d, prioritySamples)
-            insertInto.push_back(d);
-        return prioritySamples.size();
+        if (blocksToConfirm < 1)
+            return;
+        unsigned int bucketIndex = bucketMap.lower_bound(val)->second;
+        for (size_t i = blocksToConfirm; i <= curBlockConf.size(); i++)
+            curBlockConf[i - 1][bucketIndex]++;
+        curBlockTxCt[bucketIndex]++;
+        curBlockVal[bucketIndex] += val;
     }
 
-    /**
-     * Used as belt-and-suspenders check when reading to detect
-     * file corruption
-     */
-    static bool AreSane(const CFeeRate fee, const CFeeRate& minRelayFee)
+    /** Fold the current block into the decaying averages */
+    void UpdateMovingAverages()
     {
-        if (fee < CFeeRate(0))
-            return false;
-        if (fee.GetFeePerK() > minRelayFee.GetFeePerK() * 10000)
-            return false;
-        return true;
+        for (unsigned int j = 0; j < buckets.size(); j++) {
+            for (unsigned int i = 0; i < confAvg.size(); i++)
+                confAvg[i][j] = confAvg[i][j] * decay + curBlockConf[i][j];
+            avg[j] = avg[j] * decay + curBlockVal[j];
+            txCtAvg[j] = txCtAvg[j] * decay + curBlockTxCt[j];
+        }
     }
-    static bool AreSane(const std::vector<CFeeRate>& vecFee, const CFeeRate& minRelayFee)
+
+    /** A transaction entered the pool; returns its bucket */
+    unsigned int NewTx(unsigned int nBlockHeight, double val)
     {
-        BOOST_FOREACH(CFeeRate fee, vecFee)
-        {
-            if (!AreSane(fee, minRelayFee))
-                return false;
-        }
-        return true;
+        unsigned int bucketIndex = bucketMap.lower_bound(val)->second;
+        unconfTxs[nBlockHeight % unconfTxs.size()][bucketIndex]++;
+        return bucketIndex;
     }
-    static bool AreSane(const double priority)
+
+    /** A transaction left the pool, confirmed or not */
+    void RemoveTx(unsigned int nEntryHeight, unsigned int nBestSeenHeight, unsigned int bucketIndex)
     {
-        return priority >= 0;
+        if (nBestSeenHeight < nEntryHeight)
+            return;
+        unsigned int nBlocksAgo = nBestSeenHeight - nEntryHeight;
+        if (nBestSeenHeight == 0)
+            nBlocksAgo = 0;
+        if (nBlocksAgo >= unconfTxs.size()) {
+            if (oldUnconfTxs[bucketIndex] > 0)
+                oldUnconfTxs[bucketIndex]--;
+        } else {
+            unsigned int nBlockIndex = nEntryHeight % unconfTxs.size();
+            if (unconfTxs[nBlockIndex][bucketIndex] > 0)
+                unconfTxs[nBlockIndex][bucketIndex]--;
+        }
     }
-    static bool AreSane(const std::vector<double> vecPriority)
+
+    /**
+     * Combine buckets from the highest value down (or from the lowest up if
+     * !fRequireGreater) until each group has enough data, and find the last
+     * group whose share of transactions confirmed within nConfTarget blocks
+     * is on the right side of dSuccessBreakPoint. Transactions still waiting
+     * that long count as failures. Returns the average value of the median
+     * bucket of that group, or -1 if there is not enough data.
+     */
+    double EstimateMedianVal(int nConfTarget, double dSufficientTxVal, double dSuccessBreakPoint,
+                             bool fRequireGreater, unsigned int nBlockHeight) const
     {
-        BOOST_FOREACH(double priority, vecPriority)
-        {
-            if (!AreSane(priority))
-                return false;
+        double nConf = 0; // Decayed transactions confirmed within nConfTarget
+        double totalNum = 0; // Decayed transactions confirmed at all
+        int extraNum = 0; // Transactions waiting for nConfTarget blocks or longer
+        int maxBucketIndex = buckets.size() - 1;
+
+        unsigned int startBucket = fRequireGreater ? maxBucketIndex : 0;
+        int step = fRequireGreater ? -1 : 1;
+
+        // The cur variables are the range being counted, the best variables
+        // the last range that passed.
+        unsigned int curNearBucket = startBucket;
+        unsigned int bestNearBucket = startBucket;
+        unsigned int curFarBucket = startBucket;
+        unsigned int bestFarBucket = startBucket;
+        bool fFoundAnswer = false;
+        unsigned int nBins = unconfTxs.size();
+
+        for (int bucket = startBucket; bucket >= 0 && bucket <= maxBucketIndex; bucket += step) {
+            curFarBucket = bucket;
+            nConf += confAvg[nConfTarget - 1][bucket];
+            totalNum += txCtAvg[bucket];
+            for (unsigned int nConfCt = nConfTarget; nConfCt < GetMaxConfirms() && nConfCt <= nBlockHeight; nConfCt++)
+                extraNum += unconfTxs[(nBlockHeight - nConfCt) % nBins][bucket];
+            extraNum += oldUnconfTxs[bucket];
+
+            // Only confirmed transactions count towards enough data, so every
+            // target looks at the same bucket ranges.
+            if (totalNum >= dSufficientTxVal / (1 - decay)) {
+                double curPct = nConf / (totalNum + extraNum);
+                if (fRequireGreater && curPct < dSuccessBreakPoint)
+                    break;
+                if (!fRequireGreater && curPct > dSuccessBreakPoint)
+                    break;
+
+                fFoundAnswer = true;
+                nConf = 0;
+                totalNum = 0;
+                extraNum = 0;
+                bestNearBucket = curNearBucket;
+                bestFarBucket = curFarBucket;
+                curNearBucket = bucket + step;
+            }
         }
-        return true;
+
+        // Without keeping every transaction there is no true median; report
+        // the average of the bucket holding the median transaction instead.
+        double dMedian = -1;
+        double txSum = 0;
+        unsigned int minBucket = std::min(bestNearBucket, bestFarBucket);
+        unsigned int maxBucket = std::max(bestNearBucket, bestFarBucket);
+        for (unsigned int j = minBucket; j <= maxBucket; j++)
+            txSum += txCtAvg[j];
+        if (fFoundAnswer && txSum != 0) {
+            txSum = txSum / 2;
+            for (unsigned int j = minBucket; j <= maxBucket; j++) {
+                if (txCtAvg[j] < txSum) {
+                    txSum -= txCtAvg[j];
+                } else {
+                    dMedian = avg[j] / txCtAvg[j];
+                    break;
+                }
+            }
+        }
+        return dMedian;
     }
 
     void Write(CAutoFile& fileout) const
     {
-        std::vector<CFeeRate> vecFee = buf2vec(feeSamples);
-        fileout << vecFee;
-        std::vector<double> vecPriority = buf2vec(prioritySamples);
-        fileout << vecPriority;
-    }
-
-    void Read(CAutoFile& filein, const CFeeRate& minRelayFee) {
-        std::vector<CFeeRate> vecFee;
-        filein >> vecFee;
-        if (AreSane(vecFee, minRelayFee))
-            feeSamples.insert(feeSamples.end(), vecFee.begin(), vecFee.end());
-        else
-            throw runtime_error("Corrupt fee value in estimates file.");
-        std::vector<double> vecPriority;
-        filein >> vecPriority;
-        if (AreSane(vecPriority))
-            prioritySamples.insert(prioritySamples.end(), vecPriority.begin(), vecPriority.end());
-        else
-            throw runtime_error("Corrupt priority value in estimates file.");
-        if (feeSamples.size() + prioritySamples.size() > 0)
-            LogPrint("estimatefee", "Read %d fee samples and %d priority samples\n",
-                     feeSamples.size(), prioritySamples.size());
+        fileout << decay;
+        fileout << buckets;
+        fileout << avg;
+        fileout << txCtAvg;
+        fileout << confAvg;
+    }
+
+    void Read(CAutoFile& filein)
+    {
+        // Read into temporaries so a corrupt file leaves the state alone
+        double fileDecay;
+        std::vector<double> fileBuckets, fileAvg, fileTxCtAvg;
+        std::vector<std::vector<double> > fileConfAvg;
+        filein >> fileDecay;
+        if (fileDecay <= 0 || fileDecay >= 1)
+            throw runtime_error("Corrupt estimates file. Decay must be between 0 and 1 (non-inclusive)");
+        filein >> fileBuckets;
+        unsigned int nBuckets = fileBuckets.size();
+        if (nBuckets <= 1 || nBuckets > 1000)
+            throw runtime_error("Corrupt estimates file. Must have between 2 and 1000 fee/pri buckets");
+        for (unsigned int i = 1; i < nBuckets; i++)
+            if (!(fileBuckets[i - 1] < fileBuckets[i]))
+                throw runtime_error("Corrupt estimates file. Bucket boundaries must increase");
+        filein >> fileAvg;
+        if (fileAvg.size() != nBuckets)
+            throw runtime_error("Corrupt estimates file. Mismatch in fee/pri average bucket count");
+        filein >> fileTxCtAvg;
+        if (fileTxCtAvg.size() != nBuckets)
+            throw runtime_error("Corrupt estimates file. Mismatch in tx count bucket count");
+        filein >> fileConfAvg;
+        unsigned int nMaxConfirms = fileConfAvg.size();
+        if (nMaxConfirms <= 0 || nMaxConfirms > 6 * 24 * 7)
+            throw runtime_error("Corrupt estimates file. Must maintain estimates for between 1 and 1008 (one week) confirms");
+        for (unsigned int i = 0; i < nMaxConfirms; i++)
+            if (fileConfAvg[i].size() != nBuckets)
+                throw runtime_error("Corrupt estimates file. Mismatch in fee/pri conf average bucket count");
+
+        decay = fileDecay;
+        buckets = fileBuckets;
+        avg = fileAvg;
+        txCtAvg = fileTxCtAvg;
+        confAvg = fileConfAvg;
+        Resize();
+
+        LogPrint("estimatefee", "Reading estimates: %u %s buckets counting confirms up to %u blocks\n",
+                 nBuckets, dataTypeString, nMaxConfirms);
     }
 };
 
+/**
+ * Estimates the fee rate or priority a transaction needs to confirm within
+ * a number of blocks. Every transaction entering the pool is counted in the
+ * bucket of its fee rate, or of its priority if it looks like it relies on
+ * that, and moves to the confirmed counts when a block includes it. The
+ * answers are worked out once per block, so queries are lookups.
+ */
 class CMinerPolicyEstimator
 {
 private:
-    /**
-     * Records observed averages transactions that confirmed within one block, two blocks,
-     * three blocks etc.
-     */
-    std::vector<CBlockAverage> history;
-    std::vector<CFeeRate> sortedFeeSamples;
-    std::vector<double> sortedPrioritySamples;
-
-    int nBestSeenHeight;
+    //! Where a transaction in the pool is counted
+    class CTxStatsInfo
+    {
+    public:
+        CConfirmStats* stats;
+        unsigned int blockHeight;
+        unsigned int bucketIndex;
+        CTxStatsInfo() : stats(NULL), blockHeight(0), bucketIndex(0) { }
+    };
+
+    CFeeRate minTrackedFee;
+    double minTrackedPriority;
+    unsigned int nBestSeenHeight;
+    std::map<uint256, CTxStatsInfo> mapMemPoolTxs;
+    CConfirmStats feeStats;
+    CConfirmStats priStats;
+
+    //! Answers for 1 up to the max confirms blocks, refreshed every block
+    std::vector<CFeeRate> vFeeEstimates;
+    std::vector<double> vPriorityEstimates;
+
+    bool IsFeeDataPoint(const CFeeRate& feeRate, double dPriority) const
+    {
+        return feeRate >= minTrackedFee && dPriority < minTrackedPriority;
+    }
+    bool IsPriDataPoint(const CFeeRate& feeRate, double dPriority) const
+    {
+        return dPriority >= minTrackedPriority && feeRate < minTrackedFee;
+    }
 
-    /**
-     * nBlocksAgo is 0 based, i.e. transactions that confirmed in the highest seen block are
-     * nBlocksAgo == 0, transactions in the block before that are nBlocksAgo == 1 etc.
-     */
-    void seenTxConfirm(const CFeeRate& feeRate, const CFeeRate& minRelayFee, double dPriority, int nBlocksAgo)
+    void UpdateEstimates()
     {
-        // Last entry records "everything else".
-        int nBlocksTruncated = min(nBlocksAgo, (int) history.size() - 1);
-        assert(nBlocksTruncated >= 0);
-
-        // We need to guess why the transaction was included in a block-- either
-        // because it is high-priority or because it has sufficient fees.
-        bool sufficientFee = (feeRate > minRelayFee);
-        bool sufficientPriority = AllowFree(dPriority);
-        const char* assignedTo = "unassigned";
-        if (sufficientFee && !sufficientPriority && CBlockAverage::AreSane(feeRate, minRelayFee))
-        {
-            history[nBlocksTruncated].RecordFee(feeRate);
-            assignedTo = "fee";
-        }
-        else if (sufficientPriority && !sufficientFee && CBlockAverage::AreSane(dPriority))
-        {
-            history[nBlocksTruncated].RecordPriority(dPriority);
-            assignedTo = "priority";
+        unsigned int nMaxConfirms = feeStats.GetMaxConfirms();
+        vFeeEstimates.assign(nMaxConfirms, CFeeRate(0));
+        vPriorityEstimates.assign(priStats.GetMaxConfirms(), -1);
+        for (unsigned int i = 0; i < vFeeEstimates.size(); i++) {
+            double dFee = feeStats.EstimateMedianVal(i + 1, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+            if (dFee >= 0)
+                vFeeEstimates[i] = CFeeRate((CAmount)dFee);
         }
-        else
-        {
-            // Neither or both fee and priority sufficient to get confirmed:
-            // don't know why they got confirmed.
+        for (unsigned int i = 0; i < vPriorityEstimates.size(); i++)
+            vPriorityEstimates[i] = priStats.EstimateMedianVal(i + 1, SUFFICIENT_PRITXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    }
+
+    void ProcessBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry& entry)
+    {
+        // Only transactions seen entering the pool tell how long they took
+        if (!RemoveTx(entry.GetTx().GetHash()))
+            return;
+
+        int blocksToConfirm = nBlockHeight - entry.GetHeight();
+        if (blocksToConfirm <= 0) {
+            // Re-org made us lose height, this should only happen if we happen
+            // to re-org on a difficulty transition point: very rare!
+            LogPrint("estimatefee", "Blockpolicy error Transaction had negative blocksToConfirm\n");
+            return;
         }
-        LogPrint("estimatefee", "Seen TX confirm: %s : %s fee/%g priority, took %d blocks\n",
-                 assignedTo, feeRate.ToString(), dPriority, nBlocksAgo);
+
+        CFeeRate feeRate(entry.GetFee(), entry.GetTxSize());
+        double dPriority = entry.GetPriority(entry.GetHeight()); // Want priority when it went IN
+        if (IsFeeDataPoint(feeRate, dPriority))
+            feeStats.Record(blocksToConfirm, (double)feeRate.GetFeePerK());
+        else if (IsPriDataPoint(feeRate, dPriority))
+            priStats.Record(blocksToConfirm, dPriority);
     }
 
 public:
-    CMinerPolicyEstimator(int nEntries) : nBestSeenHeight(0)
+    CMinerPolicyEstimator(int nEntries, const CFeeRate& minRelayFee) : nBestSeenHeight(0)
     {
-        history.resize(nEntries);
+        minTrackedFee = std::max(minRelayFee, CFeeRate(1000));
+        std::vector<double> vFeeList;
+        for (double dBoundary = minTrackedFee.GetFeePerK(); dBoundary <= minTrackedFee.GetFeePerK() * 10000.0; dBoundary *= FEE_SPACING)
+            vFeeList.push_back(dBoundary);
+        vFeeList.push_back((double)MAX_MONEY);
+        feeStats.Initialize(vFeeList, nEntries, FEE_ESTIMATE_DECAY, "FeeRate");
+
+        minTrackedPriority = AllowFreeThreshold();
+        std::vector<double> vPriList;
+        for (double dBoundary = minTrackedPriority; dBoundary <= minTrackedPriority * 1e8; dBoundary *= PRI_SPACING)
+            vPriList.push_back(dBoundary);
+        vPriList.push_back(1e9 * (double)MAX_MONEY);
+        priStats.Initialize(vPriList, nEntries, FEE_ESTIMATE_DECAY, "Priority");
+
+        UpdateEstimates();
+    }
+
+    /** Start counting a transaction that entered the pool */
+    void ProcessTransaction(const CTxMemPoolEntry& entry, bool fCurrentEstimate)
+    {
+        unsigned int txHeight = entry.GetHeight();
+        uint256 hash = entry.GetTx().GetHash();
+        if (mapMemPoolTxs.count(hash))
+            return;
+        // A transaction only says something about the current fee market
+        // when we are caught up with the chain.
+        if (txHeight < nBestSeenHeight || !fCurrentEstimate)
+            return;
+
+        // The priority at entry stands in for the priority it confirms with
+        double dPriority = entry.GetPriority(txHeight);
+        CFeeRate feeRate(entry.GetFee(), entry.GetTxSize());
+        CTxStatsInfo& info = mapMemPoolTxs[hash];
+        info.blockHeight = txHeight;
+        if (IsFeeDataPoint(feeRate, dPriority)) {
+            info.stats = &feeStats;
+            info.bucketIndex = feeStats.NewTx(txHeight, (double)feeRate.GetFeePerK());
+        } else if (IsPriDataPoint(feeRate, dPriority)) {
+            info.stats = &priStats;
+            info.bucketIndex = priStats.NewTx(txHeight, dPriority);
+        } else {
+            LogPrint("estimatefee", "not adding tx %s to estimates\n", hash.ToString());
+            mapMemPoolTxs.erase(hash);
+        }
     }
 
-    void seenBlock(const std::vector<CTxMemPoolEntry>& entries, int nBlockHeight, const CFeeRate minRelayFee)
+    /** Stop counting a transaction, returning whether it was counted */
+    bool RemoveTx(const uint256& hash)
+    {
+        std::map<uint256, CTxStatsInfo>::iterator pos = mapMemPoolTxs.find(hash);
+        if (pos == mapMemPoolTxs.end())
+            return false;
+        pos->second.stats->RemoveTx(pos->second.blockHeight, nBestSeenHeight, pos->second.bucketIndex);
+        mapMemPoolTxs.erase(pos);
+        return true;
+    }
+
+    void ProcessBlock(unsigned int nBlockHeight, const std::vector<CTxMemPoolEntry>& entries, bool fCurrentEstimate)
     {
         if (nBlockHeight <= nBestSeenHeight)
         {
@@ -215,165 +475,76 @@ public:
         }
         nBestSeenHeight = nBlockHeight;
 
-        // Fill up the history buckets based on how long transactions took
-        // to confirm.
-        std::vector<std::vector<const CTxMemPoolEntry*> > entriesByConfirmations;
-        entriesByConfirmations.resize(history.size());
-        BOOST_FOREACH(const CTxMemPoolEntry& entry, entries)
-        {
-            // How many blocks did it take for miners to include this transaction?
-            int delta = nBlockHeight - entry.GetHeight();
-            if (delta <= 0)
-            {
-                // Re-org made us lose height, this should only happen if we happen
-                // to re-org on a difficulty transition point: very rare!
-                continue;
-            }
-            if ((delta-1) >= (int)history.size())
-                delta = history.size(); // Last bucket is catch-all
-            entriesByConfirmations.at(delta-1).push_back(&entry);
-        }
-        for (size_t i = 0; i < entriesByConfirmations.size(); i++)
-        {
-            std::vector<const CTxMemPoolEntry*> &e = entriesByConfirmations.at(i);
-            // Insert at most 10 random entries per bucket, otherwise a single block
-            // can dominate an estimate:
-            if (e.size() > 10) {
-                std::random_shuffle(e.begin(), e.end());
-                e.resize(10);
-            }
-            BOOST_FOREACH(const CTxMemPoolEntry* entry, e)
-            {
-                // Fees are stored and reported as BTC-per-kb:
-                CFeeRate feeRate(entry->GetFee(), entry->GetTxSize());
-                double dPriority = entry->GetPriority(entry->GetHeight()); // Want priority when it went IN
-                seenTxConfirm(feeRate, minRelayFee, dPriority, i);
-            }
-        }
+        // Only the latest blocks say anything about the current fee market
+        if (!fCurrentEstimate)
+            return;
 
-        //After new samples are added, we have to clear the sorted lists,
-        //so they'll be resorted the next time someone asks for an estimate
-        sortedFeeSamples.clear();
-        sortedPrioritySamples.clear();
+        feeStats.ClearCurrent(nBlockHeight);
+        priStats.ClearCurrent(nBlockHeight);
+        BOOST_FOREACH(const CTxMemPoolEntry& entry, entries)
+            ProcessBlockTx(nBlockHeight, entry);
+        feeStats.UpdateMovingAverages();
+        priStats.UpdateMovingAverages();
+        UpdateEstimates();
 
-        for (size_t i = 0; i < history.size(); i++) {
-            if (history[i].FeeSamples() + history[i].PrioritySamples() > 0)
-                LogPrint("estimatefee", "estimates: for confirming within %d blocks based on %d/%d samples, fee=%s, prio=%g\n", 
-                         i,
-                         history[i].FeeSamples(), history[i].PrioritySamples(),
-                         estimateFee(i+1).ToString(), estimatePriority(i+1));
-        }
+        LogPrint("estimatefee", "Blockpolicy after updating estimates for %u confirmed entries, new mempool map size %u\n",
+                 entries.size(), mapMemPoolTxs.size());
     }
 
     /**
      * Can return CFeeRate(0) if we don't have any data for that many blocks back. nBlocksToConfirm is 1 based.
      */
-    CFeeRate estimateFee(int nBlocksToConfirm)
+    CFeeRate estimateFee(int nBlocksToConfirm) const
     {
-        nBlocksToConfirm--;
-
-        if (nBlocksToConfirm < 0 || nBlocksToConfirm >= (int)history.size())
-            return CFeeRate(0);
-
-        if (sortedFeeSamples.size() == 0)
-        {
-            for (size_t i = 0; i < history.size(); i++)
-                history.at(i).GetFeeSamples(sortedFeeSamples);
-            std::sort(sortedFeeSamples.begin(), sortedFeeSamples.end(),
-                      std::greater<CFeeRate>());
-        }
-        if (sortedFeeSamples.size() < 11)
-        {
-            // Eleven is Gavin's Favorite Number
-            // ... but we also take a maximum of 10 samples per block so eleven means
-            // we're getting samples from at least two different blocks
+        if (nBlocksToConfirm <= 0 || nBlocksToConfirm > (int)vFeeEstimates.size())
             return CFeeRate(0);
-        }
-
-        int nBucketSize = history.at(nBlocksToConfirm).FeeSamples();
-
-        // Estimates should not increase as number of confirmations goes up,
-        // but the estimates are noisy because confirmations happen discretely
-        // in blocks. To smooth out the estimates, use all samples in the history
-        // and use the nth highest where n is (number of samples in previous bucket +
-        // half the samples in nBlocksToConfirm bucket):
-        size_t nPrevSize = 0;
-        for (int i = 0; i < nBlocksToConfirm; i++)
-            nPrevSize += history.at(i).FeeSamples();
-        size_t index = min(nPrevSize + nBucketSize/2, sortedFeeSamples.size()-1);
-        return sortedFeeSamples[index];
+        return vFeeEstimates[nBlocksToConfirm - 1];
     }
-    double estimatePriority(int nBlocksToConfirm)
-    {
-        nBlocksToConfirm--;
 
-        if (nBlocksToConfirm < 0 || nBlocksToConfirm >= (int)history.size())
+    double estimatePriority(int nBlocksToConfirm) const
+    {
+        if (nBlocksToConfirm <= 0 || nBlocksToConfirm > (int)vPriorityEstimates.size())
             return -1;
-
-        if (sortedPrioritySamples.size() == 0)
-        {
-            for (size_t i = 0; i < history.size(); i++)
-                history.at(i).GetPrioritySamples(sortedPrioritySamples);
-            std::sort(sortedPrioritySamples.begin(), sortedPrioritySamples.end(),
-                      std::greater<double>());
-        }
-        if (sortedPrioritySamples.size() < 11)
-            return -1.0;
-
-        int nBucketSize = history.at(nBlocksToConfirm).PrioritySamples();
-
-        // Estimates should not increase as number of confirmations needed goes up,
-        // but the estimates are noisy because confirmations happen discretely
-        // in blocks. To smooth out the estimates, use all samples in the history
-        // and use the nth highest where n is (number of samples in previous buckets +
-        // half the samples in nBlocksToConfirm bucket).
-        size_t nPrevSize = 0;
-        for (int i = 0; i < nBlocksToConfirm; i++)
-            nPrevSize += history.at(i).PrioritySamples();
-        size_t index = min(nPrevSize + nBucketSize/2, sortedPrioritySamples.size()-1);
-        return sortedPrioritySamples[index];
+        return vPriorityEstimates[nBlocksToConfirm - 1];
     }
 
     void Write(CAutoFile& fileout) const
     {
         fileout << nBestSeenHeight;
-        fileout << history.size();
-        BOOST_FOREACH(const CBlockAverage& entry, history)
-        {
-            entry.Write(fileout);
-        }
+        feeStats.Write(fileout);
+        priStats.Write(fileout);
     }
 
-    void Read(CAutoFile& filein, const CFeeRate& minRelayFee)
+    void Read(CAutoFile& filein)
     {
-        int nFileBestSeenHeight;
+        unsigned int nFileBestSeenHeight;
         filein >> nFileBestSeenHeight;
-        size_t numEntries;
-        filein >> numEntries;
-        if (numEntries <= 0 || numEntries > 10000)
-            throw runtime_error("Corrupt estimates file. Must have between 1 and 10k entries.");
-
-        std::vector<CBlockAverage> fileHistory;
-        
-        for (size_t i = 0; i < numEntries; i++)
-        {
-            CBlockAverage entry;
-            entry.Read(filein, minRelayFee);
-            fileHistory.push_back(entry);
-        }
-
-        // Now that we've processed the entire fee estimate data file and not
-        // thrown any errors, we can copy it to our history
+        CConfirmStats fileFeeStats = feeStats;
+        CConfirmStats filePriStats = priStats;
+        fileFeeStats.Read(filein);
+        filePriStats.Read(filein);
+
+        // Transactions already being counted may sit in buckets that no
+        // longer exist; start them over.
+        mapMemPoolTxs.clear();
         nBestSeenHeight = nFileBestSeenHeight;
-        history = fileHistory;
-        assert(history.size() > 0);
+        feeStats = fileFeeStats;
+        priStats = filePriStats;
+        UpdateEstimates();
     }
 };
 
-
 CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) :
     nTransactionsUpdated(0),
-    minRelayFee(_minRelayFee)
+    minRelayFee(_minRelayFee),
+    totalTxSize(0),
+    cachedInnerUsage(0),
+    nLastSequence(0),
+    nTransactionsReordered(0),
+    nPriorityHeight(0),
+    nLastRollingFeeUpdate(GetTime()),
+    fBlockSinceLastRollingFeeBump(false),
+    dRollingMinimumFeeRate(0)
 {
     // Sanity checks off by default for performance, because otherwise
     // accepting transactions becomes O(N^2) where N is the number
@@ -385,7 +556,7 @@ CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) :
     // to wait a day or two to save a fraction of a penny in fees.
     // Confirmation times for very-low-fee transactions that take more
     // than an hour or three to confirm are highly variable.
-    minerPolicyEstimator = new CMinerPolicyEstimator(25);
+    minerPolicyEstimator = new CMinerPolicyEstimator(25, minRelayFee);
 }
 
 CTxMemPool::~CTxMemPool()
@@ -418,8 +589,214 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
+uint64_t CTxMemPool::GetLastSequence() const
+{
+    LOCK(cs);
+    return nLastSequence;
+}
+
+unsigned int CTxMemPool::GetTransactionsReordered() const
+{
+    LOCK(cs);
+    return nTransactionsReordered;
+}
+
+void CTxMemPool::SetPriorityHeight(unsigned int nHeight)
+{
+    LOCK(cs);
+    if (nHeight == nPriorityHeight)
+        return;
+    nPriorityHeight = nHeight;
+    setByPriority.clear();
+    for (std::map<uint256, CTxMemPoolIndexEntry>::iterator it = mapIndex.begin(); it != mapIndex.end(); ++it) {
+        it->second.dCurrentPriority = agedPriority(mapTx[it->first], it->second.dPriority);
+        setByPriority.insert(std::make_pair(it->second.dCurrentPriority, it->first));
+    }
+}
+
+double CTxMemPool::agedPriority(const CTxMemPoolEntry& entry, double dPriority) const
+{
+    if (nPriorityHeight <= entry.GetHeight())
+        return dPriority;
+    return dPriority + entry.GetPriority(nPriorityHeight) - entry.GetPriority(entry.GetHeight());
+}
+
+void CTxMemPool::addIndexKeys(const uint256& hash)
+{
+    const CTxMemPoolEntry& entry = mapTx[hash];
+    CTxMemPoolIndexEntry& index = mapIndex[hash];
+    double dPriorityDelta = 0;
+    CAmount nFeeDelta = 0;
+    ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
+    index.nModFee = entry.GetFee() + nFeeDelta;
+    index.feeRate = CFeeRate(index.nModFee, entry.GetTxSize());
+    index.dPriority = entry.GetPriority(entry.GetHeight()) + dPriorityDelta;
+    index.dCurrentPriority = agedPriority(entry, index.dPriority);
+    // To a miner a transaction is only worth as much as the ancestors it
+    // needs, and evicting it also evicts the descendants that pay for it.
+    index.ancestorScore = std::min(index.feeRate, CFeeRate(index.nModFeesWithAncestors, (size_t)index.nSizeWithAncestors));
+    index.descendantScore = std::max(index.feeRate, CFeeRate(index.nModFeesWithDescendants, (size_t)index.nSizeWithDescendants));
+    setByPriority.insert(std::make_pair(index.dCurrentPriority, hash));
+    setByAncestorScore.insert(std::make_pair(index.ancestorScore, hash));
+    setByDescendantScore.insert(std::make_pair(index.descendantScore, hash));
+}
+
+void CTxMemPool::removeIndexKeys(const uint256& hash)
+{
+    const CTxMemPoolIndexEntry& index = mapIndex[hash];
+    setByPriority.erase(std::make_pair(index.dCurrentPriority, hash));
+    setByAncestorScore.erase(std::make_pair(index.ancestorScore, hash));
+    setByDescendantScore.erase(std::make_pair(index.descendantScore, hash));
+}
+
+void CTxMemPool::updateAncestorState(const uint256& hash, int64_t nCount, int64_t nSize, CAmount nModFee)
+{
+    removeIndexKeys(hash);
+    CTxMemPoolIndexEntry& index = mapIndex[hash];
+    index.nCountWithAncestors += nCount;
+    index.nSizeWithAncestors += nSize;
+    index.nModFeesWithAncestors += nModFee;
+    addIndexKeys(hash);
+}
+
+void CTxMemPool::updateDescendantState(const uint256& hash, int64_t nCount, int64_t nSize, CAmount nModFee)
+{
+    removeIndexKeys(hash);
+    CTxMemPoolIndexEntry& index = mapIndex[hash];
+    index.nCountWithDescendants += nCount;
+    index.nSizeWithDescendants += nSize;
+    index.nModFeesWithDescendants += nModFee;
+    addIndexKeys(hash);
+}
+
+void CTxMemPool::recalculateAncestorState(const uint256& hash)
+{
+    std::set<uint256> setAncestors;
+    CalculateAncestors(hash, setAncestors);
+    removeIndexKeys(hash);
+    CTxMemPoolIndexEntry& index = mapIndex[hash];
+    index.nCountWithAncestors = 1;
+    index.nSizeWithAncestors = mapTx[hash].GetTxSize();
+    index.nModFeesWithAncestors = index.nModFee;
+    BOOST_FOREACH(const uint256& hashAncestor, setAncestors) {
+        index.nCountWithAncestors++;
+        index.nSizeWithAncestors += mapTx[hashAncestor].GetTxSize();
+        index.nModFeesWithAncestors += mapIndex[hashAncestor].nModFee;
+    }
+    addIndexKeys(hash);
+}
+
+void CTxMemPool::recalculateDescendantState(const uint256& hash)
+{
+    std::set<uint256> setDescendants;
+    CalculateDescendants(hash, setDescendants);
+    removeIndexKeys(hash);
+    CTxMemPoolIndexEntry& index = mapIndex[hash];
+    index.nCountWithDescendants = 1;
+    index.nSizeWithDescendants = mapTx[hash].GetTxSize();
+    index.nModFeesWithDescendants = index.nModFee;
+    BOOST_FOREACH(const uint256& hashDescendant, setDescendants) {
+        index.nCountWithDescendants++;
+        index.nSizeWithDescendants += mapTx[hashDescendant].GetTxSize();
+        index.nModFeesWithDescendants += mapIndex[hashDescendant].nModFee;
+    }
+    addIndexKeys(hash);
+}
+
+void CTxMemPool::CalculateAncestors(const uint256& hash, std::set<uint256>& setAncestors) const
+{
+    LOCK(cs);
+    const std::set<uint256>& setParents = mapIndex.find(hash)->second.setParents;
+    std::vector<uint256> vStack(setParents.begin(), setParents.end());
+    while (!vStack.empty()) {
+        const uint256 hashAncestor = vStack.back();
+        vStack.pop_back();
+        if (!setAncestors.insert(hashAncestor).second)
+            continue;
+        const std::set<uint256>& setNext = mapIndex.find(hashAncestor)->second.setParents;
+        vStack.insert(vStack.end(), setNext.begin(), setNext.end());
+    }
+}
+
+void CTxMemPool::CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const
+{
+    LOCK(cs);
+    const std::set<uint256>& setChildren = mapIndex.find(hash)->second.setChildren;
+    std::vector<uint256> vStack(setChildren.begin(), setChildren.end());
+    while (!vStack.empty()) {
+        const uint256 hashDescendant = vStack.back();
+        vStack.pop_back();
+        if (!setDescendants.insert(hashDescendant).second)
+            continue;
+        const std::set<uint256>& setNext = mapIndex.find(hashDescendant)->second.setChildren;
+        vStack.insert(vStack.end(), setNext.begin(), setNext.end());
+    }
+}
+
+bool CTxMemPool::CalculateMemPoolAncestors(const CTransaction& tx, size_t nSize, std::set<uint256>& setAncestors,
+                                           uint64_t nLimitAncestorCount, uint64_t nLimitAncestorSize,
+                                           uint64_t nLimitDescendantCount, uint64_t nLimitDescendantSize,
+                                           std::string& errString) const
+{
+    LOCK(cs);
+    std::vector<uint256> vStack;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+        if (mapTx.count(txin.prevout.hash))
+            vStack.push_back(txin.prevout.hash);
+    }
+
+    uint64_t nTotalSize = nSize;
+    while (!vStack.empty()) {
+        const uint256 hashAncestor = vStack.back();
+        vStack.pop_back();
+        if (!setAncestors.insert(hashAncestor).second)
+            continue;
+
+        const CTxMemPoolIndexEntry& index = mapIndex.find(hashAncestor)->second;
+        if ((uint64_t)index.nCountWithDescendants + 1 > nLimitDescendantCount) {
+            errString = strprintf("too many descendants for tx %s [limit: %u]", hashAncestor.ToString(), nLimitDescendantCount);
+            return false;
+        }
+        if ((uint64_t)index.nSizeWithDescendants + nSize > nLimitDescendantSize) {
+            errString = strprintf("exceeds descendant size limit for tx %s [limit: %u]", hashAncestor.ToString(), nLimitDescendantSize);
+            return false;
+        }
+        nTotalSize += mapTx.find(hashAncestor)->second.GetTxSize();
+        if (nTotalSize > nLimitAncestorSize) {
+            errString = strprintf("exceeds ancestor size limit [limit: %u]", nLimitAncestorSize);
+            return false;
+        }
+        if (setAncestors.size() + 1 > nLimitAncestorCount) {
+            errString = strprintf("too many unconfirmed ancestors [limit: %u]", nLimitAncestorCount);
+            return false;
+        }
+        vStack.insert(vStack.end(), index.setParents.begin(), index.setParents.end());
+    }
+    return true;
+}
+
+void CTxMemPool::addLink(const uint256& hashParent, const uint256& hashChild)
+{
+    std::set<uint256>& setChildren = mapIndex[hashParent].setChildren;
+    std::set<uint256>& setParents = mapIndex[hashChild].setParents;
+    if (setChildren.insert(hashChild).second)
+        cachedInnerUsage += memusage::IncrementalDynamicUsage(setChildren);
+    if (setParents.insert(hashParent).second)
+        cachedInnerUsage += memusage::IncrementalDynamicUsage(setParents);
+}
 
-bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
+void CTxMemPool::removeLink(const uint256& hashParent, const uint256& hashChild)
+{
+    std::set<uint256>& setChildren = mapIndex[hashParent].setChildren;
+    std::set<uint256>& setParents = mapIndex[hashChild].setParents;
+    if (setChildren.erase(hashChild))
+        cachedInnerUsage -= memusage::IncrementalDynamicUsage(setChildren);
+    if (setParents.erase(hashParent))
+        cachedInnerUsage -= memusage::IncrementalDynamicUsage(setParents);
+}
+
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
@@ -432,19 +809,79 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
         nTransactionsUpdated++;
         totalTxSize += entry.GetTxSize();
+        cachedInnerUsage += entry.DynamicMemoryUsage();
+
+        CTxMemPoolIndexEntry& index = mapIndex[hash];
+        index.nSequence = ++nLastSequence;
+        mapSequence[index.nSequence] = hash;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            if (mapTx.count(txin.prevout.hash))
+                addLink(txin.prevout.hash, hash);
+        }
+        // Children may already be here if this transaction is coming back
+        // from a disconnected block.
+        std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hash, 0));
+        for (; it != mapNextTx.end() && it->first.hash == hash; ++it) {
+            addLink(hash, it->second.ptx->GetHash());
+        }
+
+        minerPolicyEstimator->ProcessTransaction(entry, fCurrentEstimate);
+
+        // Package totals of the new transaction
+        double dPriorityDelta = 0;
+        CAmount nFeeDelta = 0;
+        ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
+        index.nModFee = entry.GetFee() + nFeeDelta;
+        int64_t nSize = entry.GetTxSize();
+        std::set<uint256> setAncestors, setDescendants;
+        CalculateAncestors(hash, setAncestors);
+        CalculateDescendants(hash, setDescendants);
+        index.nCountWithAncestors = 1;
+        index.nSizeWithAncestors = nSize;
+        index.nModFeesWithAncestors = index.nModFee;
+        BOOST_FOREACH(const uint256& hashAncestor, setAncestors) {
+            index.nCountWithAncestors++;
+            index.nSizeWithAncestors += mapTx[hashAncestor].GetTxSize();
+            index.nModFeesWithAncestors += mapIndex[hashAncestor].nModFee;
+        }
+        index.nCountWithDescendants = 1;
+        index.nSizeWithDescendants = nSize;
+        index.nModFeesWithDescendants = index.nModFee;
+        BOOST_FOREACH(const uint256& hashDescendant, setDescendants) {
+            index.nCountWithDescendants++;
+            index.nSizeWithDescendants += mapTx[hashDescendant].GetTxSize();
+            index.nModFeesWithDescendants += mapIndex[hashDescendant].nModFee;
+        }
+        addIndexKeys(hash);
+
+        // ... and of the transactions around it
+        if (setDescendants.empty()) {
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+                updateDescendantState(hashAncestor, 1, nSize, index.nModFee);
+        } else {
+            // Slotting in between existing transactions after a reorg can
+            // join packages together, so count those from scratch.
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+                recalculateDescendantState(hashAncestor);
+            BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+                recalculateAncestorState(hashDescendant);
+        }
     }
     return true;
 }
 
 
-void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& removed, bool fRecursive)
+void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransactionRef>& removed, bool fRecursive)
 {
     // Remove transaction from memory pool
     {
         LOCK(cs);
-        std::deque<uint256> txToRemove;
-        txToRemove.push_back(origTx.GetHash());
-        if (fRecursive && !mapTx.count(origTx.GetHash())) {
+        std::vector<uint256> vRemove;
+        std::set<uint256> setRemove;
+        if (mapTx.count(origTx.GetHash())) {
+            vRemove.push_back(origTx.GetHash());
+            setRemove.insert(origTx.GetHash());
+        } else if (fRecursive) {
             // If recursively removing but origTx isn't in the mempool
             // be sure to remove any children that are in the pool. This can
             // happen during chain re-orgs if origTx isn't re-accepted into
@@ -453,32 +890,82 @@ void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& rem
                 std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
                 if (it == mapNextTx.end())
                     continue;
-                txToRemove.push_back(it->second.ptx->GetHash());
+                if (setRemove.insert(it->second.ptx->GetHash()).second)
+                    vRemove.push_back(it->second.ptx->GetHash());
             }
         }
-        while (!txToRemove.empty())
-        {
-            uint256 hash = txToRemove.front();
-            txToRemove.pop_front();
-            if (!mapTx.count(hash))
-                continue;
-            const CTransaction& tx = mapTx[hash].GetTx();
-            if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it == mapNextTx.end())
-                        continue;
-                    txToRemove.push_back(it->second.ptx->GetHash());
-                }
+        removeStaged(vRemove, setRemove, removed, fRecursive);
+    }
+}
+
+void CTxMemPool::removeStaged(std::vector<uint256>& vRemove, std::set<uint256>& setRemove,
+                              std::list<CTransactionRef>& removed, bool fRecursive)
+{
+    AssertLockHeld(cs);
+    if (fRecursive) {
+        for (unsigned int i = 0; i < vRemove.size(); i++) {
+            const uint256 hash = vRemove[i];
+            BOOST_FOREACH(const uint256& hashChild, mapIndex[hash].setChildren) {
+                if (setRemove.insert(hashChild).second)
+                    vRemove.push_back(hashChild);
             }
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
+        }
+    }
 
-            removed.push_back(tx);
-            totalTxSize -= mapTx[hash].GetTxSize();
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
+    // Take the removed transactions out of the package totals of the
+    // ones that stay, while the links are still there to find them.
+    std::set<uint256> setRecalculate;
+    BOOST_FOREACH(const uint256& hash, vRemove)
+    {
+        int64_t nSize = mapTx[hash].GetTxSize();
+        CAmount nModFee = mapIndex[hash].nModFee;
+        std::set<uint256> setAncestors;
+        CalculateAncestors(hash, setAncestors);
+        BOOST_FOREACH(const uint256& hashAncestor, setAncestors) {
+            if (!setRemove.count(hashAncestor))
+                updateDescendantState(hashAncestor, -1, -nSize, -nModFee);
         }
+        if (!fRecursive) {
+            std::set<uint256> setDescendants;
+            CalculateDescendants(hash, setDescendants);
+            BOOST_FOREACH(const uint256& hashDescendant, setDescendants) {
+                // Confirmed parents go first, so this is normally exact;
+                // otherwise the descendants lose more ancestors than this one.
+                if (setAncestors.empty())
+                    updateAncestorState(hashDescendant, -1, -nSize, -nModFee);
+                else
+                    setRecalculate.insert(hashDescendant);
+            }
+        }
+    }
+
+    BOOST_FOREACH(const uint256& hash, vRemove)
+    {
+        const CTransaction& tx = mapTx[hash].GetTx();
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            mapNextTx.erase(txin.prevout);
+
+        removeIndexKeys(hash);
+        const CTxMemPoolIndexEntry& index = mapIndex[hash];
+        while (!index.setParents.empty())
+            removeLink(*index.setParents.begin(), hash);
+        while (!index.setChildren.empty())
+            removeLink(hash, *index.setChildren.begin());
+        mapSequence.erase(index.nSequence);
+        mapIndex.erase(hash);
+        minerPolicyEstimator->RemoveTx(hash);
+
+        removed.push_back(mapTx[hash].GetSharedTx());
+        totalTxSize -= mapTx[hash].GetTxSize();
+        cachedInnerUsage -= mapTx[hash].DynamicMemoryUsage();
+        mapTx.erase(hash);
+        nTransactionsUpdated++;
+        nTransactionsReordered++;
+    }
+
+    BOOST_FOREACH(const uint256& hash, setRecalculate) {
+        if (mapIndex.count(hash))
+            recalculateAncestorState(hash);
     }
 }
 
@@ -486,7 +973,7 @@ void CTxMemPool::removeCoinbaseSpends(const CCoinsViewCache *pcoins, unsigned in
 {
     // Remove transactions spending a coinbase which are now immature
     LOCK(cs);
-    list<CTransaction> transactionsToRemove;
+    list<CTransactionRef> transactionsToRemove;
     for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         const CTransaction& tx = it->second.GetTx();
         BOOST_FOREACH(const CTxIn& txin, tx.vin) {
@@ -496,21 +983,20 @@ void CTxMemPool::removeCoinbaseSpends(const CCoinsViewCache *pcoins, unsigned in
             const CCoins *coins = pcoins->AccessCoins(txin.prevout.hash);
             if (fSanityCheck) assert(coins);
             if (!coins || (coins->IsCoinBase() && nMemPoolHeight - coins->nHeight < BREADCRUMBBASE_MATURITY)) {
-                transactionsToRemove.push_back(tx);
+                transactionsToRemove.push_back(it->second.GetSharedTx());
                 break;
             }
         }
     }
-    BOOST_FOREACH(const CTransaction& tx, transactionsToRemove) {
-        list<CTransaction> removed;
-        remove(tx, removed, true);
+    BOOST_FOREACH(const CTransactionRef& ptx, transactionsToRemove) {
+        list<CTransactionRef> removed;
+        remove(*ptx, removed, true);
     }
 }
 
-void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed)
+void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransactionRef>& removed)
 {
     // Remove transactions which depend on inputs of tx, recursively
-    list<CTransaction> result;
     LOCK(cs);
     BOOST_FOREACH(const CTxIn &txin, tx.vin) {
         std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(txin.prevout);
@@ -528,7 +1014,7 @@ void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>
  * Called when a block is connected. Removes from mempool and updates the miner fee estimator.
  */
 void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
-                                std::list<CTransaction>& conflicts)
+                                std::list<CTransactionRef>& conflicts, bool fCurrentEstimate)
 {
     LOCK(cs);
     std::vector<CTxMemPoolEntry> entries;
@@ -538,14 +1024,34 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
         if (mapTx.count(hash))
             entries.push_back(mapTx[hash]);
     }
-    minerPolicyEstimator->seenBlock(entries, nBlockHeight, minRelayFee);
+    minerPolicyEstimator->ProcessBlock(nBlockHeight, entries, fCurrentEstimate);
     BOOST_FOREACH(const CTransaction& tx, vtx)
     {
-        std::list<CTransaction> dummy;
+        std::list<CTransactionRef> dummy;
         remove(tx, dummy, false);
-        removeConflicts(tx, conflicts);
         ClearPrioritisation(tx.GetHash());
     }
+
+    // Whatever still spends the block's inputs conflicts with it. Those go
+    // with their descendants in one pass, so a descendant of several
+    // conflicts is only visited once.
+    std::vector<uint256> vConflicts;
+    std::set<uint256> setConflicts;
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(txin.prevout);
+            if (it == mapNextTx.end())
+                continue;
+            const uint256 hashConflict = it->second.ptx->GetHash();
+            if (setConflicts.insert(hashConflict).second)
+                vConflicts.push_back(hashConflict);
+        }
+    }
+    if (!vConflicts.empty())
+        removeStaged(vConflicts, setConflicts, conflicts, true);
+    fBlockSinceLastRollingFeeBump = true;
 }
 
 
@@ -554,8 +1060,15 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapIndex.clear();
+    setByPriority.clear();
+    setByAncestorScore.clear();
+    setByDescendantScore.clear();
+    mapSequence.clear();
     totalTxSize = 0;
+    cachedInnerUsage = 0;
     ++nTransactionsUpdated;
+    ++nTransactionsReordered;
 }
 
 void CTxMemPool::check(const CCoinsViewCache *pcoins) const
@@ -566,6 +1079,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
     LogPrint("mempool", "Checking mempool with %u transactions and %u inputs\n", (unsigned int)mapTx.size(), (unsigned int)mapNextTx.size());
 
     uint64_t checkTotal = 0;
+    uint64_t innerUsage = 0;
 
     CCoinsViewCache mempoolDuplicate(const_cast<CCoinsViewCache*>(pcoins));
 
@@ -574,6 +1088,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
     for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
         checkTotal += it->second.GetTxSize();
+        innerUsage += it->second.DynamicMemoryUsage();
         const CTransaction& tx = it->second.GetTx();
         bool fDependsWait = false;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
@@ -629,6 +1144,48 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
     }
 
     assert(totalTxSize == checkTotal);
+
+    // The secondary indexes must cover exactly mapTx, with symmetric links.
+    assert(mapIndex.size() == mapTx.size());
+    assert(setByPriority.size() == mapTx.size());
+    assert(setByAncestorScore.size() == mapTx.size());
+    assert(setByDescendantScore.size() == mapTx.size());
+    assert(mapSequence.size() == mapTx.size());
+    for (std::map<uint256, CTxMemPoolIndexEntry>::const_iterator it = mapIndex.begin(); it != mapIndex.end(); it++) {
+        const CTxMemPoolIndexEntry& index = it->second;
+        innerUsage += memusage::DynamicUsage(index.setParents) + memusage::DynamicUsage(index.setChildren);
+        assert(mapTx.count(it->first));
+        assert(setByPriority.count(std::make_pair(index.dCurrentPriority, it->first)));
+        assert(setByAncestorScore.count(std::make_pair(index.ancestorScore, it->first)));
+        assert(setByDescendantScore.count(std::make_pair(index.descendantScore, it->first)));
+        std::set<uint256> setAncestors, setDescendants;
+        CalculateAncestors(it->first, setAncestors);
+        CalculateDescendants(it->first, setDescendants);
+        int64_t nSizeWithAncestors = mapTx.find(it->first)->second.GetTxSize();
+        CAmount nModFeesWithAncestors = index.nModFee;
+        BOOST_FOREACH(const uint256& hashAncestor, setAncestors) {
+            nSizeWithAncestors += mapTx.find(hashAncestor)->second.GetTxSize();
+            nModFeesWithAncestors += mapIndex.find(hashAncestor)->second.nModFee;
+        }
+        int64_t nSizeWithDescendants = mapTx.find(it->first)->second.GetTxSize();
+        CAmount nModFeesWithDescendants = index.nModFee;
+        BOOST_FOREACH(const uint256& hashDescendant, setDescendants) {
+            nSizeWithDescendants += mapTx.find(hashDescendant)->second.GetTxSize();
+            nModFeesWithDescendants += mapIndex.find(hashDescendant)->second.nModFee;
+        }
+        assert(index.nCountWithAncestors == (int64_t)setAncestors.size() + 1);
+        assert(index.nSizeWithAncestors == nSizeWithAncestors);
+        assert(index.nModFeesWithAncestors == nModFeesWithAncestors);
+        assert(index.nCountWithDescendants == (int64_t)setDescendants.size() + 1);
+        assert(index.nSizeWithDescendants == nSizeWithDescendants);
+        assert(index.nModFeesWithDescendants == nModFeesWithDescendants);
+        assert(mapSequence.find(index.nSequence)->second == it->first);
+        BOOST_FOREACH(const uint256& hashParent, index.setParents)
+            assert(mapIndex.find(hashParent)->second.setChildren.count(it->first));
+        BOOST_FOREACH(const uint256& hashChild, index.setChildren)
+            assert(mapIndex.find(hashChild)->second.setParents.count(it->first));
+    }
+    assert(innerUsage == cachedInnerUsage);
 }
 
 void CTxMemPool::queryHashes(vector<uint256>& vtxid)
@@ -650,6 +1207,24 @@ bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
     return true;
 }
 
+bool CTxMemPool::lookupFeeRate(uint256 hash, CFeeRate& feeRate) const
+{
+    LOCK(cs);
+    map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
+    if (i == mapTx.end()) return false;
+    feeRate = CFeeRate(i->second.GetFee(), i->second.GetTxSize());
+    return true;
+}
+
+CTransactionRef CTxMemPool::get(const uint256& hash) const
+{
+    LOCK(cs);
+    map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
+    if (i == mapTx.end())
+        return CTransactionRef();
+    return i->second.GetSharedTx();
+}
+
 CFeeRate CTxMemPool::estimateFee(int nBlocks) const
 {
     LOCK(cs);
@@ -666,7 +1241,7 @@ CTxMemPool::WriteFeeEstimates(CAutoFile& fileout) const
 {
     try {
         LOCK(cs);
-        fileout << 99900; // version required to read: 0.9.99 or later
+        fileout << FEE_ESTIMATES_BUCKETED_VERSION; // version required to read
         fileout << CLIENT_VERSION; // version that wrote the file
         minerPolicyEstimator->Write(fileout);
     }
@@ -683,11 +1258,13 @@ CTxMemPool::ReadFeeEstimates(CAutoFile& filein)
     try {
         int nVersionRequired, nVersionThatWrote;
         filein >> nVersionRequired >> nVersionThatWrote;
-        if (nVersionRequired > CLIENT_VERSION)
+        if (nVersionRequired > FEE_ESTIMATES_BUCKETED_VERSION)
             return error("CTxMemPool::ReadFeeEstimates() : up-version (%d) fee estimate file", nVersionRequired);
+        if (nVersionRequired < FEE_ESTIMATES_BUCKETED_VERSION)
+            return error("CTxMemPool::ReadFeeEstimates() : old sample based fee estimate file, starting over");
 
         LOCK(cs);
-        minerPolicyEstimator->Read(filein, minRelayFee);
+        minerPolicyEstimator->Read(filein);
     }
     catch (const std::exception &) {
         LogPrintf("CTxMemPool::ReadFeeEstimates() : unable to read policy estimator data (non-fatal)");
@@ -703,6 +1280,7 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
         std::pair<double, CAmount> &deltas = mapDeltas[hash];
         deltas.first += dPriorityDelta;
         deltas.second += nFeeDelta;
+        updateModifiedFee(hash);
     }
     LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
 }
@@ -722,8 +1300,99 @@ void CTxMemPool::ClearPrioritisation(const uint256 hash)
 {
     LOCK(cs);
     mapDeltas.erase(hash);
+    updateModifiedFee(hash);
 }
 
+void CTxMemPool::updateModifiedFee(const uint256& hash)
+{
+    if (!mapTx.count(hash))
+        return;
+    CAmount nOldModFee = mapIndex[hash].nModFee;
+    removeIndexKeys(hash);
+    addIndexKeys(hash);
+    nTransactionsReordered++;
+
+    CAmount nDelta = mapIndex[hash].nModFee - nOldModFee;
+    if (nDelta == 0)
+        return;
+    std::set<uint256> setAncestors, setDescendants;
+    CalculateAncestors(hash, setAncestors);
+    CalculateDescendants(hash, setDescendants);
+    setAncestors.insert(hash);
+    setDescendants.insert(hash);
+    BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+        updateDescendantState(hashAncestor, 0, 0, nDelta);
+    BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+        updateAncestorState(hashDescendant, 0, 0, nDelta);
+}
+
+
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    return memusage::DynamicUsage(mapTx) + memusage::DynamicUsage(mapNextTx) +
+           memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapIndex) +
+           memusage::DynamicUsage(setByPriority) +
+           memusage::DynamicUsage(setByAncestorScore) + memusage::DynamicUsage(setByDescendantScore) +
+           memusage::DynamicUsage(mapSequence) + cachedInnerUsage;
+}
+
+CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const
+{
+    LOCK(cs);
+    if (!fBlockSinceLastRollingFeeBump || dRollingMinimumFeeRate == 0)
+        return CFeeRate((CAmount)dRollingMinimumFeeRate);
+
+    int64_t nTime = GetTime();
+    if (nTime > nLastRollingFeeUpdate + 10) {
+        // Decay faster the emptier the pool is
+        double dHalfLife = ROLLING_FEE_HALFLIFE;
+        size_t nUsage = DynamicMemoryUsage();
+        if (nUsage < sizelimit / 4)
+            dHalfLife /= 4;
+        else if (nUsage < sizelimit / 2)
+            dHalfLife /= 2;
+
+        dRollingMinimumFeeRate = dRollingMinimumFeeRate / pow(2.0, (nTime - nLastRollingFeeUpdate) / dHalfLife);
+        nLastRollingFeeUpdate = nTime;
+
+        if (dRollingMinimumFeeRate < (double)minRelayFee.GetFeePerK() / 2) {
+            dRollingMinimumFeeRate = 0;
+            return CFeeRate(0);
+        }
+    }
+    return std::max(CFeeRate((CAmount)dRollingMinimumFeeRate), minRelayFee);
+}
+
+void CTxMemPool::TrimToSize(size_t sizelimit)
+{
+    LOCK(cs);
+
+    unsigned int nTxnRemoved = 0;
+    CFeeRate maxFeeRateRemoved(0);
+    while (!setByDescendantScore.empty() && DynamicMemoryUsage() > sizelimit) {
+        // Evict the package with the lowest fee rate: a transaction
+        // together with everything that spends it. New transactions have to
+        // pay more than it did.
+        const uint256 hash = setByDescendantScore.begin()->second;
+        const CTxMemPoolIndexEntry& index = mapIndex[hash];
+        CFeeRate feeRate(index.nModFeesWithDescendants, (size_t)index.nSizeWithDescendants);
+        CTransactionRef ptx = mapTx[hash].GetSharedTx();
+        CFeeRate feeRateBump(feeRate.GetFeePerK() + minRelayFee.GetFeePerK());
+        if (feeRateBump.GetFeePerK() > dRollingMinimumFeeRate) {
+            dRollingMinimumFeeRate = feeRateBump.GetFeePerK();
+            fBlockSinceLastRollingFeeBump = false;
+        }
+        maxFeeRateRemoved = std::max(maxFeeRateRemoved, feeRateBump);
+
+        std::list<CTransactionRef> removed;
+        remove(*ptx, removed, true);
+        nTxnRemoved += removed.size();
+    }
+
+    if (nTxnRemoved > 0)
+        LogPrint("mempool", "Removed %u txn, rolling minimum fee bumped to %s\n", nTxnRemoved, maxFeeRateRemoved.ToString());
+}
 
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView *baseIn, CTxMemPool &mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
 
@@ -731,9 +1400,9 @@ bool CCoinsViewMemPool::GetCoins(const uint256 &txid, CCoins &coins) const {
     // If an entry in the mempool exists, always return that one, as it's guaranteed to never
     // conflict with the underlying cache, and it cannot have pruned entries (as it contains full)
     // transactions. First checking the underlying cache risks returning a pruned entry instead.
-    CTransaction tx;
-    if (mempool.lookup(txid, tx)) {
-        coins = CCoins(tx, MEMPOOL_HEIGHT);
+    CTransactionRef ptx = mempool.get(txid);
+    if (ptx) {
+        coins = CCoins(*ptx, MEMPOOL_HEIGHT);
         return true;
     }
     return (base->GetCoins(txid, coins) && !coins.IsPruned());
@@ -7,6 +7,7 @@
 #define BITBREADCRUMB_TXMEMPOOL_H
 
 #include <list>
+#include <set>
 
 #include "amount.h"
 #include "coins.h"
@@ -27,6 +28,9 @@ inline bool AllowFree(double dPriority)
     return dPriority > AllowFreeThreshold();
 }
 
+/** Half-life in seconds of the minimum fee rate raised by evicting transactions */
+static const unsigned int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
 /** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
@@ -36,10 +40,11 @@ static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 class CTxMemPoolEntry
 {
 private:
-    CTransaction tx;
+    CTransactionRef tx;
     CAmount nFee; //! Cached to avoid expensive parent-transaction lookups
     size_t nTxSize; //! ... and avoid recomputing tx size
     size_t nModSize; //! ... and modified size for priority
+    size_t nUsageSize; //! ... and total memory usage
     int64_t nTime; //! Local time when entering the mempool
     double dPriority; //! Priority when entering the mempool
     unsigned int nHeight; //! Chain height when entering the mempool
@@ -47,19 +52,56 @@ private:
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
                     int64_t _nTime, double _dPriority, unsigned int _nHeight);
+    CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
+                    int64_t _nTime, double _dPriority, unsigned int _nHeight);
     CTxMemPoolEntry();
     CTxMemPoolEntry(const CTxMemPoolEntry& other);
 
-    const CTransaction& GetTx() const { return this->tx; }
+    const CTransaction& GetTx() const { return *this->tx; }
+    CTransactionRef GetSharedTx() const { return this->tx; }
     double GetPriority(unsigned int currentHeight) const;
     CAmount GetFee() const { return nFee; }
     size_t GetTxSize() const { return nTxSize; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
 };
 
 class CMinerPolicyEstimator;
 
+/**
+ * Ordering, dependency and package data kept next to each mapTx entry, so
+ * that block assembly, package limits and eviction only have to look at
+ * the transactions involved instead of the whole pool. The package totals
+ * include the transaction itself and use fees with PrioritiseTransaction
+ * deltas applied.
+ */
+class CTxMemPoolIndexEntry
+{
+public:
+    CAmount nModFee; //! Fee including any PrioritiseTransaction delta
+    CFeeRate feeRate; //! nModFee per byte
+    double dPriority; //! Priority on entry including any PrioritiseTransaction delta
+    double dCurrentPriority; //! dPriority aged to the pool's priority height, key in setByPriority
+    uint64_t nSequence; //! Order of arrival in the pool
+    std::set<uint256> setParents; //! In-pool transactions this one spends
+    std::set<uint256> setChildren; //! In-pool transactions spending this one
+
+    int64_t nCountWithAncestors;
+    int64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+    int64_t nCountWithDescendants;
+    int64_t nSizeWithDescendants;
+    CAmount nModFeesWithDescendants;
+
+    CFeeRate ancestorScore; //! Lower of own and ancestor package fee rate, key in setByAncestorScore
+    CFeeRate descendantScore; //! Higher of own and descendant package fee rate, key in setByDescendantScore
+
+    CTxMemPoolIndexEntry() : nModFee(0), dPriority(0), dCurrentPriority(0), nSequence(0),
+        nCountWithAncestors(0), nSizeWithAncestors(0), nModFeesWithAncestors(0),
+        nCountWithDescendants(0), nSizeWithDescendants(0), nModFeesWithDescendants(0) { }
+};
+
 /** An inpoint - a combination of a transaction and an index n into its vin */
 class CInPoint
 {
@@ -92,6 +134,29 @@ private:
 
     CFeeRate minRelayFee; //! Passed to constructor to avoid dependency on main
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
+    uint64_t cachedInnerUsage; //! sum of dynamic memory usage of all the entries and their links
+    uint64_t nLastSequence; //! Sequence number handed to the last transaction added
+    unsigned int nTransactionsReordered; //! Bumped when transactions leave the pool or move in the indexes
+    unsigned int nPriorityHeight; //! Block height the keys of setByPriority are aged to
+
+    mutable int64_t nLastRollingFeeUpdate;
+    mutable bool fBlockSinceLastRollingFeeBump;
+    mutable double dRollingMinimumFeeRate; //! minimum fee to get into the pool, decreases exponentially
+
+    /** dPriority of entry, aged from its entry height to nPriorityHeight */
+    double agedPriority(const CTxMemPoolEntry& entry, double dPriority) const;
+    void addIndexKeys(const uint256& hash);
+    void removeIndexKeys(const uint256& hash);
+    void addLink(const uint256& hashParent, const uint256& hashChild);
+    void removeLink(const uint256& hashParent, const uint256& hashChild);
+    void updateAncestorState(const uint256& hash, int64_t nCount, int64_t nSize, CAmount nModFee);
+    void updateDescendantState(const uint256& hash, int64_t nCount, int64_t nSize, CAmount nModFee);
+    void recalculateAncestorState(const uint256& hash);
+    void recalculateDescendantState(const uint256& hash);
+    void updateModifiedFee(const uint256& hash);
+    /** Remove the given transactions, and with fRecursive everything spending them */
+    void removeStaged(std::vector<uint256>& vRemove, std::set<uint256>& setRemove,
+                      std::list<CTransactionRef>& removed, bool fRecursive);
 
 public:
     mutable CCriticalSection cs;
@@ -99,6 +164,13 @@ public:
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
+    /** Secondary indexes over mapTx, best transaction last */
+    std::map<uint256, CTxMemPoolIndexEntry> mapIndex;
+    std::set<std::pair<double, uint256> > setByPriority;
+    std::set<std::pair<CFeeRate, uint256> > setByAncestorScore;
+    std::set<std::pair<CFeeRate, uint256> > setByDescendantScore;
+    std::map<uint64_t, uint256> mapSequence;
+
     CTxMemPool(const CFeeRate& _minRelayFee);
     ~CTxMemPool();
 
@@ -111,17 +183,25 @@ public:
     void check(const CCoinsViewCache *pcoins) const;
     void setSanityCheck(bool _fSanityCheck) { fSanityCheck = _fSanityCheck; }
 
-    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry);
-    void remove(const CTransaction &tx, std::list<CTransaction>& removed, bool fRecursive = false);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate = true);
+    void remove(const CTransaction &tx, std::list<CTransactionRef>& removed, bool fRecursive = false);
     void removeCoinbaseSpends(const CCoinsViewCache *pcoins, unsigned int nMemPoolHeight);
-    void removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed);
+    void removeConflicts(const CTransaction &tx, std::list<CTransactionRef>& removed);
     void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
-                        std::list<CTransaction>& conflicts);
+                        std::list<CTransactionRef>& conflicts, bool fCurrentEstimate = true);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
+    uint64_t GetLastSequence() const;
+    unsigned int GetTransactionsReordered() const;
+    /**
+     * Re-key setByPriority by the priority in a block at nHeight. Coins age at
+     * different rates, so this can change the order; it only does work when
+     * the height moves.
+     */
+    void SetPriorityHeight(unsigned int nHeight);
 
     /** Affect CreateNewBlock prioritisation of transactions */
     void PrioritiseTransaction(const uint256 hash, const std::string strHash, double dPriorityDelta, const CAmount& nFeeDelta);
@@ -139,6 +219,32 @@ public:
         return totalTxSize;
     }
 
+    /** In-pool ancestors (or descendants) of an in-pool transaction, not including itself */
+    void CalculateAncestors(const uint256& hash, std::set<uint256>& setAncestors) const;
+    void CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const;
+
+    /**
+     * Check whether tx, which is not in the pool yet, would stay within the
+     * given package limits, filling setAncestors with its in-pool ancestors.
+     */
+    bool CalculateMemPoolAncestors(const CTransaction& tx, size_t nSize, std::set<uint256>& setAncestors,
+                                   uint64_t nLimitAncestorCount, uint64_t nLimitAncestorSize,
+                                   uint64_t nLimitDescendantCount, uint64_t nLimitDescendantSize,
+                                   std::string& errString) const;
+
+    /** Memory used by the pool, including the transactions and indexes */
+    size_t DynamicMemoryUsage() const;
+
+    /**
+     * The minimum fee rate to get into the pool, which may be higher than
+     * the minimum relay fee after transactions were evicted to stay below
+     * sizelimit bytes of memory. Decays back once blocks come in.
+     */
+    CFeeRate GetMinFee(size_t sizelimit) const;
+
+    /** Evict the lowest fee rate transactions and their descendants until the pool uses at most sizelimit bytes */
+    void TrimToSize(size_t sizelimit);
+
     bool exists(uint256 hash)
     {
         LOCK(cs);
@@ -146,6 +252,10 @@ public:
     }
 
     bool lookup(uint256 hash, CTransaction& result) const;
+    /** Fee rate a transaction pays (ignoring prioritisation), if it is in the pool */
+    bool lookupFeeRate(uint256 hash, CFeeRate& feeRate) const;
+    /** Shared handle to an in-pool transaction, or an empty one if it is not in the pool */
+    CTransactionRef get(const uint256& hash) const;
 
     /** Estimate fee rate needed to get into the next nBlocks */
     CFeeRate estimateFee(int nBlocks) const;
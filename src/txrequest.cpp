@@ -0,0 +1,223 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txrequest.h"
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+CTxRequestTracker::CTxRequestTracker(size_t nMaxAnnouncementsIn, size_t nMaxInFlightIn, int64_t nRequestTimeoutIn) :
+    nAnnouncements(0),
+    nSequence(0),
+    nMaxAnnouncements(nMaxAnnouncementsIn),
+    nMaxInFlight(nMaxInFlightIn),
+    nRequestTimeout(nRequestTimeoutIn)
+{
+}
+
+bool CTxRequestTracker::ReceivedInv(NodeId peer, const uint256& txhash, bool fPreferred, int64_t nReqTime)
+{
+    PeerInfo& info = mapPeers[peer];
+    if (info.setAnnounced.size() >= nMaxAnnouncements || info.setAnnounced.count(txhash))
+        return false;
+
+    Announcement ann;
+    ann.state = CANDIDATE;
+    ann.fPreferred = fPreferred;
+    ann.fParked = false;
+    ann.nTime = nReqTime;
+    ann.nSequence = nSequence++;
+    mapTxs[txhash].insert(make_pair(peer, ann));
+    info.setAnnounced.insert(txhash);
+    info.setCandidates.insert(make_pair(nReqTime, txhash));
+    nAnnouncements++;
+    return true;
+}
+
+void CTxRequestTracker::GetRequestable(NodeId peer, int64_t nNow, vector<uint256>& vRequest)
+{
+    ExpireRequests(nNow);
+
+    map<NodeId, PeerInfo>::iterator pit = mapPeers.find(peer);
+    if (pit == mapPeers.end())
+        return;
+    PeerInfo& info = pit->second;
+
+    set<pair<int64_t, uint256> >::iterator ci = info.setCandidates.begin();
+    while (ci != info.setCandidates.end() && ci->first <= nNow && info.nRequested < nMaxInFlight) {
+        const uint256 txhash = ci->second;
+        ++ci;
+
+        AnnouncementMap& anns = mapTxs[txhash];
+        Announcement& ann = anns[peer];
+        NodeId best = SelectPeer(anns, nNow);
+        if (best != peer) {
+            if (best == -1) {
+                // Another peer's request is in flight; wait for it to end
+                info.setCandidates.erase(make_pair(ann.nTime, txhash));
+                ann.fParked = true;
+            }
+            continue;
+        }
+
+        info.setCandidates.erase(make_pair(ann.nTime, txhash));
+        ann.state = REQUESTED;
+        ann.nTime = nNow + nRequestTimeout;
+        setExpiry.insert(make_pair(ann.nTime, make_pair(peer, txhash)));
+        info.nRequested++;
+        vRequest.push_back(txhash);
+    }
+}
+
+void CTxRequestTracker::ReceivedResponse(NodeId peer, const uint256& txhash)
+{
+    TxMap::iterator it = mapTxs.find(txhash);
+    if (it == mapTxs.end())
+        return;
+    AnnouncementMap::iterator ai = it->second.find(peer);
+    if (ai == it->second.end())
+        return;
+
+    if (ai->second.state == REQUESTED)
+        mapPeers[peer].fTimedOut = false;
+    SetCompleted(peer, txhash, ai->second);
+    EraseTxIfCompleted(it);
+}
+
+void CTxRequestTracker::ForgetTxHash(const uint256& txhash)
+{
+    TxMap::iterator it = mapTxs.find(txhash);
+    if (it != mapTxs.end())
+        EraseTx(it);
+}
+
+void CTxRequestTracker::DisconnectedPeer(NodeId peer)
+{
+    map<NodeId, PeerInfo>::iterator pit = mapPeers.find(peer);
+    if (pit == mapPeers.end())
+        return;
+
+    set<uint256> setAnnounced;
+    setAnnounced.swap(pit->second.setAnnounced);
+    BOOST_FOREACH(const uint256& txhash, setAnnounced) {
+        TxMap::iterator it = mapTxs.find(txhash);
+        AnnouncementMap::iterator ai = it->second.find(peer);
+        SetCompleted(peer, txhash, ai->second);
+        it->second.erase(ai);
+        nAnnouncements--;
+        if (it->second.empty())
+            mapTxs.erase(it);
+        else
+            EraseTxIfCompleted(it);
+    }
+    mapPeers.erase(pit);
+}
+
+size_t CTxRequestTracker::CountInFlight(NodeId peer) const
+{
+    map<NodeId, PeerInfo>::const_iterator pit = mapPeers.find(peer);
+    return pit == mapPeers.end() ? 0 : pit->second.nRequested;
+}
+
+size_t CTxRequestTracker::Count(NodeId peer) const
+{
+    map<NodeId, PeerInfo>::const_iterator pit = mapPeers.find(peer);
+    return pit == mapPeers.end() ? 0 : pit->second.setAnnounced.size();
+}
+
+size_t CTxRequestTracker::CountCandidates(NodeId peer) const
+{
+    map<NodeId, PeerInfo>::const_iterator pit = mapPeers.find(peer);
+    return pit == mapPeers.end() ? 0 : pit->second.setCandidates.size();
+}
+
+void CTxRequestTracker::ExpireRequests(int64_t nNow)
+{
+    while (!setExpiry.empty() && setExpiry.begin()->first <= nNow) {
+        const NodeId peer = setExpiry.begin()->second.first;
+        const uint256 txhash = setExpiry.begin()->second.second;
+        TxMap::iterator it = mapTxs.find(txhash);
+        mapPeers[peer].fTimedOut = true;
+        SetCompleted(peer, txhash, it->second[peer]);
+        EraseTxIfCompleted(it);
+    }
+}
+
+/** The peer whose announcement of a transaction should be requested now, or -1 if none */
+NodeId CTxRequestTracker::SelectPeer(const AnnouncementMap& anns, int64_t nNow) const
+{
+    NodeId best = -1;
+    const Announcement* pbest = NULL;
+    bool fBestTimedOut = false;
+    BOOST_FOREACH(const AnnouncementMap::value_type& item, anns) {
+        const Announcement& ann = item.second;
+        if (ann.state == REQUESTED)
+            return -1; // someone is already on it
+        if (ann.state != CANDIDATE || ann.nTime > nNow)
+            continue;
+        const PeerInfo& info = mapPeers.find(item.first)->second;
+        if (info.nRequested >= nMaxInFlight)
+            continue;
+
+        bool fBetter;
+        if (pbest == NULL)
+            fBetter = true;
+        else if (ann.fPreferred != pbest->fPreferred)
+            fBetter = ann.fPreferred;
+        else if (info.fTimedOut != fBestTimedOut)
+            fBetter = !info.fTimedOut;
+        else if (ann.nTime != pbest->nTime)
+            fBetter = ann.nTime < pbest->nTime;
+        else
+            fBetter = ann.nSequence < pbest->nSequence;
+        if (fBetter) {
+            best = item.first;
+            pbest = &ann;
+            fBestTimedOut = info.fTimedOut;
+        }
+    }
+    return best;
+}
+
+void CTxRequestTracker::SetCompleted(NodeId peer, const uint256& txhash, Announcement& ann)
+{
+    PeerInfo& info = mapPeers[peer];
+    if (ann.state == CANDIDATE) {
+        if (!ann.fParked)
+            info.setCandidates.erase(make_pair(ann.nTime, txhash));
+    } else if (ann.state == REQUESTED) {
+        setExpiry.erase(make_pair(ann.nTime, make_pair(peer, txhash)));
+        info.nRequested--;
+        // The parked announcements get their turn now
+        BOOST_FOREACH(AnnouncementMap::value_type& item, mapTxs[txhash]) {
+            Announcement& other = item.second;
+            if (other.state == CANDIDATE && other.fParked) {
+                other.fParked = false;
+                mapPeers[item.first].setCandidates.insert(make_pair(other.nTime, txhash));
+            }
+        }
+    }
+    ann.state = COMPLETED;
+}
+
+void CTxRequestTracker::EraseTx(TxMap::iterator it)
+{
+    for (AnnouncementMap::iterator ai = it->second.begin(); ai != it->second.end(); ++ai) {
+        SetCompleted(ai->first, it->first, ai->second);
+        mapPeers[ai->first].setAnnounced.erase(it->first);
+        nAnnouncements--;
+    }
+    mapTxs.erase(it);
+}
+
+/** Forget a transaction once none of its announcements is left to try */
+void CTxRequestTracker::EraseTxIfCompleted(TxMap::iterator it)
+{
+    BOOST_FOREACH(const AnnouncementMap::value_type& item, it->second) {
+        if (item.second.state != COMPLETED)
+            return;
+    }
+    EraseTx(it);
+}
@@ -0,0 +1,102 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITBREADCRUMB_TXREQUEST_H
+#define BITBREADCRUMB_TXREQUEST_H
+
+#include "net.h"
+#include "uint256.h"
+
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Decides which peer to fetch each announced transaction from, and when.
+ *
+ * Every inv of a transaction we don't have is recorded as an announcement: a
+ * (txhash, peer) pair that can be requested from a given time on. Only one
+ * peer at a time is asked for a transaction. Among the announcements that are
+ * due, the best one wins: a preferred peer (outbound or whitelisted) over
+ * others, then a peer whose last request didn't time out, then the earliest
+ * one. When the request times out or the peer answers notfound, the next best
+ * announcement gets its turn. Until then the other announcements are parked,
+ * so GetRequestable doesn't look at them again on every call.
+ *
+ * Announcements per peer and requests in flight per peer are capped, so
+ * memory stays bounded under inv floods and a slow peer can't hog requests.
+ *
+ * Times are in microseconds. Not thread-safe: main.cpp guards it with cs_main.
+ */
+class CTxRequestTracker
+{
+public:
+    CTxRequestTracker(size_t nMaxAnnouncementsIn, size_t nMaxInFlightIn, int64_t nRequestTimeoutIn);
+
+    //! Record that peer announced txhash, to be requested from nReqTime on. Returns false if ignored.
+    bool ReceivedInv(NodeId peer, const uint256& txhash, bool fPreferred, int64_t nReqTime);
+    //! Append the transactions to ask peer for now to vRequest, and mark them requested
+    void GetRequestable(NodeId peer, int64_t nNow, std::vector<uint256>& vRequest);
+    //! The peer sent txhash, or told us it doesn't have it
+    void ReceivedResponse(NodeId peer, const uint256& txhash);
+    //! Drop all announcements of txhash, because we have it or don't want it
+    void ForgetTxHash(const uint256& txhash);
+    //! Drop everything about peer, handing its requests to other announcers
+    void DisconnectedPeer(NodeId peer);
+
+    //! Number of requests to peer that are still awaiting an answer
+    size_t CountInFlight(NodeId peer) const;
+    //! Number of announcements by peer being tracked
+    size_t Count(NodeId peer) const;
+    //! Number of announcements by peer that GetRequestable still has to look at
+    size_t CountCandidates(NodeId peer) const;
+    //! Number of announcements being tracked in total
+    size_t Size() const { return nAnnouncements; }
+
+private:
+    enum State {
+        CANDIDATE, //!< not requested yet; nTime is when it may be
+        REQUESTED, //!< requested; nTime is when the request expires
+        COMPLETED, //!< answered or expired; kept to ignore re-announcements
+    };
+
+    struct Announcement {
+        State state;
+        bool fPreferred;
+        bool fParked; //!< CANDIDATE left out of setCandidates while another peer's request is in flight
+        int64_t nTime;
+        uint64_t nSequence; //!< arrival order, to break ties
+    };
+
+    struct PeerInfo {
+        std::set<uint256> setAnnounced;                       //!< all announcements by the peer
+        std::set<std::pair<int64_t, uint256> > setCandidates; //!< its unparked CANDIDATE ones, by nTime
+        size_t nRequested;
+        bool fTimedOut; //!< whether its last request expired unanswered
+        PeerInfo() : nRequested(0), fTimedOut(false) {}
+    };
+
+    typedef std::map<NodeId, Announcement> AnnouncementMap;
+    typedef std::map<uint256, AnnouncementMap> TxMap;
+
+    TxMap mapTxs;
+    std::map<NodeId, PeerInfo> mapPeers;
+    //! REQUESTED announcements by expiry time
+    std::set<std::pair<int64_t, std::pair<NodeId, uint256> > > setExpiry;
+    size_t nAnnouncements;
+    uint64_t nSequence;
+
+    const size_t nMaxAnnouncements;
+    const size_t nMaxInFlight;
+    const int64_t nRequestTimeout;
+
+    void ExpireRequests(int64_t nNow);
+    NodeId SelectPeer(const AnnouncementMap& anns, int64_t nNow) const;
+    void SetCompleted(NodeId peer, const uint256& txhash, Announcement& ann);
+    void EraseTx(TxMap::iterator it);
+    void EraseTxIfCompleted(TxMap::iterator it);
+};
+
+#endif // BITBREADCRUMB_TXREQUEST_H
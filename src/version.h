@@ -9,7 +9,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 70003;
+static const int PROTOCOL_VERSION = 70006;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -34,4 +34,13 @@ static const int BIP0031_VERSION = 60000;
 //! "mempool" command, enhanced "getdata" behavior starts with this version
 static const int MEMPOOL_GD_VERSION = 60002;
 
+//! "sendheaders" command and announcing blocks with headers starts with this version
+static const int SENDHEADERS_VERSION = 70004;
+
+//! "feefilter" tells peers to filter invs to you by fee starts with this version
+static const int FEEFILTER_VERSION = 70005;
+
+//! "sendcmpct" tells peers you serve compact blocks (cmpctblock, getblocktxn and blocktxn) starts with this version
+static const int COMPACTBLOCKS_VERSION = 70006;
+
 #endif // BITBREADCRUMB_VERSION_H